@@ -0,0 +1,143 @@
+#include <string.h>
+#include <math.h>
+
+#include "bitpack.h"
+
+void bit_writer_init(BitWriter* w, u8* data, u32 num_bytes)
+{
+    w->data = data;
+    w->num_bits = num_bytes*8;
+    w->bit_pos = 0;
+    w->overflow = false;
+}
+
+void bit_write_bits(BitWriter* w, const u8* src, u32 num_bits)
+{
+    if(w->bit_pos + num_bits > w->num_bits)
+    {
+        w->overflow = true;
+        return;
+    }
+
+    u8* dst = w->data + w->bit_pos / 8;
+    int shift = w->bit_pos % 8;
+    u32 bytes = (num_bits + 7) / 8;
+
+    if(shift == 0)
+    {
+        memcpy(dst, src, bytes);
+    }
+    else
+    {
+        dst[0] = (dst[0] & ((1u << shift) - 1)) | (u8)(src[0] << shift);
+
+        for(u32 i = 1; i < bytes; ++i)
+            dst[i] = (src[i-1] >> (8 - shift)) | (u8)(src[i] << shift);
+
+        if(shift + num_bits > bytes*8)
+            dst[bytes] = src[bytes-1] >> (8 - shift);
+    }
+
+    w->bit_pos += num_bits;
+}
+
+void bit_write_float(BitWriter* w, float value)
+{
+    u32 bits;
+    memcpy(&bits, &value, sizeof(u32));
+    bit_write(w, bits, 32);
+}
+
+u32 bit_writer_get_bytes(BitWriter* w)
+{
+    return (w->bit_pos + 7) / 8;
+}
+
+void bit_reader_init(BitReader* r, const u8* data, u32 num_bytes)
+{
+    r->data = data;
+    r->num_bits = num_bytes*8;
+    r->bit_pos = 0;
+    r->overflow = false;
+}
+
+float bit_read_float(BitReader* r)
+{
+    u32 bits = bit_read(r, 32);
+
+    float value;
+    memcpy(&value, &bits, sizeof(float));
+    return value;
+}
+
+int get_bits_required(u32 value)
+{
+    int bits = 0;
+    while(value)
+    {
+        bits++;
+        value >>= 1;
+    }
+    return bits;
+}
+
+void position_range_init(PositionRange* range, Vector3f min, Vector3f max, float precision)
+{
+    float mins[3] = {min.x, min.y, min.z};
+    float maxs[3] = {max.x, max.y, max.z};
+
+    range->precision = precision;
+
+    for(int i = 0; i < 3; ++i)
+    {
+        range->min[i]   = mins[i];
+        range->steps[i] = (u32)ceilf((maxs[i] - mins[i]) / precision);
+        range->bits[i]  = get_bits_required(range->steps[i]);
+    }
+}
+
+// In double, so the rounding is to the nearest step rather than off by the
+// float error of coordinates hundreds of units out
+u32 quantize_position(PositionRange* range, float value, int axis)
+{
+    double steps = round(((double)value - range->min[axis]) / range->precision);
+
+    if(steps < 0.0) return 0;
+    if(steps > range->steps[axis]) return range->steps[axis];
+    return (u32)steps;
+}
+
+float dequantize_position(PositionRange* range, u32 value, int axis)
+{
+    return (float)(range->min[axis] + value*(double)range->precision);
+}
+
+u32 quantize_angle_h(float angle, int bits)
+{
+    // wraps, so 360 lands on 0
+    double a = fmod(angle, 360.0);
+    if(a < 0.0) a += 360.0;
+
+    return (u32)round(a / 360.0 * (1 << bits)) & ((1 << bits) - 1);
+}
+
+float dequantize_angle_h(u32 value, int bits)
+{
+    return (float)(value * (360.0 / (1 << bits)));
+}
+
+u32 quantize_angle_v(float angle, int bits)
+{
+    const u32 max = (1 << bits) - 1;
+
+    double steps = round((angle + 90.0) / 180.0 * max);
+
+    if(steps < 0.0) return 0;
+    if(steps > max) return max;
+    return (u32)steps;
+}
+
+float dequantize_angle_v(u32 value, int bits)
+{
+    return (float)(value * (180.0 / ((1 << bits) - 1)) - 90.0);
+}
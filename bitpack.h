@@ -0,0 +1,111 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "util.h"
+#include "math3d.h"
+
+// Bit-packed writing and reading, LSB first, so the layout doesn't depend on
+// struct padding or host byte order. Going past the end of the buffer sets
+// overflow and writes or reads nothing.
+typedef struct
+{
+    u8* data;
+    u32 num_bits;
+    u32 bit_pos;
+    bool overflow;
+} BitWriter;
+
+typedef struct
+{
+    const u8* data;
+    u32 num_bits;
+    u32 bit_pos;
+    bool overflow;
+} BitReader;
+
+// Quantized position range, both ends have to agree on it
+typedef struct
+{
+    float min[3];
+    u32   steps[3]; // the highest quantized value on each axis
+    int   bits[3];
+    float precision; // world units per step
+} PositionRange;
+
+void bit_writer_init(BitWriter* w, u8* data, u32 num_bytes);
+void bit_write_bits(BitWriter* w, const u8* src, u32 num_bits); // num_bits from bit 0 of src, any bits after them in its last byte must be 0
+void bit_write_float(BitWriter* w, float value); // exactly, as its 32 bits
+u32  bit_writer_get_bytes(BitWriter* w);
+
+void  bit_reader_init(BitReader* r, const u8* data, u32 num_bytes);
+float bit_read_float(BitReader* r);
+
+int get_bits_required(u32 value);
+
+// Values are rounded to the nearest step and clamped to what can be represented
+void  position_range_init(PositionRange* range, Vector3f min, Vector3f max, float precision);
+u32   quantize_position(PositionRange* range, float value, int axis);
+float dequantize_position(PositionRange* range, u32 value, int axis);
+u32   quantize_angle_h(float angle, int bits); // degrees, wraps so 360 is 0
+float dequantize_angle_h(u32 value, int bits);
+u32   quantize_angle_v(float angle, int bits); // degrees, -90 to 90
+float dequantize_angle_v(u32 value, int bits);
+
+// The per-field calls, inline so encoding a snapshot isn't a call per field
+
+// overwrites bits already written
+static inline void write_bits_at(u8* data, u32 bit_pos, u32 value, int bits)
+{
+    while(bits > 0)
+    {
+        int shift = bit_pos % 8;
+        int n = MIN(8 - shift, bits);
+        u8 mask = ((1u << n) - 1) << shift;
+
+        data[bit_pos / 8] = (data[bit_pos / 8] & ~mask) | ((value << shift) & mask);
+
+        value >>= n;
+        bits -= n;
+        bit_pos += n;
+    }
+}
+
+// bits up to 32
+static inline void bit_write(BitWriter* w, u32 value, int bits)
+{
+    if(w->bit_pos + bits > w->num_bits)
+    {
+        w->overflow = true;
+        return;
+    }
+
+    write_bits_at(w->data, w->bit_pos, value, bits);
+    w->bit_pos += bits;
+}
+
+// 0 on overflow
+static inline u32 bit_read(BitReader* r, int bits)
+{
+    if(r->bit_pos + bits > r->num_bits)
+    {
+        r->overflow = true;
+        return 0;
+    }
+
+    u32 value = 0;
+    int read = 0;
+
+    while(read < bits)
+    {
+        int shift = r->bit_pos % 8;
+        int n = MIN(8 - shift, bits - read);
+
+        value |= (u32)((r->data[r->bit_pos / 8] >> shift) & ((1u << n) - 1)) << read;
+
+        read += n;
+        r->bit_pos += n;
+    }
+
+    return value;
+}
@@ -0,0 +1,548 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#endif
+
+#include "util.h"
+#include "math3d.h"
+#include "settings.h"
+#include "timer.h"
+#include "terrain.h"
+#include "socket.h"
+#include "net.h"
+#include "bitpack.h"
+#include "protocol.h"
+
+// Headless load generator for measuring what a server can take, no window or GL.
+//
+// adventure-bots [server ip] [--bots N] [--time seconds] [--rate inputs per second]
+//
+// Each bot has a socket of its own so the server sees a separate address, sends
+// input every frame like a real client and acknowledges every snapshot part it
+// receives, but only reads the parts' headers so thousands of them fit in one
+// thread.
+
+#if defined(__linux__)
+
+#define BOT_REPORT_INTERVAL 1.0    // seconds, the first one is a warm up and left out of the totals
+#define BOT_SEND_TIMES      64     // inputs remembered per bot for round trips
+#define BOT_LATENCY_STEP    0.0001 // histogram bucket width, seconds
+#define BOT_LATENCY_BUCKETS 10000  // the last bucket holds everything from 1s up
+#define BOT_TURN_RATE       3.0f   // degrees per input when heading back to the middle
+#define BOT_EDGE            0.8f   // fraction of the terrain bots wander over
+#define BOT_FIRE_CHANCE     60     // one input in this many fires
+#define BOT_INTERP_DELAY    0.05f  // what a bot claims to draw others behind by when it fires
+
+typedef struct
+{
+    int         socket;
+    u16         local_latest_packet_id;
+    ReceivedPackets received;
+
+    // synthetic input, changing every second or two
+    u16         input_sequence;
+    PlayerInput inputs[PLAYER_INPUT_REDUNDANCY];
+    int         num_inputs;
+    float       angle_h;
+    float       turn;  // degrees per input
+    u8          keys;
+    int         inputs_until_change;
+    double      input_times[BOT_SEND_TIMES];
+
+    // what came back
+    bool        has_player;
+    u16         acked_sequence;
+    Vector3f    position;
+    u32         parts_tick;
+    u32         parts_received;
+    bool        receiving; // got anything this interval
+} Bot;
+
+typedef struct
+{
+    u32    counts[BOT_LATENCY_BUCKETS];
+    u32    total;
+    double max;
+} LatencyHistogram;
+
+typedef struct
+{
+    u64 packets_sent;
+    u64 bytes_sent;
+    u64 packets_received;
+    u64 bytes_received;
+
+    u32    ticks;
+    double tick_time_total;
+    double tick_time_max;
+
+    LatencyHistogram snapshot_delay; // last part's arrival past the quickest any snapshot took
+    LatencyHistogram input_rtt;      // input sent to a snapshot showing it applied
+} BotStats;
+
+static Bot*     bots = NULL;
+static int      bots_count = 0;
+static u8       bots_recv_buffer[MAX_PACKET_DATA_SIZE];
+static BotStats bots_interval;
+static BotStats bots_total;
+static bool     bots_has_transit = false;
+static double   bots_min_transit = 0.0; // clocks differ between machines, delays are measured from this
+static bool     bots_has_tick = false;
+static u32      bots_latest_tick = 0;
+static Vector3f bots_min_bounds;
+static Vector3f bots_max_bounds;
+static Address  bots_server_address;
+
+static void latency_add(LatencyHistogram* hist, double latency)
+{
+    int bucket = (int)(latency / BOT_LATENCY_STEP);
+    bucket = MAX(0, MIN(bucket, BOT_LATENCY_BUCKETS-1));
+
+    hist->counts[bucket]++;
+    hist->total++;
+    hist->max = MAX(hist->max, latency);
+}
+
+// ms
+static double latency_percentile(LatencyHistogram* hist, double p)
+{
+    if(hist->total == 0)
+        return 0.0;
+
+    u32 target = (u32)ceil(hist->total * p);
+    u32 seen = 0;
+
+    for(int i = 0; i < BOT_LATENCY_BUCKETS; ++i)
+    {
+        seen += hist->counts[i];
+        if(seen >= MAX(target, 1))
+            return (i+1) * BOT_LATENCY_STEP * 1000.0;
+    }
+
+    return hist->max * 1000.0;
+}
+
+static void bot_stats_add(BotStats* total, BotStats* stats)
+{
+    total->packets_sent     += stats->packets_sent;
+    total->bytes_sent       += stats->bytes_sent;
+    total->packets_received += stats->packets_received;
+    total->bytes_received   += stats->bytes_received;
+
+    total->ticks           += stats->ticks;
+    total->tick_time_total += stats->tick_time_total;
+    total->tick_time_max    = MAX(total->tick_time_max, stats->tick_time_max);
+
+    LatencyHistogram* from[2] = {&stats->snapshot_delay, &stats->input_rtt};
+    LatencyHistogram* to[2]   = {&total->snapshot_delay, &total->input_rtt};
+
+    for(int h = 0; h < 2; ++h)
+    {
+        for(int i = 0; i < BOT_LATENCY_BUCKETS; ++i)
+            to[h]->counts[i] += from[h]->counts[i];
+
+        to[h]->total += from[h]->total;
+        to[h]->max = MAX(to[h]->max, from[h]->max);
+    }
+}
+
+static void bot_stats_print(BotStats* stats, double seconds, int receiving)
+{
+    double tick_avg = stats->ticks ? stats->tick_time_total / stats->ticks : 0.0;
+
+    printf("bots %d/%d | tick %.2f avg %.2f max ms | out %.0f pkt/s %.1f KB/s | in %.0f pkt/s %.1f KB/s"
+           " | snapshot +%.1f/+%.1f/+%.1f max +%.1f ms | rtt %.1f/%.1f/%.1f max %.1f ms\n",
+        receiving, bots_count,
+        tick_avg*1000.0, stats->tick_time_max*1000.0,
+        stats->packets_sent / seconds,     stats->bytes_sent / seconds / 1024.0,
+        stats->packets_received / seconds, stats->bytes_received / seconds / 1024.0,
+        latency_percentile(&stats->snapshot_delay, 0.5),
+        latency_percentile(&stats->snapshot_delay, 0.9),
+        latency_percentile(&stats->snapshot_delay, 0.99),
+        stats->snapshot_delay.max*1000.0,
+        latency_percentile(&stats->input_rtt, 0.5),
+        latency_percentile(&stats->input_rtt, 0.9),
+        latency_percentile(&stats->input_rtt, 0.99),
+        stats->input_rtt.max*1000.0);
+}
+
+static void bot_next_input(Bot* bot, PlayerInput* input)
+{
+    if(--bot->inputs_until_change <= 0)
+    {
+        bot->keys = PLAYER_KEY_W;
+        if(rand() % 4 == 0) bot->keys |= PLAYER_KEY_SHIFT;
+        if(rand() % 4 == 0) bot->keys |= (rand() % 2) ? PLAYER_KEY_A : PLAYER_KEY_D;
+
+        bot->turn = ((rand() % 201) - 100) / 100.0f;
+        bot->inputs_until_change = (int)TARGET_FPS/2 + rand() % (int)(2*TARGET_FPS);
+    }
+
+    float turn = bot->turn;
+
+    // wandered near the edge, turn until walking back towards the middle
+    Vector3f* p = &bot->position;
+    if(bot->has_player && (p->x < bots_min_bounds.x || p->x > bots_max_bounds.x || p->z < bots_min_bounds.z || p->z > bots_max_bounds.z))
+    {
+        Vector3f target, up;
+        get_view_vectors(bot->angle_h, 0.0f, &target, &up);
+
+        // W walks along -target
+        if(target.x*p->x + target.z*p->z < 0.9f*sqrtf(p->x*p->x + p->z*p->z))
+            turn = BOT_TURN_RATE;
+    }
+
+    bot->angle_h = fmodf(bot->angle_h + turn + 360.0f, 360.0f);
+
+    memset(input,0,sizeof(PlayerInput));
+    input->sequence = ++bot->input_sequence;
+    input->keys     = bot->keys | ((rand() % 120 == 0) ? PLAYER_KEY_JUMP : 0);
+    input->angle_h  = bot->angle_h;
+
+    if(rand() % BOT_FIRE_CHANCE == 0)
+    {
+        input->keys |= PLAYER_KEY_FIRE;
+        input->interp_delay = BOT_INTERP_DELAY;
+    }
+}
+
+static void bot_send_input(Bot* bot, double now)
+{
+    PlayerInput input;
+    bot_next_input(bot, &input);
+
+    bot->inputs[input.sequence % PLAYER_INPUT_REDUNDANCY] = input;
+    bot->num_inputs = MIN(bot->num_inputs+1, PLAYER_INPUT_REDUNDANCY);
+    bot->input_times[input.sequence % BOT_SEND_TIMES] = now;
+
+    Packet pkt = {
+        .header.game_id = game_id,
+        .header.packet_id = bot->local_latest_packet_id,
+        .header.type = PACKET_TYPE_INPUT,
+        .header.ack = bot->received.latest_id,
+        .header.ack_bitfield = get_ack_bit_field(&bot->received)
+    };
+
+    pkt.data_len = write_input_payload(pkt.data, bot->inputs, bot->num_inputs, input.sequence);
+
+    u8 buf[MAX_PACKET_DATA_SIZE];
+    u32 len = write_packet(buf, &pkt);
+
+    int sent_bytes = socket_sendto(bot->socket, &bots_server_address, buf, len);
+    bot->local_latest_packet_id++;
+
+    if(sent_bytes > 0)
+    {
+        bots_interval.packets_sent++;
+        bots_interval.bytes_sent += sent_bytes;
+    }
+}
+
+static void bot_handle_packet(Bot* bot, PacketView* pkt, double now)
+{
+    if(pkt->header.game_id != game_id || pkt->header.type != PACKET_TYPE_WORLD_STATE)
+        return;
+
+    BitReader r;
+    bit_reader_init(&r, pkt->data, pkt->data_len);
+
+    WorldStateHeader h;
+    if(!read_world_state_header(&r, &h))
+        return;
+
+    // acked without decoding the entries, as a client that never loses a baseline
+    update_received_packets(&bot->received, pkt->header.packet_id);
+    bot->receiving = true;
+
+    if(h.part == 0)
+    {
+        // every bot hears the same tick time, count it once
+        if(!bots_has_tick || is_tick_greater(h.tick, bots_latest_tick))
+        {
+            bots_has_tick = true;
+            bots_latest_tick = h.tick;
+            bots_interval.ticks++;
+            bots_interval.tick_time_total += h.tick_time;
+            bots_interval.tick_time_max = MAX(bots_interval.tick_time_max, h.tick_time);
+        }
+
+        if(h.has_player)
+        {
+            u16 age = bot->input_sequence - h.input_sequence;
+
+            if(bot->has_player && is_packet_id_greater(h.input_sequence, bot->acked_sequence) && age < BOT_SEND_TIMES)
+                latency_add(&bots_interval.input_rtt, now - bot->input_times[h.input_sequence % BOT_SEND_TIMES]);
+
+            if(!bot->has_player || is_packet_id_greater(h.input_sequence, bot->acked_sequence))
+            {
+                bot->has_player = true;
+                bot->acked_sequence = h.input_sequence;
+                bot->position = h.player_state.position;
+            }
+        }
+    }
+
+    if(h.tick != bot->parts_tick)
+    {
+        if(bot->parts_received != 0 && !is_tick_greater(h.tick, bot->parts_tick))
+            return; // a straggler from an older snapshot
+
+        bot->parts_tick = h.tick;
+        bot->parts_received = 0;
+    }
+
+    bot->parts_received |= (1u << h.part);
+
+    u32 all_parts = (h.num_parts >= 32) ? 0xFFFFFFFF : ((1u << h.num_parts) - 1);
+    if(bot->parts_received != all_parts)
+        return;
+
+    double transit = now - h.tick / (double)SERVER_RATE;
+
+    if(!bots_has_transit || transit < bots_min_transit)
+    {
+        bots_has_transit = true;
+        bots_min_transit = transit;
+    }
+
+    latency_add(&bots_interval.snapshot_delay, transit - bots_min_transit);
+}
+
+static void bots_recv(int epoll_fd, double timeout)
+{
+    struct epoll_event events[SOCKET_BATCH_MAX];
+
+    int n = epoll_wait(epoll_fd, events, SOCKET_BATCH_MAX, (int)(timeout*1000.0));
+
+    for(int i = 0; i < n; ++i)
+    {
+        Bot* bot = &bots[events[i].data.u32];
+
+        for(;;)
+        {
+            SocketDatagram d = {
+                .data = bots_recv_buffer,
+                .len  = sizeof(bots_recv_buffer)
+            };
+
+            if(socket_recv(bot->socket, &d) < 0)
+                break;
+
+            double now = timer_get_time();
+
+            bots_interval.packets_received++;
+            bots_interval.bytes_received += d.len;
+
+            PacketView pkt;
+            if(parse_packet(d.data, d.len, &pkt))
+                bot_handle_packet(bot, &pkt, now);
+        }
+    }
+}
+
+static bool bots_open(int num_bots, int epoll_fd)
+{
+    // a socket each, more than the usual soft limit of open files
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)num_bots + 64)
+    {
+        limit.rlim_cur = MIN(limit.rlim_max, (rlim_t)num_bots + 64);
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    bots = calloc(num_bots, sizeof(Bot));
+    if(!bots)
+    {
+        printf("Failed to allocate %d bots\n", num_bots);
+        return false;
+    }
+
+    for(int i = 0; i < num_bots; ++i)
+    {
+        Bot* bot = &bots[i];
+
+        if(!socket_create(&bot->socket))
+        {
+            printf("Only opened %d of %d bot sockets\n", i, num_bots);
+            break;
+        }
+
+        socket_set_nonblocking(bot->socket);
+        socket_set_recv_buffer_size(bot->socket, 256*1024);
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bot->socket, &ev) < 0)
+        {
+            perror("epoll_ctl");
+            socket_close(bot->socket);
+            break;
+        }
+
+        bot->angle_h = (float)(rand() % 360);
+        bots_count++;
+    }
+
+    return bots_count > 0;
+}
+
+static int bots_run(int num_bots, double duration, float input_rate)
+{
+    create_game_id();
+    bots_server_address = net_client_get_server_address();
+    srand((unsigned)time(NULL));
+
+    // bots turn back before wandering off the terrain
+    if(!terrain_load_bounds(TERRAIN_HEIGHTMAP))
+        return -1;
+
+    terrain_get_bounds(&bots_min_bounds, &bots_max_bounds);
+    bots_min_bounds.x *= BOT_EDGE; bots_min_bounds.z *= BOT_EDGE;
+    bots_max_bounds.x *= BOT_EDGE; bots_max_bounds.z *= BOT_EDGE;
+
+    int epoll_fd = epoll_create1(0);
+    if(epoll_fd < 0)
+    {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    if(!bots_open(num_bots, epoll_fd))
+        return -1;
+
+    printf("Running %d bots at %.0f inputs/s each against %u.%u.%u.%u:%u\n",
+        bots_count, input_rate, bots_server_address.a, bots_server_address.b, bots_server_address.c, bots_server_address.d, bots_server_address.port);
+
+    Timer bots_timer = {0};
+    timer_begin(&bots_timer);
+
+    double start = bots_timer.time_start;
+    double last_report = start;
+    u64 sends = 0;
+    int next_bot = 0;
+    bool warmed_up = false;
+    int receiving = 0;
+
+    for(;;)
+    {
+        double now = timer_get_time();
+
+        // spread the sends evenly over time, not a burst from every bot at once
+        u64 sends_due = (u64)((now - start) * input_rate * bots_count);
+
+        for(; sends < sends_due; ++sends)
+        {
+            bot_send_input(&bots[next_bot], now);
+            next_bot = (next_bot + 1) % bots_count;
+        }
+
+        bots_recv(epoll_fd, 0.001);
+
+        now = timer_get_time();
+
+        if(now - last_report >= BOT_REPORT_INTERVAL)
+        {
+            receiving = 0;
+            for(int i = 0; i < bots_count; ++i)
+            {
+                receiving += bots[i].receiving ? 1 : 0;
+                bots[i].receiving = false;
+            }
+
+            bot_stats_print(&bots_interval, now - last_report, receiving);
+
+            if(warmed_up)
+                bot_stats_add(&bots_total, &bots_interval);
+
+            memset(&bots_interval, 0, sizeof(BotStats));
+            last_report = now;
+            warmed_up = true;
+
+            if(duration > 0.0 && now - start >= duration)
+                break;
+        }
+    }
+
+    double measured = (last_report - start) - BOT_REPORT_INTERVAL;
+
+    if(measured > 0.0)
+    {
+        printf("\nTotal over %.0f s, warm up left out:\n", measured);
+        bot_stats_print(&bots_total, measured, receiving);
+    }
+
+    for(int i = 0; i < bots_count; ++i)
+        socket_close(bots[i].socket);
+
+    close(epoll_fd);
+    free(bots);
+
+    return 0;
+}
+
+#else
+
+static int bots_run(int num_bots, double duration, float input_rate)
+{
+    printf("Bots need epoll, they only run on Linux\n");
+    return -1;
+}
+
+#endif
+
+
+int main(int argc, char* argv[])
+{
+    int    num_bots   = 100;
+    double duration   = 30.0;
+    float  input_rate = TARGET_FPS;
+
+    net_client_set_server_ip("127.0.0.1");
+
+    for(int i = 1; i < argc; ++i)
+    {
+        if(argv[i][0] == '-' && argv[i][1] == '-')
+        {
+            if(i+1 >= argc)
+            {
+                printf("%s needs a value\n", argv[i]);
+                return 1;
+            }
+
+            // simulated clients, each on a socket of its own
+            if(strncmp(argv[i]+2,"bots",4) == 0)
+                num_bots = atoi(argv[++i]);
+
+            // seconds to run for, 0 until killed
+            else if(strncmp(argv[i]+2,"time",4) == 0)
+                duration = atof(argv[++i]);
+
+            // inputs each bot sends per second
+            else if(strncmp(argv[i]+2,"rate",4) == 0)
+                input_rate = atof(argv[++i]);
+        }
+        else
+        {
+            if(!net_client_set_server_ip(argv[i]))
+                return 1;
+        }
+    }
+
+    if(num_bots <= 0 || input_rate <= 0.0f)
+    {
+        printf("Need at least one bot sending input\n");
+        return 1;
+    }
+
+    return bots_run(num_bots, duration, input_rate) == 0 ? 0 : 1;
+}
@@ -12,12 +12,71 @@ gcc game.c \
     sky.c \
     light.c \
     terrain.c \
+    terrain_height.c \
     socket.c \
     net.c \
+    protocol.c \
+    bitpack.c \
+    metrics.c \
+    congestion.c \
+    capture.c \
+    interp.c \
+    packet_queue.c \
     timer.c \
     text.c \
     phys.c \
     sphere.c \
     menu.c \
-    -lglfw -lGLU -lGLEW -lGL -lm \
+    -lglfw -lGLU -lGLEW -lGL -lm -lpthread \
     -o adventure
+
+# headless load generator, see bots.c
+gcc bots.c \
+    net.c \
+    protocol.c \
+    bitpack.c \
+    metrics.c \
+    congestion.c \
+    capture.c \
+    socket.c \
+    timer.c \
+    packet_queue.c \
+    player.c \
+    phys.c \
+    terrain_height.c \
+    math3d.c \
+    util.c \
+    -lm -lpthread \
+    -o adventure-bots
+
+# dedicated server without GLFW or GL, see server.c
+gcc server.c \
+    net.c \
+    protocol.c \
+    bitpack.c \
+    metrics.c \
+    congestion.c \
+    capture.c \
+    socket.c \
+    timer.c \
+    packet_queue.c \
+    player.c \
+    phys.c \
+    terrain_height.c \
+    math3d.c \
+    util.c \
+    -lm -lpthread \
+    -o adventure-server
+
+# server receive path benchmark, see recv_bench.c
+gcc -O2 recv_bench.c -lpthread -o recv_bench
+
+# snapshot encoding round trip test and size benchmark, see snapshot_bench.c
+gcc -O2 snapshot_bench.c \
+    protocol.c \
+    bitpack.c \
+    terrain_height.c \
+    math3d.c \
+    util.c \
+    -lm -lpthread \
+    -o snapshot_bench
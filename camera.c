@@ -3,6 +3,7 @@
 #include <math.h>
 #include <stdbool.h>
 
+#include "util.h"
 #include "math3d.h"
 #include "settings.h"
 #include "terrain.h"
@@ -14,6 +15,7 @@
 #define MAX_CAMERA_ADJUSTMENT 0.4f
 
 Camera camera;
+Camera* view_camera = &camera;
 
 static float terrain_height;
 
@@ -21,12 +23,14 @@ static float terrain_height;
 // Prototypes
 //
 
+static void camera_follow_player();
 static void camera_update_accel();
 static void camera_update_velocity();
 static void camera_update_velocity2();
 static void camera_update_position();
 static void camera_update_perspective();
 static void camera_update_rotations();
+static void camera_turn(Camera* cam, float cursor_x, float cursor_y);
 
 //
 // Global functions
@@ -36,11 +40,11 @@ void get_camera_transform(Matrix4f* mat)
 {
     Vector3f n,u,v;
 
-    copy_v3f(&n,&camera.target);
-    copy_v3f(&u,&camera.up);
+    copy_v3f(&n,&view_camera->target);
+    copy_v3f(&u,&view_camera->up);
 
     normalize_v3f(&n);
-    cross_v3f(camera.target,u,&u);
+    cross_v3f(view_camera->target,u,&u);
     cross_v3f(n,u,&v);
 
     memset(mat,0,sizeof(Matrix4f));
@@ -106,69 +110,88 @@ void camera_init()
 
 void camera_update_angle(float cursor_x, float cursor_y)
 {
-    int delta_x = camera.cursor.x - cursor_x;
-    int delta_y = camera.cursor.y - cursor_y;
-
-    camera.cursor.x = cursor_x;
-    camera.cursor.y = cursor_y;
-
-    camera.angle_h += (float)delta_x / 16.0f;
-    camera.angle_v += (float)delta_y / 16.0f;
-
-    if(camera.angle_h > 360)
-        camera.angle_h -= 360.0f;
-    else if(camera.angle_h < 0)
-        camera.angle_h += 360.f;
-
-    if(camera.angle_v > 90)
-        camera.angle_v = 90.0f;
-    else if(camera.angle_v < -90)
-        camera.angle_v = -90.0f;
+    camera_turn(&camera, cursor_x, cursor_y);
 
    //printf("Angle: H %f, V %f\n",camera.angle_h,camera.angle_v);
 }
 
+void camera_latch_angle(Camera* cam, float cursor_x, float cursor_y)
+{
+    camera_turn(cam, cursor_x, cursor_y);
+    get_view_vectors(cam->angle_h, cam->angle_v, &cam->target, &cam->up);
+}
+
 void camera_update()
 {
+    if(camera.mode == CAMERA_MODE_FOLLOW_PLAYER)
+    {
+        // the player is moved by player_update, the camera rides along
+        camera_follow_player();
+    }
+    else
+    {
 #if 0
-    camera_update_accel();
-    camera_update_velocity();
+        camera_update_accel();
+        camera_update_velocity();
 #else
-    camera_update_velocity2();
+        camera_update_velocity2();
 #endif
 
-    camera_update_position();
+        camera_update_position();
+    }
+
     camera_update_perspective();
     camera_update_rotations();
 }
 
 void camera_move_to_player()
 {
-    camera.velocity.x = player.velocity.x;
-    camera.velocity.y = player.velocity.y;
-    camera.velocity.z = player.velocity.z;
-
-    camera.position.x = player.position.x;
-    camera.position.y = player.position.y;
-    camera.position.z = player.position.z;
-
-    camera.target.x = player.target.x;
-    camera.target.y = player.target.y;
-    camera.target.z = player.target.z;
-
-    camera.up.x = player.up.x;
-    camera.up.y = player.up.y;
-    camera.up.z = player.up.z;
+    camera_follow_player();
 
     camera.angle_h = player.angle_h;
     camera.angle_v = player.angle_v;
-}
 
+    get_view_vectors(camera.angle_h, camera.angle_v, &camera.target, &camera.up);
+}
 
 //
 // Static functions
 //
 
+// turns by how far the cursor moved since it was last seen
+static void camera_turn(Camera* cam, float cursor_x, float cursor_y)
+{
+    int delta_x = cam->cursor.x - cursor_x;
+    int delta_y = cam->cursor.y - cursor_y;
+
+    cam->cursor.x = cursor_x;
+    cam->cursor.y = cursor_y;
+
+    cam->angle_h += (float)delta_x / 16.0f;
+    cam->angle_v += (float)delta_y / 16.0f;
+
+    if(cam->angle_h > 360)
+        cam->angle_h -= 360.0f;
+    else if(cam->angle_h < 0)
+        cam->angle_h += 360.f;
+
+    if(cam->angle_v > 90)
+        cam->angle_v = 90.0f;
+    else if(cam->angle_v < -90)
+        cam->angle_v = -90.0f;
+}
+
+static void camera_follow_player()
+{
+    camera.velocity.x = player.state.velocity.x;
+    camera.velocity.y = player.state.velocity.y;
+    camera.velocity.z = player.state.velocity.z;
+
+    camera.position.x = player.state.position.x + player.correction.x;
+    camera.position.y = player.state.position.y + player.correction.y;
+    camera.position.z = player.state.position.z + player.correction.z;
+}
+
 static void get_user_force(Vector3f* user_force)
 {
     Vector3f target_dir = {0};
@@ -239,7 +262,7 @@ static void camera_update_accel()
     float coeff_friction_ground = 0.3f;
     float coeff_friction_air = 0.1f;
 
-    if(player.is_in_air)
+    if(player.state.is_in_air)
     {
         gravity.y = ACCEL_DUE_TO_GRAVITY;
 
@@ -303,41 +326,9 @@ static void camera_update_velocity()
     camera.velocity.z += camera.accel.z;
 }
 
+// Free camera flying, walking is player_move
 static void camera_update_velocity2()
 {
-
-    Vector3f norm = {0};
-
-    if(camera.mode == CAMERA_MODE_FOLLOW_PLAYER)
-    {
-        terrain_height = 0.0f;
-        terrain_get_stats(camera.position.x, camera.position.z, &terrain_height, &norm);
-
-        float margin_of_error = 0.05f;
-
-        if(camera.position.y > player.height + terrain_height)
-        {
-            // gravity
-            camera.velocity.y -= 0.02;
-            if(camera.position.y > player.height + terrain_height + margin_of_error)
-                player.is_in_air = true;
-        }
-        else
-        {
-            camera.velocity.y = 0.0f;
-            player.is_in_air = false;
-            player.jumped = false;
-        }
-    }
-    else if(camera.mode == CAMERA_MODE_FREE)
-    {
-        if(player.is_in_air)
-            player.is_in_air = false;
-    }
-
-    if(player.is_in_air)
-        return;
-
     float accel           = 0.167f; // 1 meter per second
     float max_vel         = 0.175f;
     float friction_factor = 0.008f;
@@ -348,33 +339,13 @@ static void camera_update_velocity2()
         max_vel *= 2.0f;
     }
 
-    if(camera.mode == CAMERA_MODE_FREE)
-    {
-        accel   *= 2.0f;
-        max_vel *= 2.0f;
-    }
-
+    accel   *= 2.0f;
+    max_vel *= 2.0f;
 
     Vector3f target_dir = {camera.target.x, camera.target.y, camera.target.z};
 
-    if(!player.jumped && player.key_space)
-    {
-        // jump
-        player.jumped = true;
-        camera.velocity.y += 0.4f;
-    }
-
     if(player.key_w_down)
     {
-        if(camera.mode == CAMERA_MODE_FOLLOW_PLAYER)
-        {
-            copy_v3f(&target_dir,&camera.target);
-            target_dir.y = 0.0f;
-            normalize_v3f(&target_dir);
-        }
-        else
-            copy_v3f(&target_dir,&camera.target);
-
         camera.velocity.x += -accel * target_dir.x;
         camera.velocity.y += -accel * target_dir.y;
         camera.velocity.z += -accel * target_dir.z;
@@ -382,15 +353,6 @@ static void camera_update_velocity2()
 
     if(player.key_s_down)
     {
-        if(camera.mode == CAMERA_MODE_FOLLOW_PLAYER)
-        {
-            copy_v3f(&target_dir,&camera.target);
-            target_dir.y = 0.0f;
-            normalize_v3f(&target_dir);
-        }
-        else
-            copy_v3f(&target_dir,&camera.target);
-
         camera.velocity.x += +accel * target_dir.x;
         camera.velocity.y += +accel * target_dir.y;
         camera.velocity.z += +accel * target_dir.z;
@@ -418,73 +380,23 @@ static void camera_update_velocity2()
         camera.velocity.z += +accel * right.z;
     }
 
-    // friction
-    if(camera.mode == CAMERA_MODE_FOLLOW_PLAYER)
+    // air friction
+    if(ABS(camera.velocity.x) > 0.0f || ABS(camera.velocity.y) > 0.0f || ABS(camera.velocity.z) > 0.0f)
     {
-        // handle slope
-        Vector3f dir = {camera.target.x, 0.0f, camera.target.z};
-
-        float dot = dot_product_v3f(&norm, &dir);
-        float mag_norm = magnitude_v3f(&norm);
-        float mag_targ = magnitude_v3f(&dir);
+        Vector3f friction = {-camera.velocity.x, -camera.velocity.y, -camera.velocity.z};
 
-        float angle = acos(dot/(mag_norm*mag_targ));
-        double factor = angle / PI_OVER_2;
+        normalize_v3f(&friction);
 
-        //printf("angle: %f, factor: %f\n",angle,factor);
-
-        if(factor < 10.0f)
-        {
-            //camera.velocity.x *= factor;
-            //camera.velocity.y *= factor;
-            //camera.velocity.z *= factor;
-        }
-
-        // ground friction
-        if(ABS(camera.velocity.x) > 0.0f || ABS(camera.velocity.z) > 0.0f)
-        {
-            Vector3f friction = {-camera.velocity.x, 0.0f, -camera.velocity.z};
-
-            normalize_v3f(&friction);
-            friction.x *= friction_factor;
-            friction.z *= friction_factor;
-
-            camera.velocity.x += friction.x;
-            camera.velocity.z += friction.z;
-        }
-    }
-    else
-    {
-        // air friction
-        if(ABS(camera.velocity.x) > 0.0f || ABS(camera.velocity.y) > 0.0f || ABS(camera.velocity.z) > 0.0f)
-        {
-            Vector3f friction = {-camera.velocity.x, -camera.velocity.y, -camera.velocity.z};
-
-            normalize_v3f(&friction);
-
-            friction.x *= friction_factor;
-            friction.y *= friction_factor;
-            friction.z *= friction_factor;
-
-            camera.velocity.x += friction.x;
-            camera.velocity.y += friction.y;
-            camera.velocity.z += friction.z;
-        }
+        friction.x *= friction_factor;
+        friction.y *= friction_factor;
+        friction.z *= friction_factor;
 
+        camera.velocity.x += friction.x;
+        camera.velocity.y += friction.y;
+        camera.velocity.z += friction.z;
     }
 
-    float velocity_magnitude;
-
-    if(camera.mode == CAMERA_MODE_FREE)
-    {
-        velocity_magnitude = magnitude_v3f(&camera.velocity);
-    }
-    else
-    {
-        velocity_magnitude = 
-            sqrt(camera.velocity.x*camera.velocity.x + 
-                 camera.velocity.z*camera.velocity.z);
-    }
+    float velocity_magnitude = magnitude_v3f(&camera.velocity);
 
     float margin_of_error = 0.0166f;
 
@@ -494,15 +406,13 @@ static void camera_update_velocity2()
         normalize_v3f(&camera.velocity);
 
         camera.velocity.x *= max_vel;
-        if(camera.mode == CAMERA_MODE_FREE)
-            camera.velocity.y *= max_vel;
+        camera.velocity.y *= max_vel;
         camera.velocity.z *= max_vel;
     }
     else if(ABS(velocity_magnitude) < margin_of_error)
     {
         camera.velocity.x = 0.0f;
-        if(camera.mode == CAMERA_MODE_FREE)
-            camera.velocity.y = 0.0f;
+        camera.velocity.y = 0.0f;
         camera.velocity.z = 0.0f;
     }
 }
@@ -513,12 +423,6 @@ static void camera_update_position()
     camera.position_target.y = camera.position.y + camera.velocity.y;
     camera.position_target.z = camera.position.z + camera.velocity.z;
 
-    if(camera.mode == CAMERA_MODE_FOLLOW_PLAYER)
-    {
-        if(camera.position.y < player.height + terrain_height)
-            camera.position_target.y = player.height + terrain_height;
-    }
-
     if(camera.position.x != camera.position_target.x)
         camera.position.x = camera.position_target.x;
 
@@ -559,30 +463,5 @@ static void camera_update_perspective()
 
 static void camera_update_rotations()
 {
-    const Vector3f v_axis = {0.0f, 1.0f, 0.0f};
-
-    // Rotate the view vector by the horizontal angle around the vertical axis
-    Vector3f view = {1.0f, 0.0f, 0.0f};
-    rotate_v3f(camera.angle_h, v_axis, &view);
-    normalize_v3f(&view);
-
-    // Rotate the view vector by the vertical angle around the horizontal axis
-    Vector3f h_axis = {0};
-
-    cross_v3f(v_axis, view, &h_axis);
-    normalize_v3f(&h_axis);
-    rotate_v3f(camera.angle_v, h_axis, &view);
-
-    copy_v3f(&camera.target,&view);
-    normalize_v3f(&camera.target);
-
-    normalize_v3f(&camera.target);
-
-    //printf("Target: %f %f %f\n", camera.target.x, camera.target.y, camera.target.z);
-
-    cross_v3f(camera.target,h_axis, &camera.up);
-    normalize_v3f(&camera.up);
-
-    //printf("Up: %f %f %f\n", camera.up.x, camera.up.y, camera.up.z);
-
+    get_view_vectors(camera.angle_h, camera.angle_v, &camera.target, &camera.up);
 }
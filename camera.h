@@ -41,9 +41,12 @@ typedef struct {
 } Camera;
 
 extern Camera camera;
+extern Camera* view_camera; // what frames are drawn from, the frame's own copy of camera
 
 void camera_init();
 void camera_update();
 void camera_update_angle(float cursor_x, float cursor_y);
+// Turns a frame's copy of the camera to where the cursor is now and rebuilds its view vectors
+void camera_latch_angle(Camera* cam, float cursor_x, float cursor_y);
 void get_camera_transform(Matrix4f* mat);
 void camera_move_to_player();
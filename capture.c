@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "math3d.h"
+#include "timer.h"
+#include "socket.h"
+#include "capture.h"
+
+#define CAPTURE_FILE_BUFFER (1024*1024)
+
+atomic_bool capture_running = false;
+
+static _Thread_local bool capture_recv_deferred = false;
+
+static struct
+{
+    FILE* file;
+    pthread_mutex_t lock;
+    Timer timer;
+    u64   last_us;
+} capture;
+
+static void put_u16(u8* p, u16 v) { p[0] = v; p[1] = v >> 8; }
+static void put_u32(u8* p, u32 v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+static u16  get_u16(u8* p) { return p[0] | (p[1] << 8); }
+static u32  get_u32(u8* p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24); }
+
+bool capture_start(const char* path)
+{
+    if(capture_running)
+        return true;
+
+    capture.file = fopen(path, "wb");
+    if(!capture.file)
+    {
+        printf("Failed to open capture file %s\n", path);
+        return false;
+    }
+
+    setvbuf(capture.file, NULL, _IOFBF, CAPTURE_FILE_BUFFER);
+
+    u8 header[8];
+    put_u32(header, CAPTURE_MAGIC);
+    put_u32(header+4, CAPTURE_VERSION);
+    fwrite(header, 1, sizeof(header), capture.file);
+
+    pthread_mutex_init(&capture.lock, NULL);
+    timer_begin(&capture.timer);
+    capture.last_us = 0;
+
+    printf("Capturing datagrams to %s\n", path);
+
+    capture_running = true;
+    return true;
+}
+
+void capture_stop()
+{
+    if(!capture_running)
+        return;
+
+    pthread_mutex_lock(&capture.lock);
+    capture_running = false;
+    fclose(capture.file);
+    capture.file = NULL;
+    pthread_mutex_unlock(&capture.lock);
+}
+
+// capture.lock must be held, returns the record's time delta
+static u32 capture_time_delta()
+{
+    u64 now_us = (u64)(timer_get_elapsed(&capture.timer) * 1000000.0);
+    u64 delta = (now_us > capture.last_us) ? now_us - capture.last_us : 0;
+
+    capture.last_us += delta;
+    return (u32)MIN(delta, 0xFFFFFFFF);
+}
+
+void capture_defer_recv()
+{
+    capture_recv_deferred = true;
+}
+
+void capture_datagram(CaptureType type, Address* address, u8* data, u32 len)
+{
+    if(type == CAPTURE_RECV && capture_recv_deferred)
+        return;
+
+    u8 record[13];
+    len = MIN(len, 0xFFFF);
+
+    pthread_mutex_lock(&capture.lock);
+
+    if(capture.file)
+    {
+        record[0] = type;
+        put_u32(record+1, capture_time_delta());
+        record[5] = address->a;
+        record[6] = address->b;
+        record[7] = address->c;
+        record[8] = address->d;
+        put_u16(record+9, address->port);
+        put_u16(record+11, len);
+
+        fwrite(record, 1, 13, capture.file);
+        fwrite(data, 1, len, capture.file);
+    }
+
+    pthread_mutex_unlock(&capture.lock);
+}
+
+void capture_tick(u32 tick)
+{
+    u8 record[9];
+
+    pthread_mutex_lock(&capture.lock);
+
+    if(capture.file)
+    {
+        record[0] = CAPTURE_TICK;
+        put_u32(record+1, capture_time_delta());
+        put_u32(record+5, tick);
+
+        fwrite(record, 1, 9, capture.file);
+
+        // the server is usually stopped by a signal, so at most a tick is lost
+        fflush(capture.file);
+    }
+
+    pthread_mutex_unlock(&capture.lock);
+}
+
+bool capture_open(CaptureReader* reader, const char* path)
+{
+    reader->time_us = 0;
+    reader->file = fopen(path, "rb");
+
+    if(!reader->file)
+    {
+        printf("Failed to open capture file %s\n", path);
+        return false;
+    }
+
+    u8 header[8];
+    if(fread(header, 1, sizeof(header), reader->file) != sizeof(header) || get_u32(header) != CAPTURE_MAGIC)
+    {
+        printf("%s isn't a capture file\n", path);
+        capture_close(reader);
+        return false;
+    }
+
+    if(get_u32(header+4) != CAPTURE_VERSION)
+    {
+        printf("%s is capture version %u, expected %u\n", path, get_u32(header+4), CAPTURE_VERSION);
+        capture_close(reader);
+        return false;
+    }
+
+    return true;
+}
+
+bool capture_read(CaptureReader* reader, CaptureRecord* record)
+{
+    u8 head[13];
+
+    if(fread(head, 1, 5, reader->file) != 5)
+        return false;
+
+    reader->time_us += get_u32(head+1);
+
+    record->type = head[0];
+    record->time = reader->time_us / 1000000.0;
+
+    if(record->type == CAPTURE_TICK)
+    {
+        if(fread(head+5, 1, 4, reader->file) != 4)
+            return false;
+
+        record->tick = get_u32(head+5);
+        record->len = 0;
+        return true;
+    }
+
+    if(record->type != CAPTURE_RECV && record->type != CAPTURE_SEND)
+        return false;
+
+    if(fread(head+5, 1, 8, reader->file) != 8)
+        return false;
+
+    record->address.a = head[5];
+    record->address.b = head[6];
+    record->address.c = head[7];
+    record->address.d = head[8];
+    record->address.port = get_u16(head+9);
+
+    u32 len = get_u16(head+11);
+    record->len = MIN(len, CAPTURE_MAX_DATA);
+
+    if(fread(record->data, 1, record->len, reader->file) != record->len)
+        return false;
+
+    // whatever didn't fit
+    if(len > record->len)
+        fseek(reader->file, len - record->len, SEEK_CUR);
+
+    return true;
+}
+
+void capture_close(CaptureReader* reader)
+{
+    if(reader->file)
+        fclose(reader->file);
+
+    reader->file = NULL;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdatomic.h>
+
+// Capture file: a header, then one record after another, little endian.
+//   header:   magic u32, version u32
+//   record:   type u8, microseconds since the previous record u32, then
+//   datagram: address a.b.c.d u8 x4, port u16, len u16, data
+//   tick:     tick u32
+#define CAPTURE_MAGIC    0x50414341 // "ACAP"
+#define CAPTURE_VERSION  1
+#define CAPTURE_MAX_DATA 2048 // longer datagrams are cut short when read back
+
+typedef enum
+{
+    CAPTURE_RECV,
+    CAPTURE_SEND,
+    CAPTURE_TICK, // the server starting a tick, so a replay runs them between the same datagrams
+} CaptureType;
+
+typedef struct
+{
+    CaptureType type;
+    double      time; // seconds since the capture started
+    Address     address;
+    u32         tick;
+    u32         len;
+    u8          data[CAPTURE_MAX_DATA];
+} CaptureRecord;
+
+typedef struct
+{
+    FILE* file;
+    u64   time_us;
+} CaptureReader;
+
+extern atomic_bool capture_running;
+
+// Records every datagram through socket.c from now on, from any thread
+bool capture_start(const char* path);
+void capture_stop();
+void capture_datagram(CaptureType type, Address* address, u8* data, u32 len);
+
+// Skips what this thread receives, for a thread that hands datagrams to
+// another to apply. That thread records them with capture_datagram as it
+// applies them, so they land between the same ticks in the capture as they
+// did on the server.
+void capture_defer_recv();
+void capture_tick(u32 tick);
+
+bool capture_open(CaptureReader* reader, const char* path);
+bool capture_read(CaptureReader* reader, CaptureRecord* record); // false at the end or on a damaged record
+void capture_close(CaptureReader* reader);
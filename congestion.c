@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "util.h"
+#include "math3d.h"
+#include "congestion.h"
+
+#define CONGESTION_RTT_SMOOTHING    0.125 // weight of each new sample, RFC 6298's alpha and beta
+#define CONGESTION_RTTVAR_SMOOTHING 0.25
+#define CONGESTION_MIN_RTT_WINDOW   10.0  // seconds a minimum is trusted before a new sample replaces it
+#define CONGESTION_MAX_RTT          1.0f  // acks later than this never come
+#define CONGESTION_ACK_DELAY        0.05f // the client acks with its next input, allow for it holding one back
+
+#define CONGESTION_LOSS_SMOOTHING 0.03125 // per packet, so about the last 32
+#define CONGESTION_RATE_INTERVAL  0.5     // seconds each bandwidth sample covers
+
+// A link is congested when this much is lost, or when round trips run this far
+// above the minimum: packets are sitting in a queue somewhere.
+#define CONGESTION_LOSS_BAD        0.1f
+#define CONGESTION_QUEUE_DELAY_BAD 0.1f
+
+#define CONGESTION_BACKOFF_HOLD    1.0  // seconds between slowing down, for the loss estimate to catch up
+#define CONGESTION_RECOVER_MIN     1.0f // seconds clear before speeding up a step
+#define CONGESTION_RECOVER_MAX     60.0f
+#define CONGESTION_RECOVER_PROBE   10.0 // congested this soon after speeding up doubles recover_time, clear this long halves it
+
+void congestion_init(CongestionState* cs, double now)
+{
+    *cs = (CongestionState){0};
+
+    cs->send_interval  = 1;
+    cs->interval_start = now;
+    cs->last_change    = now;
+    cs->recover_time   = CONGESTION_RECOVER_MIN;
+}
+
+void congestion_on_sent(CongestionState* cs, u32 bytes)
+{
+    cs->interval_sent += bytes;
+}
+
+void congestion_on_acked(CongestionState* cs, u32 bytes)
+{
+    cs->interval_acked += bytes;
+    cs->loss -= cs->loss * CONGESTION_LOSS_SMOOTHING;
+}
+
+void congestion_on_lost(CongestionState* cs)
+{
+    cs->loss += (1.0f - cs->loss) * CONGESTION_LOSS_SMOOTHING;
+}
+
+void congestion_on_rtt(CongestionState* cs, float rtt, double now)
+{
+    if(cs->srtt == 0.0f)
+    {
+        cs->srtt   = rtt;
+        cs->rttvar = rtt / 2.0f;
+    }
+    else
+    {
+        cs->rttvar += (fabsf(cs->srtt - rtt) - cs->rttvar) * CONGESTION_RTTVAR_SMOOTHING;
+        cs->srtt   += (rtt - cs->srtt) * CONGESTION_RTT_SMOOTHING;
+    }
+
+    if(cs->min_rtt == 0.0f || rtt <= cs->min_rtt || now - cs->min_rtt_time > CONGESTION_MIN_RTT_WINDOW)
+    {
+        cs->min_rtt = rtt;
+        cs->min_rtt_time = now;
+    }
+}
+
+float congestion_loss_timeout(CongestionState* cs)
+{
+    if(cs->srtt == 0.0f)
+        return CONGESTION_MAX_RTT;
+
+    return MIN(cs->srtt + 4.0f*cs->rttvar + CONGESTION_ACK_DELAY, CONGESTION_MAX_RTT);
+}
+
+void congestion_update(CongestionState* cs, double now)
+{
+    double elapsed = now - cs->interval_start;
+
+    if(elapsed >= CONGESTION_RATE_INTERVAL)
+    {
+        float acked_rate = (float)(cs->interval_acked / elapsed);
+
+        cs->bandwidth = MAX(acked_rate, cs->prev_acked_rate);
+        cs->send_rate = (float)(cs->interval_sent / elapsed);
+        cs->prev_acked_rate = acked_rate;
+
+        cs->interval_acked = 0;
+        cs->interval_sent  = 0;
+        cs->interval_start = now;
+    }
+
+    cs->congested = (cs->loss > CONGESTION_LOSS_BAD) || (cs->srtt - cs->min_rtt > CONGESTION_QUEUE_DELAY_BAD);
+
+    double since_change = now - cs->last_change;
+
+    if(cs->congested)
+    {
+        if(since_change < CONGESTION_BACKOFF_HOLD || cs->send_interval >= CONGESTION_MAX_SEND_INTERVAL)
+            return;
+
+        // went bad again right after speeding up, so hold off longer before the next try
+        if(cs->last_change_up && since_change < CONGESTION_RECOVER_PROBE)
+            cs->recover_time = MIN(cs->recover_time*2.0f, CONGESTION_RECOVER_MAX);
+
+        cs->send_interval = MIN(cs->send_interval*2, CONGESTION_MAX_SEND_INTERVAL);
+        cs->last_change_up = false;
+        cs->last_change = now;
+    }
+    else if(cs->send_interval > 1)
+    {
+        if(since_change < cs->recover_time)
+            return;
+
+        cs->send_interval--;
+        cs->last_change_up = true;
+        cs->last_change = now;
+    }
+    else if(since_change >= CONGESTION_RECOVER_PROBE && cs->recover_time > CONGESTION_RECOVER_MIN)
+    {
+        // been fine at full rate for a while
+        cs->recover_time = MAX(cs->recover_time/2.0f, CONGESTION_RECOVER_MIN);
+        cs->last_change = now;
+    }
+}
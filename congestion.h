@@ -0,0 +1,48 @@
+#pragma once
+
+#define CONGESTION_MAX_SEND_INTERVAL 4 // ticks between snapshots at the slowest, 7.5 a second
+
+// What the server knows about the path to one client, from the acks of the
+// snapshots it sent, and how often it should send snapshots down it.
+typedef struct
+{
+    // round trip, as RFC 6298
+    float  srtt;
+    float  rttvar;
+    float  min_rtt;       // lowest sample lately, the path without any queueing
+    double min_rtt_time;
+
+    float loss; // smoothed fraction of snapshot packets that were never acked
+
+    // bytes a second
+    float  bandwidth;  // acked, the most over the last two intervals: what the path has carried
+    float  send_rate;  // sent, over the last interval
+    u32    interval_acked;
+    u32    interval_sent;
+    float  prev_acked_rate;
+    double interval_start;
+
+    // snapshots go out every send_interval ticks, backing off while the link
+    // is congested and speeding back up once it has stayed clear for a while
+    u8     send_interval;
+    bool   congested;
+    bool   last_change_up; // the last change sped up
+    double last_change;
+    float  recover_time;   // how long the link has to stay clear before speeding up
+} CongestionState;
+
+void congestion_init(CongestionState* cs, double now);
+
+void congestion_on_sent(CongestionState* cs, u32 bytes);
+
+// Every packet sent ends up either acked or lost, once: an ack that comes in
+// after its packet was given up on is only an RTT sample.
+void congestion_on_acked(CongestionState* cs, u32 bytes);
+void congestion_on_lost(CongestionState* cs);
+void congestion_on_rtt(CongestionState* cs, float rtt, double now);
+
+// Seconds a packet may go unacked before it's counted as lost
+float congestion_loss_timeout(CongestionState* cs);
+
+// Once a tick, rolls the rate intervals over and adjusts send_interval
+void congestion_update(CongestionState* cs, double now);
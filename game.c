@@ -5,10 +5,14 @@
 #include <math.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
+#include "util.h"
 #include "settings.h"
 #include "window.h"
 #include "shader.h"
@@ -21,7 +25,11 @@
 #include "mesh.h"
 #include "sky.h"
 #include "terrain.h"
+#include "socket.h"
 #include "net.h"
+#include "metrics.h"
+#include "capture.h"
+#include "interp.h"
 #include "text.h"
 #include "timer.h"
 #include "phys.h"
@@ -33,36 +41,117 @@
 // =========================
 
 Timer game_timer = {0};
+TimerStats frame_stats = {0}; // game_timer's over the last second, for the hud
+
+// The simulation steps at TARGET_FPS whatever the frame rate, as many times a
+// frame as the time that went by needs. Frames draw in between the last two steps.
+#define SIM_MAX_STEPS 5 // per frame, a longer stall is dropped rather than caught up
+
+float render_fps = TARGET_FPS; // frames are capped at this, 0 for uncapped
+bool  vsync = false;           // let the display pace frames instead
+bool  pipelined = false;       // simulate on a thread of its own while the last frame is drawn
+
+// Mouse look is read again right before drawing rather than from the poll at
+// the start of the frame, so simulating in between doesn't delay it.
+bool late_latch = true;
+bool measure_latency = false; // print how long input took to reach the screen
+
+double input_time = 0.0; // of the last glfwPollEvents, what the next frame prepared reacts to
+
+// input to glfwSwapBuffers returning, each frame
+static struct
+{
+    MetricsHistogram input; // keys and the mouse as polled
+    MetricsHistogram look;  // the view as drawn, late-latched or polled
+    double start;
+} latency;
+
+double sim_accumulator = 0.0; // real time not simulated yet, less than a step
+double sim_time_last = 0.0;
+u32    sim_dropped_steps = 0;
 
 int is_title_screen = true;
 bool client_connected = false;
 bool is_client = false;
-
-typedef struct
-{
-    Vector3f position;
-    float angle_h;
-    float angle_v;
-    float time_received;
-} PlayerDataPoint;
+int server_workers = 0;
 
 typedef struct
 {
     char player_name[16];
-    PlayerDataPoint prior;
-    PlayerDataPoint current;
-    
-    double delta_time;
-    double time_since_last_packet;
-    Vector3f guessed_velocity;
-    float guessed_angle_h_vel;
-    float guessed_angle_v_vel;
+    InterpBuffer history;
+    InterpSample current; // where it's drawn this frame
+    bool held;            // left out of the newest snapshot: unchanged or waiting its turn, so don't guess where it went
     bool highlighted;
+    bool active;
 } PlayerInfo;
 
-PlayerInfo player_info[MAX_CLIENTS] = {0};
+PlayerInfo player_info[MAX_CLIENTS] = {0}; // indexed by server client id
 int num_other_players = 0;
 
+#define HIT_DISPLAY_TIME 1.0f // seconds a confirmed hit stays on screen
+
+static u8    last_hits = 0;
+static u16   last_hit_id = 0;
+static float hit_display_time = 0.0f;
+
+InterpClock interp_clock = {0}; // other players are drawn interp_clock.delay behind the server
+
+// Where things are drawn from, kept for the last two simulation steps
+typedef struct
+{
+    Vector3f camera_position;
+    Vector3f player_offset;
+    Vector3f player_position;
+} ViewState;
+
+ViewState view_prev = {0};
+ViewState view_curr = {0};
+
+#define HUD_MAX_TEXTS 16
+
+typedef struct
+{
+    float    x;
+    float    y;
+    Vector3f color;
+    char     text[64];
+} HudText;
+
+// Everything render_frame draws, so it never reads what the simulation is changing
+typedef struct
+{
+    bool title_screen;
+
+    Camera   camera;
+    bool     show_player; // third person or a free camera
+    Vector3f player_position;
+    float    player_angle_h;
+    float    player_angle_v;
+
+    int          num_players;
+    InterpSample players[MAX_CLIENTS];
+
+    int     num_texts;
+    HudText texts[HUD_MAX_TEXTS];
+
+    double input_time; // when the input it reacts to was polled
+    double look_time;  // when camera's angles were, later if late-latched
+} RenderSnapshot;
+
+// The simulation thread prepares one snapshot while the main thread draws the
+// other, they swap once both are done
+static struct
+{
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    bool busy; // the simulation thread has a frame to prepare
+    bool quit;
+    int  front; // the snapshot being drawn
+
+    RenderSnapshot snapshots[2];
+} pipeline;
+
 Mesh rat = {0};
 Mesh cheese = {0};
 Mesh sword = {0};
@@ -78,7 +167,14 @@ void start_game();
 void init();
 void deinit();
 void simulate();
-void render();
+void get_view_state(ViewState* view);
+float advance_simulation();
+void prepare_frame(float alpha, RenderSnapshot* rs);
+void render_frame(RenderSnapshot* rs);
+static void* simulation_run(void* arg);
+static void simulation_wait();
+static void simulation_signal(bool quit);
+static void record_latency(RenderSnapshot* rs);
 
 // =========================
 // Main Loop
@@ -88,6 +184,15 @@ int main(int argc, char* argv[])
 {
     bool is_server = false;
 
+    // network conditions simulated on what this end sends, pass them to both ends for both directions
+    bool simulate_network = false;
+    SocketConditions conditions = {.seed = 1};
+
+    char* metrics_path = NULL;
+    char* capture_path = NULL;
+    char* replay_path = NULL;
+    bool replay_realtime = false;
+
     if(argc > 1)
     {
         for(int i = 1; i < argc; ++i)
@@ -98,17 +203,98 @@ int main(int argc, char* argv[])
                 if(strncmp(argv[i]+2,"server",6) == 0)
                     is_server = true;
 
+                // server receive workers, one per core unless a count follows
+                else if(strncmp(argv[i]+2,"workers",7) == 0)
+                {
+                    server_workers = SERVER_WORKERS_PER_CORE;
+
+                    if(i+1 < argc && argv[i+1][0] >= '0' && argv[i+1][0] <= '9')
+                        server_workers = atoi(argv[++i]);
+                }
+
+                // server telemetry as JSON lines, to a file or unix:/path
+                else if(i+1 < argc && strncmp(argv[i]+2,"metrics",7) == 0)
+                    metrics_path = argv[++i];
+
+                // every datagram sent and received, to a capture file
+                else if(i+1 < argc && strncmp(argv[i]+2,"capture",7) == 0)
+                    capture_path = argv[++i];
+
+                // run the server off a capture, as fast as possible unless --realtime
+                else if(i+1 < argc && strncmp(argv[i]+2,"replay",6) == 0)
+                    replay_path = argv[++i];
+                else if(strncmp(argv[i]+2,"realtime",8) == 0)
+                    replay_realtime = true;
+
                 // client
                 else if(strncmp(argv[i]+2,"client",6) == 0)
                     is_client = true;
+
+                // frame rate cap, 0 for none, or vsync
+                else if(i+1 < argc && strncmp(argv[i]+2,"fps",3) == 0)
+                    render_fps = atof(argv[++i]);
+                else if(strncmp(argv[i]+2,"vsync",5) == 0)
+                    vsync = true;
+                else if(strncmp(argv[i]+2,"pipelined",9) == 0)
+                    pipelined = true;
+
+                // input latency: read mouse look again right before drawing, and report input to swap times
+                else if(strncmp(argv[i]+2,"no-late-latch",13) == 0)
+                    late_latch = false;
+                else if(strncmp(argv[i]+2,"measure-latency",15) == 0)
+                    measure_latency = true;
+
+                // simulated network: --latency ms --jitter ms --loss % --duplicate % --reorder % --seed n
+                else if(i+1 < argc && strncmp(argv[i]+2,"latency",7) == 0)
+                {
+                    conditions.latency = atof(argv[++i]);
+                    simulate_network = true;
+                }
+                else if(i+1 < argc && strncmp(argv[i]+2,"jitter",6) == 0)
+                {
+                    conditions.jitter = atof(argv[++i]);
+                    simulate_network = true;
+                }
+                else if(i+1 < argc && strncmp(argv[i]+2,"loss",4) == 0)
+                {
+                    conditions.loss = atof(argv[++i]);
+                    simulate_network = true;
+                }
+                else if(i+1 < argc && strncmp(argv[i]+2,"duplicate",9) == 0)
+                {
+                    conditions.duplicate = atof(argv[++i]);
+                    simulate_network = true;
+                }
+                else if(i+1 < argc && strncmp(argv[i]+2,"reorder",7) == 0)
+                {
+                    conditions.reorder = atof(argv[++i]);
+                    simulate_network = true;
+                }
+                else if(i+1 < argc && strncmp(argv[i]+2,"seed",4) == 0)
+                {
+                    conditions.seed = (u32)strtoul(argv[++i], NULL, 10);
+                }
             }
             else
             {
-                net_client_set_server_ip(argv[i]);
+                if(!net_client_set_server_ip(argv[i]))
+                    return 1;
             }
         }
     }
 
+    if(simulate_network && !socket_simulate_conditions(&conditions))
+        return 1;
+
+    if(is_server && metrics_path && !metrics_start(metrics_path))
+        return 1;
+
+    if(replay_path)
+        return net_server_replay(replay_path, replay_realtime) == 0 ? 0 : 1;
+
+    if(capture_path && !capture_start(capture_path))
+        return 1;
+
     if(is_server)
         start_server();
     else
@@ -121,30 +307,104 @@ int main(int argc, char* argv[])
 // Functions
 // =========================
 
+static void on_stop_signal(int sig)
+{
+    (void)sig;
+    net_server_stop();
+}
+
 void start_server()
 {
-    net_server_start();
+    // Ctrl-C or a kill stops the server after the current tick, so the
+    // metrics and capture are flushed and closed
+    signal(SIGINT, on_stop_signal);
+    signal(SIGTERM, on_stop_signal);
+
+    net_server_start(server_workers);
+
+    metrics_stop();
+    capture_stop();
+    socket_simulate_stop();
 }
 
 void start_game()
 {
     init();
 
-    timer_set_fps(&game_timer,TARGET_FPS);
+    glfwSwapInterval(vsync ? 1 : 0);
+
+    bool capped = (render_fps > 0.0f && !vsync);
+
+    timer_set_fps(&game_timer,capped ? render_fps : TARGET_FPS);
     timer_begin(&game_timer);
 
+    sim_time_last = timer_get_time();
+    input_time = sim_time_last;
+
+    if(pipelined)
+    {
+        // the first frame drawn
+        prepare_frame(advance_simulation(), &pipeline.snapshots[1]);
+
+        pthread_mutex_init(&pipeline.lock, NULL);
+        pthread_cond_init(&pipeline.cond, NULL);
+
+        if(pthread_create(&pipeline.thread, NULL, simulation_run, NULL) != 0)
+        {
+            perror("Failed to start the simulation thread");
+            pipelined = false;
+        }
+    }
+
     // main game loop
     for(;;)
     {
+        // the simulation thread is idle here, so input callbacks can change what it reads
         glfwPollEvents();
+        input_time = timer_get_time();
+
         if(glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS || glfwWindowShouldClose(window) != 0)
             break;
 
-        simulate();
-        render();
+        if(pipelined)
+        {
+            // draw what it prepared last time while it simulates the next frame
+            pipeline.front ^= 1;
+            simulation_signal(false);
+
+            render_frame(&pipeline.snapshots[pipeline.front]);
+
+            simulation_wait();
+        }
+        else
+        {
+            RenderSnapshot* rs = &pipeline.snapshots[0];
+
+            prepare_frame(advance_simulation(), rs);
+            render_frame(rs);
+        }
+
+        if(capped)
+        {
+            timer_wait_for_frame(&game_timer);
+            timer_inc_frame(&game_timer);
+        }
+        else
+        {
+            timer_start_frame(&game_timer);
+        }
+
+        if(game_timer.stats.interval_total >= 1.0)
+        {
+            frame_stats = game_timer.stats;
+            timer_reset_stats(&game_timer);
+        }
+    }
 
-        timer_wait_for_frame(&game_timer);
-        timer_inc_frame(&game_timer);
+    if(pipelined)
+    {
+        simulation_signal(true);
+        pthread_join(pipeline.thread, NULL);
     }
 
     deinit();
@@ -256,10 +516,13 @@ void init()
     mesh_build(&sword, "models/broadsword.stl");
 
     printf("Building terrain.\n");
-    terrain_build("textures/heightmap5.png");
+    terrain_build(TERRAIN_HEIGHTMAP);
 
     player_init();
     camera_init();
+
+    get_view_state(&view_curr);
+    view_prev = view_curr;
     transform_world_init();
     light_init();
     sky_init();
@@ -274,6 +537,8 @@ void deinit()
     shader_deinit();
     if(is_client)
         net_client_deinit();
+    socket_simulate_stop();
+    capture_stop();
     window_deinit();
 }
 
@@ -284,217 +549,391 @@ void simulate()
 
     world.time += TARGET_SPF;
 
+    if(hit_display_time > 0.0f)
+        hit_display_time -= TARGET_SPF;
+
     //printf("\ntime: %f\n",world.time);
-    camera_update();
-    player_update();
 
-    Vector3f dir;
-    copy_v3f(&dir, &sunlight.direction);
-    normalize_v3f(&dir);
+    PlayerInput input;
+    player_get_input(&input, camera.angle_h, camera.angle_v);
 
-    shader_set_float(program, "dl.diffuse_intensity", sunlight.base.diffuse_intensity);
-    shader_set_vec3(program, "dl.direction", dir.x, dir.y, dir.z);
+    if(camera.mode != CAMERA_MODE_FOLLOW_PLAYER)
+    {
+        // the camera is flying around on its own, the player stands still
+        input.keys = 0;
+        input.angle_h = player.angle_h;
+        input.angle_v = player.angle_v;
+    }
+
+    ClientSnapshot* snapshot = NULL;
 
     if(is_client)
     {
-        ClientData p =
-        {
-            {
-                player.position.x,
-                player.position.y,
-                player.position.z
-            },
-            player.angle_h,
-            player.angle_v,
-            5.0f,
-        };
-
-        int bytes_sent = net_client_send((u8*)&p,sizeof(ClientData));
-
-        // read from server
-        for(;;)
+        // the server rewinds shots by this much, to where we saw everyone
+        input.interp_delay = interp_clock.delay;
+        net_client_send_input(&input);
+
+        // newest snapshot the network thread has received, if any
+        snapshot = net_client_get_snapshot();
+
+        // take where the server has us and replay what it hasn't run yet
+        if(snapshot && snapshot->has_player_state)
+            player_reconcile(snapshot->input_sequence, &snapshot->player_state);
+    }
+
+    // a prediction when connected, the real thing in a local game
+    player_update(&input);
+    camera_update();
+
+    view_prev = view_curr;
+    get_view_state(&view_curr);
+
+    if(is_client)
+    {
+        if(snapshot)
         {
-            bool data_waiting = net_client_data_waiting();
+            WorldState* ws = &snapshot->state;
 
-            if(!data_waiting)
-                break;
+            interp_clock_add_snapshot(&interp_clock, ws->tick, snapshot->time_received);
 
-            Packet srvpkt = {0};
-            bool is_latest;
-            int recv_bytes = net_client_recv(&srvpkt, &is_latest);
+            if(snapshot->hits != last_hits)
+            {
+                last_hits = snapshot->hits;
+                last_hit_id = snapshot->last_hit_id;
+                hit_display_time = HIT_DISPLAY_TIME;
+            }
 
-            if(!is_latest)
-                continue;
+            num_other_players = ws->num_clients - 1;
 
-            if(recv_bytes > 0)
+            for(int i = 0; i < MAX_CLIENTS; ++i)
             {
-                WorldState* ws = (WorldState*)srvpkt.data;
-                num_other_players = ws->num_clients - 1;
+                PlayerInfo* info = &player_info[i];
 
-                printf("Num Other Players: %d.\n",ws->num_clients - 1);
+                bool present = (ws->present[i / 64] >> (i % 64)) & 1;
+
+                if(!present || i == ws->ignore_id)
+                {
+                    info->active = false;
+                    continue;
+                }
 
-                int player_index = 0;
-                for(int i = 0; i < ws->num_clients; ++i)
+                if(!info->active)
                 {
-                    if(i == ws->ignore_id)
-                        continue;
+                    interp_buffer_clear(&info->history);
+                    info->active = true;
+                }
+
+                //strncpy(info->player_name,ws->client_data[i].name,16);
+
+                InterpSample sample = {
+                    .time     = snapshot->value_tick[i] / (double)SERVER_RATE,
+                    .position = ws->client_data[i].position,
+                    .angle_h  = ws->client_data[i].angle_h,
+                    .angle_v  = ws->client_data[i].angle_v
+                };
+
+                interp_buffer_add(&info->history, &sample);
+                info->held = (snapshot->value_tick[i] != ws->tick);
+            }
+        }
+    }
+}
+
+void get_view_state(ViewState* view)
+{
+    view->camera_position = camera.position;
+    view->player_offset   = camera.player_offset;
+    view->player_position = player.state.position;
+}
+
+static void lerp_v3f(Vector3f* a, Vector3f* b, float t, Vector3f* out)
+{
+    out->x = a->x + (b->x - a->x)*t;
+    out->y = a->y + (b->y - a->y)*t;
+    out->z = a->z + (b->z - a->z)*t;
+}
+
+static void hud_print(RenderSnapshot* rs, float x, float y, float r, float g, float b, const char* fmt, ...)
+{
+    if(rs->num_texts >= HUD_MAX_TEXTS)
+        return;
+
+    HudText* t = &rs->texts[rs->num_texts++];
+    t->x = x;
+    t->y = y;
+    t->color.x = r; t->color.y = g; t->color.z = b;
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(t->text, sizeof(t->text), fmt, args);
+    va_end(args);
+}
+
+// Runs the fixed simulation steps for the real time that went by since the
+// last call, returns how far the frame is into the next one
+float advance_simulation()
+{
+    double now = timer_get_time();
+    sim_accumulator += now - sim_time_last;
+    sim_time_last = now;
+
+    for(int steps = 0; sim_accumulator >= TARGET_SPF; ++steps)
+    {
+        if(steps == SIM_MAX_STEPS)
+        {
+            sim_dropped_steps += (u32)(sim_accumulator / TARGET_SPF);
+            sim_accumulator = fmod(sim_accumulator, TARGET_SPF);
+            break;
+        }
 
-                    // copy current point to prior
-                    memcpy(&player_info[player_index].prior, &player_info[player_index].current,sizeof(PlayerDataPoint));
+        simulate();
+        sim_accumulator -= TARGET_SPF;
+    }
 
-                    PlayerDataPoint* c = &player_info[player_index].current;
-                    PlayerDataPoint* p = &player_info[player_index].prior;
+    return (float)(sim_accumulator / TARGET_SPF);
+}
 
-                    c->time_received = timer_get_time();
-                    c->position.x    = ws->client_data[i].position.x;
-                    c->position.y    = ws->client_data[i].position.y;
-                    c->position.z    = ws->client_data[i].position.z;
-                    c->angle_h       = ws->client_data[i].angle_h;
-                    c->angle_v       = ws->client_data[i].angle_v;
+// Everything the frame draws: the camera alpha of the way from the previous
+// simulation step to the last, everyone else where they are at this moment,
+// and the hud
+void prepare_frame(float alpha, RenderSnapshot* rs)
+{
+    rs->title_screen = is_title_screen;
+    rs->num_players = 0;
+    rs->num_texts = 0;
 
-                    //strncpy(player_info[player_index].player_name,ws->client_data[i].name,16);
+    rs->input_time = input_time;
+    rs->look_time  = input_time;
 
-                    player_info[player_index].time_since_last_packet = 0.0f;
+    if(is_title_screen)
+        return;
 
-                    // calculate 
-                    player_info[player_index].delta_time = 
-                        c->time_received - p->time_received;
+    ViewState view;
+    lerp_v3f(&view_prev.camera_position, &view_curr.camera_position, alpha, &view.camera_position);
+    lerp_v3f(&view_prev.player_offset,   &view_curr.player_offset,   alpha, &view.player_offset);
+    lerp_v3f(&view_prev.player_position, &view_curr.player_position, alpha, &view.player_position);
 
-                    player_info[player_index].guessed_velocity.x = 
-                        (c->position.x - p->position.x) / player_info[player_index].delta_time;
+    Camera* cam = &rs->camera;
 
-                    player_info[player_index].guessed_velocity.y = 
-                        (c->position.y - p->position.y) / player_info[player_index].delta_time;
+    *cam = camera;
+    cam->position      = view.camera_position;
+    cam->player_offset = view.player_offset;
 
-                    player_info[player_index].guessed_velocity.z = 
-                        (c->position.z - p->position.z) / player_info[player_index].delta_time;
+    // the mouse moves between steps too, look with the newest angles
+    get_view_vectors(camera.angle_h, camera.angle_v, &cam->target, &cam->up);
 
-                    player_info[player_index].guessed_angle_h_vel = 
-                        (RAD(c->angle_h) - RAD(p->angle_h)) / player_info[player_index].delta_time;
+    rs->show_player     = (camera.perspective == CAMERA_PERSPECTIVE_THIRD_PERSON || camera.mode == CAMERA_MODE_FREE);
+    rs->player_position = view.player_position;
+    rs->player_angle_h  = player.angle_h;
+    rs->player_angle_v  = player.angle_v;
 
-                    player_info[player_index].guessed_angle_v_vel = 
-                        (RAD(c->angle_v) - RAD(p->angle_v)) / player_info[player_index].delta_time;
-                    
-                    /*
-                    printf("Client%d: P %f %f %f R %f %f\n", i,
-                            ws->client_data[i].position.x,
-                            ws->client_data[i].position.y,
-                            ws->client_data[i].position.z,
-                            ws->client_data[i].angle_h,
-                            ws->client_data[i].angle_v
-                    );
-                    */
+    if(is_client)
+    {
+        interp_clock_update(&interp_clock, timer_get_time());
 
-                    player_index++;
-                }
-            }
+        for(int i = 0; i < MAX_CLIENTS; ++i)
+        {
+            PlayerInfo* info = &player_info[i];
+            if(!info->active)
+                continue;
+
+            if(!interp_buffer_sample(&info->history, interp_clock.render_time, info->held, &info->current))
+                interp_clock.num_extrapolated++;
         }
     }
 
-    for(int i = 0; i < num_other_players; ++i)
+    int highlighted = -1;
+
+    for(int i = 0; i < MAX_CLIENTS; ++i)
     {
+        if(!player_info[i].active)
+            continue;
+
+        rs->players[rs->num_players++] = player_info[i].current;
+
         Vector3f p1,p2;
 
-        p1.x = camera.position.x;
-        p1.y = camera.position.y;
-        p1.z = camera.position.z;
+        p1.x = cam->position.x;
+        p1.y = cam->position.y;
+        p1.z = cam->position.z;
 
-        float view_distance = 10.0f;
+        // same ray the server tests shots with
+        p2.x = cam->position.x + PLAYER_FIRE_RANGE*cam->target.x;
+        p2.y = cam->position.y + PLAYER_FIRE_RANGE*cam->target.y;
+        p2.z = cam->position.z + PLAYER_FIRE_RANGE*cam->target.z;
 
-        p2.x = camera.position.x + view_distance*camera.target.x;
-        p2.y = camera.position.y + view_distance*camera.target.y;
-        p2.z = camera.position.z + view_distance*camera.target.z;
+        player_info[i].highlighted = phys_collision_line_sphere(p1,p2,player_info[i].current.position,PLAYER_HIT_RADIUS,NULL);
 
-        if(phys_collision_line_sphere(p1,p2,player_info[i].current.position,2.0f))
-            player_info[i].highlighted = true;
-        else
-            player_info[i].highlighted = false;
+        if(player_info[i].highlighted)
+            highlighted = i;
+    }
+
+    // hud
+    hud_print(rs,10.0f,25.0f,1.0f,1.0f,1.0f,is_client ? "Connected to Server" : "Local Game");
+    hud_print(rs,10.0f,50.0f,1.0f,1.0f,1.0f,"Player Count: %d",num_other_players+1);
+
+    if(is_client)
+    {
+        hud_print(rs,10.0f,75.0f,1.0f,1.0f,1.0f,"Interp: %.0f ms  Jitter: %.1f ms  Buffer: %.1f  Extrap: %d",
+                  interp_clock.delay*1000.0, interp_clock.jitter*1000.0,
+                  interp_clock.buffer_depth, interp_clock.num_extrapolated);
+    }
+
+    if(frame_stats.frames > 1)
+    {
+        hud_print(rs,10.0f,125.0f,1.0f,1.0f,1.0f,"FPS: %.0f  Frame jitter: %.2f ms  Dropped steps: %u",
+                  (frame_stats.frames-1) / frame_stats.interval_total,
+                  timer_get_jitter(&frame_stats)*1000.0, sim_dropped_steps);
     }
+
+    hud_print(rs,10.0f,100.0f,0.60f,0.00f,0.60f,"%s",player.name);
+
+    if(highlighted >= 0)
+        hud_print(rs,view_width/2.0f - 75.0f,view_height - 30.0f,0.0f,1.0f,1.0f,"%s",player_info[highlighted].player_name);
+
+    if(hit_display_time > 0.0f)
+        hud_print(rs,view_width/2.0f - 75.0f,view_height/2.0f + 30.0f,1.0f,0.2f,0.2f,"Hit %s",player_info[last_hit_id].player_name);
+
+    // reticule
+    hud_print(rs,view_width/2.0f-1,view_height/2.0f,1.0f,1.0f,1.0f,".");
 }
 
-void render()
+// Draws a prepared frame, touching nothing the simulation does
+void render_frame(RenderSnapshot* rs)
 {
     glClearDepth(1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    if(is_title_screen)
+    if(rs->title_screen)
     {
         menu_render(&title_screen);
     }
     else
     {
+        if(late_latch && glfwGetInputMode(window,GLFW_CURSOR) == GLFW_CURSOR_DISABLED)
+        {
+            // only the view turns, where things are and what the simulation saw stay as prepared
+            double cursor_x, cursor_y;
+            glfwGetCursorPos(window,&cursor_x,&cursor_y);
+            camera_latch_angle(&rs->camera,cursor_x,cursor_y);
+
+            rs->look_time = timer_get_time();
+        }
+
+        view_camera = &rs->camera;
+
+        Vector3f dir;
+        copy_v3f(&dir, &sunlight.direction);
+        normalize_v3f(&dir);
+
+        shader_set_float(program, "dl.diffuse_intensity", sunlight.base.diffuse_intensity);
+        shader_set_vec3(program, "dl.direction", dir.x, dir.y, dir.z);
+
         terrain_render();
 
-        if(camera.perspective == CAMERA_PERSPECTIVE_THIRD_PERSON || camera.mode == CAMERA_MODE_FREE)
+        if(rs->show_player)
         {
-            Vector3f pos      = {-player.position.x, -player.position.y, -player.position.z};
-            Vector3f rotation = {-player.angle_v+90.0f, -player.angle_h+90.0f, 0.0f};
+            Vector3f pos      = {-rs->player_position.x, -rs->player_position.y, -rs->player_position.z};
+            Vector3f rotation = {-rs->player_angle_v+90.0f, -rs->player_angle_h+90.0f, 0.0f};
             Vector3f scale    = {1.0f, 1.0f, 1.0f};
 
             mesh_render(&sword, pos, rotation, scale);
         }
 
         // objects
-        for(int i = 0; i < num_other_players; ++i)
+        for(int i = 0; i < rs->num_players; ++i)
         {
-            float angle_v_interp = player_info[i].time_since_last_packet*(player_info[i].guessed_angle_v_vel);
-            float angle_h_interp = player_info[i].time_since_last_packet*(player_info[i].guessed_angle_h_vel);
-
-            Vector3f pos_interp = {
-                player_info[i].time_since_last_packet*(player_info[i].guessed_velocity.x),
-                player_info[i].time_since_last_packet*(player_info[i].guessed_velocity.y),
-                player_info[i].time_since_last_packet*(player_info[i].guessed_velocity.z)
-            };
-
-            player_info[i].time_since_last_packet += TARGET_SPF;
-
-            Vector3f pos = {
-                -(player_info[i].current.position.x + pos_interp.x),
-                -(player_info[i].current.position.y + pos_interp.y),
-                -(player_info[i].current.position.z + pos_interp.z)
-            };
-            Vector3f rotation = {
-                -(player_info[i].current.angle_v + DEG(angle_v_interp))+90.0f,
-                -(player_info[i].current.angle_h + DEG(angle_h_interp))+90.0f,
-                0.0f
-            };
+            InterpSample* c = &rs->players[i];
 
+            Vector3f pos = {-c->position.x, -c->position.y, -c->position.z};
+            Vector3f rotation = {-c->angle_v+90.0f, -c->angle_h+90.0f, 0.0f};
             Vector3f scale    = {1.0f, 1.0f, 1.0f};
 
             mesh_render(&rat, pos, rotation, scale);
         }
 
-        float angle = DEG(sinf(0.1f*world.time));
-
         sky_render();
 
-        // hud
-        Vector3f color = {1.0f,1.0f,1.0f};
+        for(int i = 0; i < rs->num_texts; ++i)
+            text_print(rs->texts[i].x,rs->texts[i].y,rs->texts[i].text,rs->texts[i].color);
+    }
 
-        if(is_client)
-            text_print(10.0f,25.0f,"Connected to Server",color);
-        else
-            text_print(10.0f,25.0f,"Local Game",color);
+    glfwSwapBuffers(window);
 
-        char text_num_players[16] = {0};
-        snprintf(text_num_players,16,"Player Count: %d",num_other_players+1);
-        text_print(10.0f,50.0f,text_num_players,color);
+    if(measure_latency && !rs->title_screen)
+        record_latency(rs);
+}
 
-        color.x = 0.60f; color.y = 0.00f; color.z = 0.60f;
-        text_print(10.0f,100.0f,player.name,color);
+static void record_latency(RenderSnapshot* rs)
+{
+    double now = timer_get_time();
 
-        color.x = 0.0f; color.y = 1.0f; color.z = 1.0f;
-        for(int i = 0; i < num_other_players;++i)
-        {
-            if(player_info[i].highlighted)
-                text_print(view_width/2.0f - 75.0f,view_height - 30.0f,player_info[i].player_name,color);
-        }
+    if(latency.start == 0.0)
+        latency.start = now;
+
+    metrics_histogram_add(&latency.input, now - rs->input_time);
+    metrics_histogram_add(&latency.look,  now - rs->look_time);
+
+    if(now - latency.start < METRICS_INTERVAL)
+        return;
+
+    printf("Input to swap: %u frames, input p50 %.2f p99 %.2f max %.2f ms, look p50 %.2f p99 %.2f max %.2f ms%s%s\n",
+           latency.input.total,
+           metrics_histogram_percentile(&latency.input, 0.50) * 1000.0,
+           metrics_histogram_percentile(&latency.input, 0.99) * 1000.0,
+           latency.input.max * 1000.0,
+           metrics_histogram_percentile(&latency.look, 0.50) * 1000.0,
+           metrics_histogram_percentile(&latency.look, 0.99) * 1000.0,
+           latency.look.max * 1000.0,
+           late_latch ? ", late-latched" : "",
+           pipelined ? ", pipelined" : "");
+
+    memset(&latency, 0, sizeof(latency));
+    latency.start = now;
+}
+
+// Pipelined mode: steps the simulation and prepares the next frame while the
+// main thread draws the last one, see start_game
+static void* simulation_run(void* arg)
+{
+    (void)arg;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&pipeline.lock);
+        while(!pipeline.busy && !pipeline.quit)
+            pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+        bool quit = pipeline.quit;
+        pthread_mutex_unlock(&pipeline.lock);
+
+        if(quit)
+            break;
+
+        float alpha = advance_simulation();
+        prepare_frame(alpha, &pipeline.snapshots[pipeline.front ^ 1]);
 
-        // reticule
-        color.x = 1.0f; color.y = 1.0f; color.z = 1.0f;
-        text_print(view_width/2.0f-1,view_height/2.0f,".",color);
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.busy = false;
+        pthread_cond_broadcast(&pipeline.cond);
+        pthread_mutex_unlock(&pipeline.lock);
     }
 
-    glfwSwapBuffers(window);
+    return NULL;
+}
+
+static void simulation_wait()
+{
+    pthread_mutex_lock(&pipeline.lock);
+    while(pipeline.busy)
+        pthread_cond_wait(&pipeline.cond, &pipeline.lock);
+    pthread_mutex_unlock(&pipeline.lock);
 }
 
+static void simulation_signal(bool quit)
+{
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.busy = !quit;
+    pipeline.quit = quit;
+    pthread_cond_broadcast(&pipeline.cond);
+    pthread_mutex_unlock(&pipeline.lock);
+}
@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "util.h"
+#include "math3d.h"
+#include "net.h"
+#include "interp.h"
+
+#define INTERP_OFFSET_DRIFT 0.01 // how quickly offset gives up a quick arrival, per snapshot
+#define INTERP_DELAY_GROW   0.25 // delay chases its target quickly upwards and slowly back down
+#define INTERP_DELAY_SHRINK 0.02
+#define INTERP_SPACING_SMOOTHING 0.125
+#define INTERP_CATCHUP_TIME 0.25 // render_time closes its error over roughly this long
+#define INTERP_MAX_SKEW     0.1  // while never running more than 10% fast or slow
+
+void interp_clock_add_snapshot(InterpClock* clock, u32 tick, double time_received)
+{
+    double server_time = tick / (double)SERVER_RATE;
+    double transit = time_received - server_time;
+
+    if(!clock->synced)
+    {
+        clock->synced       = true;
+        clock->offset       = transit;
+        clock->last_transit = transit;
+        clock->latest_time  = server_time;
+        clock->jitter       = 0.0;
+        clock->spacing      = 1.0/SERVER_RATE;
+        clock->delay        = INTERP_DELAY_MIN;
+        clock->render_time  = server_time - clock->delay;
+        clock->last_update  = time_received;
+        return;
+    }
+
+    if(server_time <= clock->latest_time)
+        return;
+
+    clock->spacing += (server_time - clock->latest_time - clock->spacing) * INTERP_SPACING_SMOOTHING;
+    clock->latest_time = server_time;
+
+    // RFC 3550 interarrival jitter
+    double d = transit - clock->last_transit;
+    clock->jitter += (fabs(d) - clock->jitter) / 16.0;
+    clock->last_transit = transit;
+
+    // track the quickest arrivals, drifting up so a route or clock change isn't stuck forever
+    if(transit < clock->offset)
+        clock->offset = transit;
+    else
+        clock->offset += (transit - clock->offset) * INTERP_OFFSET_DRIFT;
+
+    // far enough back to have the next snapshot already, however far apart they come
+    double target = MAX(clock->spacing, 1.0/SERVER_RATE) + INTERP_DELAY_MARGIN + INTERP_JITTER_SCALE*clock->jitter;
+    target = MAX(INTERP_DELAY_MIN, MIN(target, INTERP_DELAY_MAX));
+
+    clock->delay += (target - clock->delay) * (target > clock->delay ? INTERP_DELAY_GROW : INTERP_DELAY_SHRINK);
+}
+
+void interp_clock_update(InterpClock* clock, double now)
+{
+    if(!clock->synced)
+        return;
+
+    double dt = MAX(now - clock->last_update, 0.0);
+    clock->last_update = now;
+
+    clock->render_time += dt;
+
+    double target = now - clock->offset - clock->delay;
+    double error = target - clock->render_time;
+
+    if(fabs(error) > INTERP_DELAY_MAX)
+    {
+        // too far out to ease back in, e.g. after a stall
+        clock->render_time = target;
+    }
+    else
+    {
+        // skew the rate slightly rather than jump, so motion stays smooth
+        double max_skew = dt*INTERP_MAX_SKEW;
+        double correction = error * MIN(dt / INTERP_CATCHUP_TIME, 1.0);
+        clock->render_time += MAX(-max_skew, MIN(correction, max_skew));
+    }
+
+    clock->buffer_depth = (clock->latest_time - clock->render_time) * SERVER_RATE;
+    clock->num_extrapolated = 0;
+}
+
+void interp_buffer_clear(InterpBuffer* buf)
+{
+    buf->newest = 0;
+    buf->count = 0;
+}
+
+void interp_buffer_add(InterpBuffer* buf, InterpSample* sample)
+{
+    if(buf->count > 0 && sample->time <= buf->samples[buf->newest].time)
+        return;
+
+    buf->newest = (buf->newest + 1) % INTERP_BUFFER_SIZE;
+    buf->samples[buf->newest] = *sample;
+
+    if(buf->count < INTERP_BUFFER_SIZE)
+        buf->count++;
+}
+
+static inline InterpSample* get_sample(InterpBuffer* buf, int age)
+{
+    return &buf->samples[(buf->newest - age + INTERP_BUFFER_SIZE) % INTERP_BUFFER_SIZE];
+}
+
+static void lerp_sample(InterpSample* a, InterpSample* b, float t, InterpSample* out)
+{
+    out->position.x = a->position.x + (b->position.x - a->position.x)*t;
+    out->position.y = a->position.y + (b->position.y - a->position.y)*t;
+    out->position.z = a->position.z + (b->position.z - a->position.z)*t;
+
+    // go the short way around
+    float dh = b->angle_h - a->angle_h;
+    if(dh > 180.0f)  dh -= 360.0f;
+    if(dh < -180.0f) dh += 360.0f;
+
+    out->angle_h = fmodf(a->angle_h + dh*t, 360.0f);
+    if(out->angle_h < 0.0f) out->angle_h += 360.0f;
+
+    out->angle_v = a->angle_v + (b->angle_v - a->angle_v)*t;
+}
+
+bool interp_buffer_sample(InterpBuffer* buf, double time, bool hold, InterpSample* out)
+{
+    if(buf->count == 0)
+        return false;
+
+    InterpSample* newest = get_sample(buf, 0);
+
+    if(time >= newest->time)
+    {
+        *out = *newest;
+        out->time = time;
+
+        if(time == newest->time || hold)
+            return true;
+
+        if(buf->count < 2)
+            return false;
+
+        // ran out of snapshots, keep going the way it was for a little while
+        InterpSample* prior = get_sample(buf, 1);
+        double ahead = MIN(time - newest->time, INTERP_EXTRAPOLATE_MAX);
+        lerp_sample(prior, newest, (float)(1.0 + ahead / (newest->time - prior->time)), out);
+        return false;
+    }
+
+    for(int age = 1; age < buf->count; ++age)
+    {
+        InterpSample* a = get_sample(buf, age);
+        if(a->time > time)
+            continue;
+
+        InterpSample* b = get_sample(buf, age-1);
+        lerp_sample(a, b, (float)((time - a->time) / (b->time - a->time)), out);
+        out->time = time;
+        return true;
+    }
+
+    // older than anything buffered, hold the oldest
+    *out = *get_sample(buf, buf->count-1);
+    out->time = time;
+    return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#define INTERP_BUFFER_SIZE 32          // snapshots kept per remote player, ~1s at SERVER_RATE
+#define INTERP_DELAY_MARGIN 0.01
+#define INTERP_DELAY_MIN   (1.0/SERVER_RATE + INTERP_DELAY_MARGIN) // next snapshot in hand to interpolate, plus a margin
+#define INTERP_DELAY_MAX   0.25
+#define INTERP_JITTER_SCALE 3.0        // delay covers this many mean deviations of arrival jitter
+#define INTERP_EXTRAPOLATE_MAX 0.1     // seconds to keep moving past the newest snapshot
+
+typedef struct
+{
+    double   time; // server time, tick / SERVER_RATE
+    Vector3f position;
+    float    angle_h;
+    float    angle_v;
+} InterpSample;
+
+// Ring of one remote player's snapshots, oldest to newest
+typedef struct
+{
+    InterpSample samples[INTERP_BUFFER_SIZE];
+    int newest;
+    int count;
+} InterpBuffer;
+
+// Maps local time onto the server timeline and picks how far behind it to render
+typedef struct
+{
+    bool   synced;
+    double offset;       // local - server time of the quickest arrivals
+    double last_transit;
+    double latest_time;  // server time of the newest snapshot
+    double jitter;       // mean deviation of snapshot transit times
+    double spacing;      // server time between snapshots, more than a tick if the server backs off
+    double delay;        // how far behind the estimated server time we render
+    double render_time;  // server time being rendered
+    double last_update;
+
+    // metrics
+    double buffer_depth; // snapshot intervals buffered ahead of render_time
+    int    num_extrapolated;
+} InterpClock;
+
+void interp_clock_add_snapshot(InterpClock* clock, u32 tick, double time_received);
+void interp_clock_update(InterpClock* clock, double now);
+
+void interp_buffer_clear(InterpBuffer* buf);
+void interp_buffer_add(InterpBuffer* buf, InterpSample* sample);
+
+// Fills out with the pose at time, returns false if that needed extrapolation.
+// With hold, anything past the newest sample is the newest sample.
+bool interp_buffer_sample(InterpBuffer* buf, double time, bool hold, InterpSample* out);
@@ -12,8 +12,16 @@ gcc game.c \
     sky.c \
     light.c \
     terrain.c \
+    terrain_height.c \
     socket.c \
     net.c \
+    protocol.c \
+    bitpack.c \
+    metrics.c \
+    congestion.c \
+    capture.c \
+    interp.c \
+    packet_queue.c \
     timer.c \
     text.c \
     phys.c \
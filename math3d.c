@@ -175,6 +175,34 @@ float barry_centric(Vector3f p1, Vector3f p2, Vector3f p3, Vector2f pos)
     return l1 * p1.y + l2 * p2.y + l3 * p3.y;
 }
 
+// Forward and up vectors for a view looking angle_h around and angle_v up, in degrees
+void get_view_vectors(float angle_h, float angle_v, Vector3f* target, Vector3f* up)
+{
+    const Vector3f v_axis = {0.0f, 1.0f, 0.0f};
+
+    // Rotate the view vector by the horizontal angle around the vertical axis
+    Vector3f view = {1.0f, 0.0f, 0.0f};
+    rotate_v3f(angle_h, v_axis, &view);
+    normalize_v3f(&view);
+
+    // Rotate the view vector by the vertical angle around the horizontal axis
+    Vector3f h_axis = {0};
+
+    cross_v3f(v_axis, view, &h_axis);
+    normalize_v3f(&h_axis);
+    rotate_v3f(angle_v, h_axis, &view);
+
+    copy_v3f(target,&view);
+    normalize_v3f(target);
+
+    //printf("Target: %f %f %f\n", target->x, target->y, target->z);
+
+    cross_v3f(*target,h_axis, up);
+    normalize_v3f(up);
+
+    //printf("Up: %f %f %f\n", up->x, up->y, up->z);
+}
+
 
 //
 // Matrices
@@ -64,3 +64,4 @@ void print_m4f(const char* title, Matrix4f w);
 
 // other
 float barry_centric(Vector3f p1, Vector3f p2, Vector3f p3, Vector2f pos);
+void get_view_vectors(float angle_h, float angle_v, Vector3f* target, Vector3f* up);
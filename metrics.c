@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <math.h>
+#include <pthread.h>
+
+#if !defined(_WIN32)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "util.h"
+#include "math3d.h"
+#include "socket.h"
+#include "net.h"
+#include "metrics.h"
+
+#define METRICS_LINE_SIZE (512*1024) // a report with every client connected is ~250KB
+
+// The tick thread fills in report and flags it pending, the writer thread
+// turns it into a JSON line and clears the flag once it's written out. A
+// report that arrives while one is pending is skipped, never waited on.
+static struct
+{
+    bool running;
+    char path[256];
+    bool is_socket;
+    FILE* file;
+    int  socket;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;
+    bool pending;
+    bool stopping;
+
+    ServerMetrics report;
+    char line[METRICS_LINE_SIZE];
+} metrics;
+
+void metrics_histogram_add(MetricsHistogram* hist, double seconds)
+{
+    double us = seconds * 1000000.0;
+
+    // bucket b > 0 holds [2^((b-1)/8), 2^(b/8)) us
+    int bucket = (us < 1.0) ? 0 : 1 + (int)(log2(us) * 8.0);
+    bucket = MIN(bucket, METRICS_HISTOGRAM_BUCKETS-1);
+
+    hist->counts[bucket]++;
+    hist->total++;
+    hist->sum += seconds;
+    hist->max = MAX(hist->max, seconds);
+}
+
+double metrics_histogram_percentile(MetricsHistogram* hist, double p)
+{
+    if(hist->total == 0)
+        return 0.0;
+
+    u32 target = MAX((u32)ceil(hist->total * p), 1);
+    u32 seen = 0;
+
+    for(int i = 0; i < METRICS_HISTOGRAM_BUCKETS; ++i)
+    {
+        seen += hist->counts[i];
+        if(seen >= target)
+            return MIN(pow(2.0, i / 8.0) / 1000000.0, hist->max);
+    }
+
+    return hist->max;
+}
+
+// appends to the line, dropping whatever doesn't fit
+static int line_printf(int len, const char* fmt, ...)
+{
+    if(len >= METRICS_LINE_SIZE)
+        return len;
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(metrics.line + len, METRICS_LINE_SIZE - len, fmt, args);
+    va_end(args);
+
+    return (n < 0) ? len : MIN(len + n, METRICS_LINE_SIZE);
+}
+
+// milliseconds
+static int write_histogram(int len, const char* name, MetricsHistogram* hist)
+{
+    return line_printf(len, "\"%s\":{\"avg\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f},",
+        name,
+        hist->total ? hist->sum / hist->total * 1000.0 : 0.0,
+        metrics_histogram_percentile(hist, 0.50) * 1000.0,
+        metrics_histogram_percentile(hist, 0.90) * 1000.0,
+        metrics_histogram_percentile(hist, 0.99) * 1000.0,
+        hist->max * 1000.0);
+}
+
+static int format_report(ServerMetrics* m)
+{
+    static const char* drop_names[DROP_COUNT] = {
+        "malformed", "server_full", "stale", "input_budget", "pool_empty", "queue_full", "send_failed"
+    };
+
+    double per_second = (m->interval > 0.0) ? 1.0 / m->interval : 0.0;
+
+    u64 packets_in = 0, bytes_in = 0, packets_out = 0, bytes_out = 0;
+    for(int i = 0; i < m->num_clients; ++i)
+    {
+        packets_in  += m->clients[i].packets_in;
+        bytes_in    += m->clients[i].bytes_in;
+        packets_out += m->clients[i].packets_out;
+        bytes_out   += m->clients[i].bytes_out;
+    }
+
+    int len = line_printf(0, "{\"time\":%.3f,\"interval\":%.3f,\"tick\":%u,\"ticks\":%u,\"clients\":%u,",
+        m->time, m->interval, m->tick, m->ticks, m->num_clients);
+
+    len = write_histogram(len, "tick_ms",     &m->tick_time);
+    len = write_histogram(len, "tick_late_ms", &m->tick_late);
+    len = line_printf(len, "\"tick_jitter_ms\":%.3f,\"skipped_ticks\":%u,", m->tick_jitter*1000.0, m->skipped_ticks);
+    len = write_histogram(len, "recv_ms",     &m->recv_time);
+    len = write_histogram(len, "simulate_ms", &m->simulate_time);
+    len = write_histogram(len, "send_ms",     &m->send_time);
+    len = write_histogram(len, "rewind_ms",   &m->rewind_time);
+
+    len = line_printf(len, "\"packets_in\":%.0f,\"bytes_in\":%.0f,\"packets_out\":%.0f,\"bytes_out\":%.0f,",
+        packets_in*per_second, bytes_in*per_second, packets_out*per_second, bytes_out*per_second);
+
+    len = line_printf(len, "\"shots\":%u,\"hits\":%u,", m->shots, m->hits);
+
+    len = line_printf(len, "\"drops\":{");
+    for(int i = 0; i < DROP_COUNT; ++i)
+        len = line_printf(len, "%s\"%s\":%u", i ? "," : "", drop_names[i], m->drops[i]);
+
+    len = line_printf(len, "},\"per_client\":[");
+
+    for(int i = 0; i < m->num_clients; ++i)
+    {
+        ClientMetrics* c = &m->clients[i];
+        Address* a = &c->address;
+
+        len = line_printf(len, "%s{\"id\":%u,\"address\":\"%u.%u.%u.%u:%u\",\"rtt_ms\":%.2f,\"rtt_var_ms\":%.2f,"
+            "\"loss\":%.3f,\"bandwidth\":%.0f,\"send_interval\":%u,"
+            "\"packets_in\":%.0f,\"bytes_in\":%.0f,\"packets_out\":%.0f,\"bytes_out\":%.0f,\"drops\":%u}",
+            i ? "," : "", c->id, a->a, a->b, a->c, a->d, a->port, c->rtt*1000.0, c->rtt_var*1000.0,
+            c->loss, c->bandwidth, c->send_interval,
+            c->packets_in*per_second, c->bytes_in*per_second, c->packets_out*per_second, c->bytes_out*per_second,
+            c->drops);
+    }
+
+    len = line_printf(len, "]}\n");
+
+    // cut short, still end on a line of its own
+    if(len >= METRICS_LINE_SIZE)
+    {
+        metrics.line[METRICS_LINE_SIZE-2] = '\n';
+        len = METRICS_LINE_SIZE-1;
+    }
+
+    return len;
+}
+
+static bool write_report(int len)
+{
+    if(!metrics.is_socket)
+    {
+        if(!metrics.file)
+            metrics.file = fopen(metrics.path, "a");
+
+        if(!metrics.file)
+            return false;
+
+        fwrite(metrics.line, 1, len, metrics.file);
+        fflush(metrics.file);
+        return true;
+    }
+
+#if !defined(_WIN32)
+    // whatever is listening may come and go, connect again when it's back
+    if(metrics.socket < 0)
+    {
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(sock < 0)
+            return false;
+
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, metrics.path, MIN(strlen(metrics.path), sizeof(addr.sun_path)-1));
+
+        if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        {
+            close(sock);
+            return false;
+        }
+
+        metrics.socket = sock;
+    }
+
+#if defined(MSG_NOSIGNAL)
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+
+    for(int sent = 0; sent < len;)
+    {
+        int n = send(metrics.socket, metrics.line + sent, len - sent, flags);
+        if(n <= 0)
+        {
+            close(metrics.socket);
+            metrics.socket = -1;
+            return false;
+        }
+        sent += n;
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void* metrics_run(void* arg)
+{
+    (void)arg;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&metrics.lock);
+        while(!metrics.pending && !metrics.stopping)
+            pthread_cond_wait(&metrics.ready, &metrics.lock);
+        bool stop = !metrics.pending; // a pending report is written out first
+        pthread_mutex_unlock(&metrics.lock);
+
+        if(stop)
+            break;
+
+        // report is left alone while pending, so it's read without the lock
+        int len = format_report(&metrics.report);
+        write_report(len);
+
+        pthread_mutex_lock(&metrics.lock);
+        metrics.pending = false;
+        pthread_mutex_unlock(&metrics.lock);
+    }
+
+    return NULL;
+}
+
+bool metrics_start(const char* path)
+{
+    if(metrics.running)
+        return true;
+
+    metrics.is_socket = (strncmp(path, "unix:", 5) == 0);
+    snprintf(metrics.path, sizeof(metrics.path), "%s", metrics.is_socket ? path+5 : path);
+    metrics.socket = -1;
+    metrics.pending = false;
+    metrics.stopping = false;
+
+#if defined(_WIN32)
+    if(metrics.is_socket)
+    {
+        printf("Metrics can't go to a UNIX socket on this platform.\n");
+        return false;
+    }
+#endif
+
+    pthread_mutex_init(&metrics.lock, NULL);
+    pthread_cond_init(&metrics.ready, NULL);
+
+    if(pthread_create(&metrics.thread, NULL, metrics_run, NULL) != 0)
+    {
+        printf("Failed to start metrics thread.\n");
+        pthread_cond_destroy(&metrics.ready);
+        pthread_mutex_destroy(&metrics.lock);
+        return false;
+    }
+
+    printf("Publishing metrics every %.0f s to %s\n", METRICS_INTERVAL, path);
+
+    metrics.running = true;
+    return true;
+}
+
+bool metrics_publish(ServerMetrics* m)
+{
+    if(!metrics.running)
+        return false;
+
+    if(pthread_mutex_trylock(&metrics.lock) != 0)
+        return false;
+
+    bool busy = metrics.pending;
+
+    if(!busy)
+    {
+        // only the clients in use
+        memcpy(&metrics.report, m, offsetof(ServerMetrics, clients) + m->num_clients*sizeof(ClientMetrics));
+        metrics.pending = true;
+        pthread_cond_signal(&metrics.ready);
+    }
+
+    pthread_mutex_unlock(&metrics.lock);
+    return !busy;
+}
+
+void metrics_stop()
+{
+    if(!metrics.running)
+        return;
+
+    pthread_mutex_lock(&metrics.lock);
+    metrics.running = false;
+    metrics.stopping = true;
+    pthread_cond_signal(&metrics.ready);
+    pthread_mutex_unlock(&metrics.lock);
+
+    pthread_join(metrics.thread, NULL);
+
+    if(metrics.file)
+    {
+        fclose(metrics.file);
+        metrics.file = NULL;
+    }
+
+#if !defined(_WIN32)
+    if(metrics.socket >= 0)
+    {
+        close(metrics.socket);
+        metrics.socket = -1;
+    }
+#endif
+
+    pthread_cond_destroy(&metrics.ready);
+    pthread_mutex_destroy(&metrics.lock);
+}
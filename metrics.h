@@ -0,0 +1,82 @@
+#pragma once
+
+#define METRICS_INTERVAL 1.0          // seconds covered by each report
+#define METRICS_HISTOGRAM_BUCKETS 200 // 8 per doubling from 1us, the last holds everything past ~28s
+
+// Durations on a log scale, within about 9% of the real value
+typedef struct
+{
+    u32    counts[METRICS_HISTOGRAM_BUCKETS];
+    u32    total;
+    double sum;
+    double max;
+} MetricsHistogram;
+
+typedef enum
+{
+    DROP_MALFORMED,    // too short, truncated or from another game
+    DROP_SERVER_FULL,  // from a new client with every slot taken
+    DROP_STALE,        // a duplicate or older than the acks still track
+    DROP_INPUT_BUDGET, // packets whose inputs ran past the client's rate, the rest wait for their redundant copies
+    DROP_POOL_EMPTY,   // a receive worker had no buffer to read into
+    DROP_QUEUE_FULL,   // a receive worker's queue to the tick thread was full
+    DROP_SEND_FAILED,
+    DROP_COUNT
+} DropReason;
+
+typedef struct
+{
+    u16     id;
+    Address address;
+    float   rtt;           // seconds, smoothed
+    float   rtt_var;       // mean deviation of rtt
+    float   loss;          // fraction of snapshot packets lost, smoothed
+    float   bandwidth;     // bytes per second the link has been seen to carry
+    u8      send_interval; // ticks between the snapshots it's sent, raised while congested
+    u32     packets_in;
+    u32     bytes_in;
+    u32     packets_out;
+    u32     bytes_out;
+    u32     drops; // stale datagrams and inputs over budget
+} ClientMetrics;
+
+// One interval of server telemetry
+typedef struct
+{
+    double time;     // server uptime at the end of the interval
+    double interval; // seconds covered
+    u32    tick;
+    u32    ticks;
+
+    MetricsHistogram tick_time;     // recv + simulate + send
+    MetricsHistogram tick_late;     // how far past its scheduled time each tick started
+    double           tick_jitter;   // standard deviation of the time between tick starts
+    u32              skipped_ticks; // dropped after falling too far behind
+    MetricsHistogram recv_time;     // reading and applying client packets since the last tick
+    MetricsHistogram simulate_time; // timeouts and capturing the world state
+    MetricsHistogram send_time;     // encoding and sending snapshots
+
+    MetricsHistogram rewind_time;   // how far back shots were tested, lag compensation
+
+    u32 shots;
+    u32 hits;
+    u32 drops[DROP_COUNT];
+
+    u16 num_clients;
+    ClientMetrics clients[MAX_CLIENTS];
+} ServerMetrics;
+
+void metrics_histogram_add(MetricsHistogram* hist, double seconds);
+double metrics_histogram_percentile(MetricsHistogram* hist, double p); // seconds
+
+// Starts the writer thread. "unix:/some/path" connects to a UNIX stream socket,
+// anything else is a file that JSON lines are appended to.
+bool metrics_start(const char* path);
+
+// Hands a report to the writer thread without waiting on it. Returns false if
+// it's not running or still busy with the last report, which is then skipped.
+bool metrics_publish(ServerMetrics* metrics);
+
+// Writes out a report still pending, joins the writer thread and closes the
+// file or socket. Call from the thread that publishes.
+void metrics_stop();
@@ -2,83 +2,295 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
 #include <errno.h> 
 #include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/select.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
 #include "socket.h"
 #include "util.h"
+#include "settings.h"
 #include "timer.h"
 #include "net.h"
+#include "terrain.h"
+#include "phys.h"
 #include "packet_queue.h"
+#include "metrics.h"
+#include "congestion.h"
+#include "capture.h"
+#include "bitpack.h"
+#include "protocol.h"
 
-#define SERVER_RATE 30.0f
 #define PORT 27001
 
 #define PACKET_INFO_MAX_LEN 256
 #define MAX_PRIOR_PACKETS 32
-#define MAXIMUM_RTT 1.0f
+
+// How fast the server runs a client's input commands
+#define PLAYER_INPUT_RATE       TARGET_FPS // commands per second a client may run, one per frame
+#define PLAYER_INPUT_BURST      16.0f      // commands it may run back to back after a stall
+
+// Lag compensation: shots are tested against where the shooter saw everyone,
+// up to this many seconds back. Anyone further behind has to lead their target.
+#define LAG_COMPENSATION_MAX 0.5
+
+// Area of interest, distances are measured on the ground plane
+#define AOI_RADIUS       256.0f // clients further apart than this aren't sent to each other
+#define AOI_NEAR_RADIUS  96.0f  // clients within this and in view are sent every tick
+#define AOI_CELL_SIZE    64.0f
+#define AOI_GRID_MAX     64     // cells per axis
+#define GRID_END         0xFFFF // terminates a cell's client list
+
+// Snapshot budget. Every client in range builds up priority each tick it
+// isn't sent, and each snapshot sends the highest until the budget is spent.
+#define SNAPSHOT_ENTRY_BUDGET   (PACKET_MAX_PAYLOAD - 128) // bytes of entries, so a snapshot mostly fits one datagram
+#define SNAPSHOT_MAX_VALUE_AGE  15     // ticks a client may go unsent before it has to be, see server_get_baseline
+#define PRIORITY_NEAR           1.0f   // per tick, near and in view
+#define PRIORITY_FAR            0.1f   // per tick at AOI_RADIUS, rising linearly to PRIORITY_NEAR at AOI_NEAR_RADIUS
+#define PRIORITY_BEHIND         0.25f  // scales anything outside the view cone
+#define PRIORITY_VIEW_COS       0.5f   // cosine of half the view cone
+#define PRIORITY_BUCKETS        64     // for picking the highest without a sort
+#define PRIORITY_BUCKET_SIZE    0.25f
+
+// Entries are encoded once a tick for each baseline value receivers hold,
+// then copied into every snapshot that needs one, see server_get_encoded_entry
+#define ENTRY_CACHE_SLOTS    8 // baseline values per client, by value tick
+#define ENTRY_CACHE_MAX_BITS 128
+#define ENTRY_CACHE_BUSY     UINT64_MAX
 
 #define DISCONNECTION_TIMEOUT 10.0f // seconds
 
+#define CLIENT_WAIT_TIMEOUT 0.1 // seconds the network thread sleeps before checking it should stop
+
+#define SERVER_RECV_BUFFER_SIZE (4*1024*1024) // absorb bursts between wakeups
+#define SERVER_SEND_BUFFER_COUNT 256
+
+#define SERVER_MAX_WORKERS       64
+#define SERVER_WORKER_QUEUE_SIZE 2048  // received packets a worker can have waiting for the tick thread
+#define SERVER_WORKER_MAX_BATCHES 4    // socket_recv_batch calls per wakeup before the worker looks at wake_fd again
+#define SERVER_MAX_CATCH_UP      6     // ticks run back to back after a stall before the rest are skipped
+
+#define CLIENT_TABLE_SIZE  (2*MAX_CLIENTS) // power of 2, keeps load factor <= 0.5
+#define CLIENT_TABLE_EMPTY 0xFFFF
+
 typedef struct
 {
     int socket;
     u16 local_latest_packet_id;
-    u16 remote_latest_packet_id;
-    PacketQueue latest_received_packets;
+    ReceivedPackets received;
 } NodeInfo;
 
+typedef struct
+{
+    u16    packet_id;
+    double time_sent;
+    u32    tick;
+    u8     part;
+    u16    size;
+    bool   acked;
+} PacketInfo;
+
+typedef struct
+{
+    u32 tick;
+    u8  num_parts;
+    u32 acked_parts;
+
+    // clients the receiver holds after this snapshot and how many ticks old
+    // each one's value is, needed to rebuild that when it's the baseline
+    u64 visible[MAX_CLIENTS/64];
+    u8  value_age[MAX_CLIENTS];
+} SnapshotInfo;
+
+// The bulk of a client's state, kept out of ClientInfo so only connected
+// clients take up room for it
+typedef struct
+{
+    PacketInfo   packet_info[PACKET_INFO_MAX_LEN];
+    SnapshotInfo snapshot_info[SNAPSHOT_HISTORY];
+    float        priority[MAX_CLIENTS]; // accumulated for each other client since it was last sent
+} ClientHistory;
+
 typedef struct
 {
     Address address;
-    u16 remote_latest_packet_id;
-    clock_t  time_of_latest_packet;
+    u64 key;
+    u16 local_latest_packet_id;
+    ReceivedPackets received;
+    double time_of_latest_packet;
+    ClientData data;
+
+    // authoritative movement, stepped once per input command
+    PlayerState state;
+    bool   has_input;
+    u16    input_sequence; // newest input applied
+    float  input_budget;   // commands it may still run, refilled at PLAYER_INPUT_RATE
+    double input_budget_time;
+
+    // grid cell the client is standing in, -1 if none
+    int grid_cell;
+    u16 grid_prev;
+    u16 grid_next;
+
+    // what has been sent to this client and what it has acknowledged,
+    // allocated when it connects
+    ClientHistory* history;
+    bool has_acked_snapshot;
+    u32  acked_tick;
+
+    // shots the rewind confirmed, wrapping, told back to it in each snapshot
+    u8  hits;
+    u16 last_hit_id;
+
+    // packets from oldest_unresolved_id on are neither acked nor given up on yet
+    CongestionState congestion;
+    u16 oldest_unresolved_id;
+    u32 next_send_tick;
+
+    // counted since the last metrics report, then started over
+    ClientMetrics metrics;
 } ClientInfo;
 
+// A client packet decoded off the wire, ready to be applied to the client's state
 typedef struct
 {
-    u16    packet_id;
-    double time_sent;
-} PacketInfo;
+    Address      from;
+    u32          len;
+    PacketHeader header;
+    u8           num_inputs;
+    PlayerInput  inputs[PLAYER_INPUT_REDUNDANCY]; // oldest first
+} ServerUpdate;
+
+// Outgoing datagrams queued up for one socket_send_batch call
+typedef struct
+{
+    int            socket;
+    u8             buffers[SERVER_SEND_BUFFER_COUNT][MAX_PACKET_DATA_SIZE];
+    SocketDatagram datagrams[SERVER_SEND_BUFFER_COUNT];
+    int            count;
+    u32            failed; // datagrams the socket wouldn't take, for metrics
+} SendBatch;
+
+#if defined(__linux__)
+typedef struct
+{
+    int index;
+    int socket;   // SO_REUSEPORT socket of its own on PORT
+    int event_fd; // epoll over socket and wake_fd
+    int wake_fd;  // eventfd the tick thread signals to start a broadcast
+    pthread_t thread;
+
+    // Datagrams are received straight into pool buffers and their handles
+    // queued for the tick thread, which frees them once applied.
+    PacketPool  pool;
+    PacketQueue queue;
+    SendBatch   send;
+
+    PacketHandle   recv_handles[SOCKET_BATCH_MAX]; // buffers for the next batch, NONE until allocated
+    SocketDatagram recv_datagrams[SOCKET_BATCH_MAX];
+    u8             discard_buffer[MAX_PACKET_DATA_SIZE]; // read into when the pool runs dry
+
+    // datagrams thrown away, collected by the tick thread for metrics
+    atomic_uint dropped_pool_empty;
+    atomic_uint dropped_queue_full;
+} ServerWorker;
+#endif
 
-u32 game_id = 0;
+// One client's snapshot entry as encoded against one baseline value
+typedef struct
+{
+    _Atomic u64 key; // see get_entry_key, ENTRY_CACHE_BUSY while it's being written
+    u8 mask;
+    u8 num_bits;
+    u8 data[ENTRY_CACHE_MAX_BITS/8];
+} EncodedEntry;
 
 // ---
 
 static Address server_address = {0};
+
+// Clients live in stable slots indexed by client id. The address table maps
+// packed ip+port to a slot and the active list allows iterating only the
+// connected clients; all three are updated in O(1) on connect/disconnect.
 static ClientInfo server_clients[MAX_CLIENTS] = {0};
+static u16 server_client_table[CLIENT_TABLE_SIZE];
+static u16 server_active_ids[MAX_CLIENTS];
+static u16 server_active_index[MAX_CLIENTS];
+static u16 server_free_ids[MAX_CLIENTS];
+static u16 server_num_free_ids = 0;
 
-static u8 server_num_clients = 0;
+static u16 server_num_clients = 0;
+
+// Uniform grid over the terrain's x/z extents, each cell heading a list of
+// the clients standing in it so nearby clients can be found without a scan.
+static u16 server_grid_cells[AOI_GRID_MAX*AOI_GRID_MAX];
+static int server_grid_width  = 0;
+static int server_grid_height = 0;
 
-static PacketInfo packet_info[PACKET_INFO_MAX_LEN] = {0};
-static u32 packet_info_index = 0;
 static Timer server_timer = {0};
-static WorldState world_state = {0};
+static int server_event_fd = -1;
+static int server_timer_fd = -1; // in the epoll set, armed for the end of each wait
+static atomic_bool server_stopping = false; // set by net_server_stop, from a signal handler
+
+static u8             server_recv_buffers[SOCKET_BATCH_MAX][MAX_PACKET_DATA_SIZE];
+static SocketDatagram server_recv_datagrams[SOCKET_BATCH_MAX];
+
+static SendBatch      server_send_batch;
+
+#if defined(__linux__)
+// Receive workers. Each one owns a socket and drains it into its packet pool,
+// the tick thread applies what they queue and then has them split the broadcast.
+static ServerWorker*     server_workers[SERVER_MAX_WORKERS];
+static int               server_num_workers = 0;
+static pthread_barrier_t server_broadcast_barrier;
+static WorldState*       server_broadcast_state = NULL;
+static atomic_bool       server_workers_stopping = false;
+
+// Workers signal it when they queue packets, the tick thread sleeps on it
+// like the single threaded server sleeps on its socket. The flag saves a
+// write for every batch while the tick thread hasn't drained the last ones.
+static int               server_drain_fd = -1;
+static atomic_bool       server_drain_signaled = false;
+#endif
 
-static void create_game_id()
-{
-    game_id = 0x98325423;
-}
+static WorldState world_history[SNAPSHOT_HISTORY] = {0};
+static u32 server_tick = 0;
 
-static inline int get_packet_size(Packet* pkt)
-{
-    return (sizeof(pkt->header) + pkt->data_len);
-}
+// the last slot is each client encoded in full, for receivers with no baseline value
+static EncodedEntry server_entry_cache[MAX_CLIENTS][ENTRY_CACHE_SLOTS+1];
+static double server_tick_time = 0.0; // seconds the last tick spent receiving, capturing and sending
+static double server_tick_start = 0.0; // server_get_time() when the newest world state was captured
 
-static u32 get_ack_bit_field(NodeInfo* node_info)
-{
-    u32 bit_field = 0;
+// a replay runs the server off the capture's clock and sends nowhere
+static bool   server_replaying = false;
+static double server_replay_time = 0.0;
+static u64    server_replay_packets_out = 0;
+static u64    server_replay_bytes_out = 0;
 
-    //node_info->latest_received_packets;
+// accumulated over METRICS_INTERVAL, then handed to the metrics writer
+static ServerMetrics server_metrics;
+static double server_metrics_start = 0.0;
 
-    return bit_field;
+// The clock the server's decisions run on: the wall clock when live, the
+// capture's when replaying, so a replay decides the same way every run.
+static double server_get_time()
+{
+    return server_replaying ? server_replay_time : timer_get_time();
 }
 
-static inline bool is_packet_id_greater(u16 id, u16 cmp)
+static inline int get_packet_size(Packet* pkt)
 {
-    return ((id > cmp) && (id - cmp <= 32768)) || 
-           ((id < cmp) && (cmp - id  > 32768));
+    return (PACKET_HEADER_SIZE + pkt->data_len);
 }
 
 static void print_packet(Packet* pkt)
@@ -98,7 +310,7 @@ static void print_packet(Packet* pkt)
     printf("\n");
 }
 
-static bool has_data_waiting(int socket)
+static bool wait_for_data(int socket, double timeout)
 {
     fd_set readfds;
 
@@ -111,6 +323,9 @@ static bool has_data_waiting(int socket)
     int activity;
 
     struct timeval tv = {0};
+    tv.tv_sec  = (time_t)timeout;
+    tv.tv_usec = (suseconds_t)((timeout - tv.tv_sec)*1000000.0);
+
     activity = select(socket + 1 , &readfds , NULL , NULL , &tv);
 
     if ((activity < 0) && (errno!=EINTR))
@@ -125,8 +340,10 @@ static bool has_data_waiting(int socket)
 
 static int net_send(NodeInfo* node_info, Address* to, Packet* pkt)
 {
-    int pkt_len = get_packet_size(pkt);
-    int sent_bytes = socket_sendto(node_info->socket, to, (u8*)pkt, pkt_len);
+    u8 buf[MAX_PACKET_DATA_SIZE];
+    u32 len = write_packet(buf, pkt);
+
+    int sent_bytes = socket_sendto(node_info->socket, to, buf, len);
 
     //printf("[SENT] Packet %d (%u B)\n",pkt->header.packet_id,sent_bytes);
 
@@ -135,281 +352,2087 @@ static int net_send(NodeInfo* node_info, Address* to, Packet* pkt)
     return sent_bytes;
 }
 
-static int net_recv(NodeInfo* node_info, Address* from, Packet* pkt, bool* is_latest)
+static NodeInfo server_info = {0};
+
+// socket is the server's, or the workers' drain event when they receive for it
+static bool server_events_init(int socket)
+{
+#if defined(__linux__)
+    server_event_fd = epoll_create1(0);
+    if(server_event_fd < 0)
+    {
+        perror("Failed to create epoll instance.\n");
+        return false;
+    }
+
+    // edge-triggered: one wakeup per burst, the socket is then drained until it would block
+    struct epoll_event ev = {0};
+    ev.events  = EPOLLIN | EPOLLET;
+    ev.data.fd = socket;
+
+    if(epoll_ctl(server_event_fd, EPOLL_CTL_ADD, socket, &ev) < 0)
+    {
+        perror("Failed to add socket to epoll instance.\n");
+        return false;
+    }
+
+    // epoll_wait's timeout is in whole ms, a timer wakes it to the us
+    server_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if(server_timer_fd < 0)
+    {
+        perror("Failed to create timerfd.\n");
+        return false;
+    }
+
+    ev.events  = EPOLLIN;
+    ev.data.fd = server_timer_fd;
+
+    if(epoll_ctl(server_event_fd, EPOLL_CTL_ADD, server_timer_fd, &ev) < 0)
+    {
+        perror("Failed to add timerfd to epoll instance.\n");
+        return false;
+    }
+#endif
+    return true;
+}
+
+// sleeps until data arrives on the server socket, or the workers have queued
+// some, or it's time (as timer_get_time())
+static void server_wait_for_data(double time)
 {
-    int recv_bytes = socket_recvfrom(node_info->socket, from, (u8*)pkt);
+#if defined(__linux__)
+    struct itimerspec its = {0};
+    int flags = 0;
 
-    if(is_packet_id_greater(pkt->header.packet_id,node_info->remote_latest_packet_id))
+    if(timer_is_monotonic())
     {
-        node_info->remote_latest_packet_id = pkt->header.packet_id;
-        *is_latest = true;
+        // absolute, so being preempted on the way in doesn't add to the wait
+        u64 ns = timer_get_clock_ns(time);
+        its.it_value.tv_sec  = ns / 1000000000;
+        its.it_value.tv_nsec = ns % 1000000000;
+        flags = TFD_TIMER_ABSTIME;
     }
     else
     {
-        *is_latest = false;
+        // the timer isn't counting on the timerfd's clock, so from now.
+        // A zero value would disarm it, at least 1ns fires right away.
+        double duration = MAX(time - timer_get_time(), 0.000000001);
+        its.it_value.tv_sec  = (time_t)duration;
+        its.it_value.tv_nsec = MAX((long)((duration - its.it_value.tv_sec) * 1000000000.0), 1);
     }
 
-    //packet_queue_enqueue(&node_info->latest_received_packets,pkt);
+    if(timerfd_settime(server_timer_fd, flags, &its, NULL) < 0)
+        perror("timerfd_settime error");
+
+    struct epoll_event ev;
+    int num_events = epoll_wait(server_event_fd, &ev, 1, -1);
+
+    if(num_events < 0 && errno != EINTR)
+        perror("epoll_wait error");
 
-    return recv_bytes;
+    // clear it, or it stays readable
+    u64 expirations;
+    if(read(server_timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        perror("Failed to read timerfd");
+#else
+    wait_for_data(server_info.socket, MAX(time - timer_get_time(), 0.0));
+#endif
 }
 
-static NodeInfo server_info = {0};
+static inline u64 get_address_key(Address* address)
+{
+    return ((u64)address->a << 40) | ((u64)address->b << 32) | ((u64)address->c << 24) | ((u64)address->d << 16) | address->port;
+}
 
-int net_server_start()
+static inline u32 get_client_table_slot(u64 key)
 {
-    int sock;
+    // fibonacci hashing
+    return (u32)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (CLIENT_TABLE_SIZE-1);
+}
 
-    printf("Creating socket.\n");
-    socket_create(&sock);
+static inline int get_grid_coord(float value, int axis, int num_cells)
+{
+    int coord = (int)floorf((value - position_range.min[axis]) / AOI_CELL_SIZE);
+    return (coord < 0) ? 0 : (coord >= num_cells) ? num_cells-1 : coord;
+}
 
-    printf("Binding socket %u to any local ip on port %u.\n", sock, PORT);
-    socket_bind(sock, NULL, PORT);
+static void server_grid_init()
+{
+    server_grid_width  = (int)ceilf(position_range.steps[0]*POSITION_PRECISION / AOI_CELL_SIZE);
+    server_grid_height = (int)ceilf(position_range.steps[2]*POSITION_PRECISION / AOI_CELL_SIZE);
 
-    server_info.socket = sock;
+    server_grid_width  = MAX(1, MIN(server_grid_width,  AOI_GRID_MAX));
+    server_grid_height = MAX(1, MIN(server_grid_height, AOI_GRID_MAX));
 
-    printf("Creating packet queue.\n");
-    /*
-    bool queue_created = packet_queue_create(&server_info.latest_received_packets,MAX_PRIOR_PACKETS+1);
-    if(!queue_created)
-    {
-        printf("Failed to create prior packets queue!\n");
-        return -1;
-    }
-    */
+    memset(server_grid_cells, 0xFF, sizeof(server_grid_cells));
+}
 
-    create_game_id();
+static void server_grid_unlink(u16 id)
+{
+    ClientInfo* client = &server_clients[id];
 
-    /*
-    printf("Initializing GLFW.\n");
+    if(client->grid_cell < 0)
+        return;
 
-    if(!glfwInit())
-    {
-        fprintf(stderr,"Failed to init GLFW!\n");
-        return false;
-    }
-    */
+    if(client->grid_prev != GRID_END)
+        server_clients[client->grid_prev].grid_next = client->grid_next;
+    else
+        server_grid_cells[client->grid_cell] = client->grid_next;
 
-    printf("Server started.\n");
+    if(client->grid_next != GRID_END)
+        server_clients[client->grid_next].grid_prev = client->grid_prev;
 
-    timer_set_fps(&server_timer,SERVER_RATE);
-    timer_begin(&server_timer);
+    client->grid_cell = -1;
+}
 
-    for(;;)
-    {
-        // Read packets
-        for(;;)
-        {
-            bool data_waiting = has_data_waiting(server_info.socket);
+// moves the client to the cell its current position falls in
+static void server_grid_update(u16 id)
+{
+    ClientInfo* client = &server_clients[id];
 
-            if(!data_waiting)
-                break;
+    int x = get_grid_coord(client->data.position.x, 0, server_grid_width);
+    int z = get_grid_coord(client->data.position.z, 2, server_grid_height);
+    int cell = z*server_grid_width + x;
 
-            Address from = {0};
-            Packet recv_packet = {0};
+    if(cell == client->grid_cell)
+        return;
 
-            bool is_latest;
-            int bytes_received = net_recv(&server_info, &from, &recv_packet, &is_latest);
+    server_grid_unlink(id);
 
-            //print_packet(&recv_packet);
+    client->grid_cell = cell;
+    client->grid_prev = GRID_END;
+    client->grid_next = server_grid_cells[cell];
 
-            // validate packet is legit
-            if(recv_packet.header.game_id != game_id)
-            {
-                printf("Invalid packet game_id 0x%08x != 0x%08x\n",recv_packet.header.game_id, game_id);
-                timer_delay_us(10); // delay 10 us
-                continue;
-            }
+    if(client->grid_next != GRID_END)
+        server_clients[client->grid_next].grid_prev = id;
 
-            bool new_client = true;
-            int client_id = -1;
+    server_grid_cells[cell] = id;
+}
 
-            for(int i = 0; i < server_num_clients; ++i)
-            {
-                // add client to client list if they are new
-                if(server_clients[i].address.a    == from.a &&
-                   server_clients[i].address.b    == from.b &&
-                   server_clients[i].address.c    == from.c &&
-                   server_clients[i].address.d    == from.d &&
-                   server_clients[i].address.port == from.port)
-                {
-                    new_client = false;
-                    client_id = i;
-                    break;
-                }
-            }
+static void server_clients_init()
+{
+    memset(server_client_table, 0xFF, sizeof(server_client_table));
 
-            if(new_client)
-            {
-                client_id = server_num_clients;
+    // hand out low ids first
+    server_num_free_ids = MAX_CLIENTS;
+    for(int i = 0; i < MAX_CLIENTS; ++i)
+        server_free_ids[i] = MAX_CLIENTS - 1 - i;
 
-                printf("Client Connected! %u.%u.%u.%u:%u\n",from.a,from.b,from.c,from.d,from.port);
+    server_num_clients = 0;
 
-                // Copy address to server clients addresses
-                memcpy(&server_clients[server_num_clients].address,&from,sizeof(Address));
-                server_num_clients++;
-                world_state.num_clients = server_num_clients;
+    server_grid_init();
+}
 
-                printf("Num Clients: %u\n",server_num_clients);
-            }
+static int server_find_client(u64 key)
+{
+    u32 slot = get_client_table_slot(key);
 
-            is_latest = is_packet_id_greater(recv_packet.header.packet_id,server_clients[client_id].remote_latest_packet_id);
+    for(;;)
+    {
+        u16 id = server_client_table[slot];
 
-            if(new_client || is_latest)
-            {
-                server_clients[client_id].remote_latest_packet_id = recv_packet.header.packet_id;
-                server_clients[client_id].time_of_latest_packet = timer_get_time();
-                memcpy(&world_state.client_data[client_id],recv_packet.data,recv_packet.data_len);
+        if(id == CLIENT_TABLE_EMPTY)
+            return -1;
 
-                ClientData* c = (ClientData*)&world_state.client_data[client_id];
-                printf("Client %u: P %f %f %f R %f %f\n",client_id,c->position.x,c->position.y,c->position.z,c->angle_h,c->angle_v);
-            }
+        if(server_clients[id].key == key)
+            return id;
 
-            timer_delay_us(10); // delay 10 us
-        }
+        slot = (slot + 1) & (CLIENT_TABLE_SIZE-1);
+    }
+}
 
-        if(server_num_clients > 0)
-        {
-            // disconnect any client that hasn't sent a packet in DISCONNECTION_TIMEOUT
-            for(int i = 0; i < server_num_clients; ++i)
-            {
-                double time_elapsed = timer_get_time() - server_clients[i].time_of_latest_packet;
+static int server_add_client(Address* address, u64 key)
+{
+    if(server_num_free_ids == 0)
+        return -1;
 
-                if(time_elapsed >= DISCONNECTION_TIMEOUT)
-                {
-                    Address* addr = &server_clients[i].address;
-                    printf("Client Disconnected! %u.%u.%u.%u:%u\n",addr->a,addr->b,addr->c,addr->d,addr->port);
+    ClientHistory* history = calloc(1, sizeof(ClientHistory));
+    if(!history)
+    {
+        printf("Failed to allocate client history.\n");
+        return -1;
+    }
 
-                    // Disconnect client
-                    server_num_clients--;
-                    world_state.num_clients = server_num_clients;
+    u16 id = server_free_ids[--server_num_free_ids];
 
-                    memcpy(&server_clients[i], &server_clients[server_num_clients], sizeof(ClientInfo));
+    ClientInfo* client = &server_clients[id];
+    memset(client, 0, sizeof(ClientInfo));
+    client->history = history;
+    client->address = *address;
+    client->key = key;
+    client->grid_cell = -1;
 
-                    printf("Num Clients: %u\n",server_num_clients);
-                }
-            }
-#if 1
+    // same spawn as player_init, so prediction starts out agreeing
+    client->state.position.y = PLAYER_HEIGHT;
+    client->data.position = client->state.position;
+    client->input_budget = PLAYER_INPUT_BURST;
+    client->input_budget_time = server_get_time();
 
-            // Send packets to all "connected" clients
-            for(int i = 0; i < server_num_clients; ++i)
-            {
-                // Fill out packet
-                Packet send_packet = {
-                    .header.game_id = game_id,
-                    .header.packet_id = server_info.local_latest_packet_id,
-                    .header.type = PACKET_TYPE_WORLD_STATE,
-                    .header.ack = server_clients[i].remote_latest_packet_id,
-                    .header.ack_bitfield = get_ack_bit_field(&server_info)
-                };
-
-                world_state.ignore_id = i;
-                send_packet.data_len = sizeof(world_state);
-                memcpy(send_packet.data,(u8*)&world_state,sizeof(world_state));
-
-                net_send(&server_info,&server_clients[i].address,&send_packet);
-            }
-#endif
-            
+    congestion_init(&client->congestion, client->input_budget_time);
+
+    // a client acks packet 0 until it has received something, so the first real one is 1
+    client->history->packet_info[0].acked = true;
+    client->local_latest_packet_id = 1;
+    client->oldest_unresolved_id = 1;
+
+    u32 slot = get_client_table_slot(key);
+    while(server_client_table[slot] != CLIENT_TABLE_EMPTY)
+        slot = (slot + 1) & (CLIENT_TABLE_SIZE-1);
+
+    server_client_table[slot] = id;
+
+    server_active_index[id] = server_num_clients;
+    server_active_ids[server_num_clients++] = id;
+
+    server_grid_update(id);
+
+    return id;
+}
+
+static void server_remove_client(u16 id)
+{
+    server_grid_unlink(id);
+
+    // find the table slot holding this client
+    u32 slot = get_client_table_slot(server_clients[id].key);
+    while(server_client_table[slot] != id)
+        slot = (slot + 1) & (CLIENT_TABLE_SIZE-1);
+
+    // backward shift deletion so probe sequences stay intact without tombstones
+    u32 hole = slot;
+    u32 next = (hole + 1) & (CLIENT_TABLE_SIZE-1);
 
-            /*
-            
-            // Update packet info
-            packet_info[packet_info_index].packet_id = send_packet.header.packet_id;
-            packet_info[packet_info_index].time_sent = timer_get_elapsed(&server_timer);
-            packet_info_index++;
-            if(packet_info_index >= PACKET_INFO_MAX_LEN)
-                packet_info_index = 0;
-                */
+    while(server_client_table[next] != CLIENT_TABLE_EMPTY)
+    {
+        u32 home = get_client_table_slot(server_clients[server_client_table[next]].key);
 
-            server_info.local_latest_packet_id++;
+        // move the entry back if the hole lies cyclically between its home slot and where it sits
+        bool can_move = (next > hole) ? (home <= hole || home > next) : (home <= hole && home > next);
+        if(can_move)
+        {
+            server_client_table[hole] = server_client_table[next];
+            hole = next;
         }
 
-        timer_wait_for_frame(&server_timer);
-        timer_inc_frame(&server_timer);
+        next = (next + 1) & (CLIENT_TABLE_SIZE-1);
     }
+
+    server_client_table[hole] = CLIENT_TABLE_EMPTY;
+
+    // swap-remove from the active list
+    u16 index = server_active_index[id];
+    u16 last_id = server_active_ids[--server_num_clients];
+
+    server_active_ids[index] = last_id;
+    server_active_index[last_id] = index;
+
+    free(server_clients[id].history);
+    server_clients[id].history = NULL;
+
+    server_free_ids[server_num_free_ids++] = id;
 }
 
-bool net_client_set_server_ip(char* address)
+static void server_ack_packet(ClientInfo* client, u16 packet_id, double now)
 {
-    // example input:
-    // 200.100.24.10
+    PacketInfo* info = &client->history->packet_info[packet_id % PACKET_INFO_MAX_LEN];
 
-    char num_str[3] = {0};
-    u8   bytes[4]  = {0};
+    if(info->packet_id != packet_id || info->acked)
+        return;
+
+    info->acked = true;
+
+    congestion_on_rtt(&client->congestion, (float)(now - info->time_sent), now);
+
+    // one that already timed out was counted as lost
+    if((s16)(packet_id - client->oldest_unresolved_id) >= 0)
+        congestion_on_acked(&client->congestion, info->size);
+
+    SnapshotInfo* snapshot = &client->history->snapshot_info[info->tick % SNAPSHOT_HISTORY];
+    if(snapshot->tick != info->tick)
+        return;
 
-    u8   num_str_index = 0, byte_index = 0;
+    snapshot->acked_parts |= (1u << info->part);
 
-    for(int i = 0; i < strlen(address)+1; ++i)
+    // a snapshot can serve as a baseline once every one of its parts has arrived
+    u32 all_parts = (snapshot->num_parts >= 32) ? 0xFFFFFFFF : ((1u << snapshot->num_parts) - 1);
+
+    if(snapshot->acked_parts == all_parts)
     {
-        if(address[i] == '.' || address[i] == '\0')
+        if(!client->has_acked_snapshot || is_tick_greater(snapshot->tick, client->acked_tick))
         {
-            bytes[byte_index++] = atoi(num_str);
-            memset(num_str,0,3*sizeof(char));
-            num_str_index = 0;
-            continue;
+            client->acked_tick = snapshot->tick;
+            client->has_acked_snapshot = true;
         }
-
-        num_str[num_str_index++] = address[i];
     }
+}
 
-    server_address.a = bytes[0];
-    server_address.b = bytes[1];
-    server_address.c = bytes[2];
-    server_address.d = bytes[3];
+// Moves past the oldest packet still waiting on an ack, counting it as lost if it isn't acked
+static void server_resolve_oldest(ClientInfo* client)
+{
+    u16 id = client->oldest_unresolved_id++;
+    PacketInfo* info = &client->history->packet_info[id % PACKET_INFO_MAX_LEN];
 
-    server_address.port = PORT;
+    if(info->packet_id != id || !info->acked)
+        congestion_on_lost(&client->congestion);
+}
 
-    return true;
+static void server_resolve_losses(ClientInfo* client, double now)
+{
+    float timeout = congestion_loss_timeout(&client->congestion);
+
+    while(client->oldest_unresolved_id != client->local_latest_packet_id)
+    {
+        PacketInfo* info = &client->history->packet_info[client->oldest_unresolved_id % PACKET_INFO_MAX_LEN];
+
+        if(!info->acked && now - info->time_sent < timeout)
+            break;
+
+        server_resolve_oldest(client);
+    }
 }
 
-static NodeInfo client_info = {0};
+static void server_process_acks(ClientInfo* client, u16 ack, u32 ack_bitfield)
+{
+    double now = server_get_time();
 
-bool net_client_init()
+    server_ack_packet(client, ack, now);
+
+    for(int i = 0; i < 32; ++i)
+    {
+        if(ack_bitfield & (1u << i))
+            server_ack_packet(client, ack - 1 - i, now);
+    }
+}
+
+// Decodes a received datagram. Returns false if it isn't a valid packet.
+static bool server_parse_packet(Address* from, u8* data, u32 len, ServerUpdate* update)
 {
-    int sock;
+    PacketView view;
+    if(!parse_packet(data, len, &view))
+        return false;
 
-    printf("Creating socket.\n");
-    socket_create(&sock);
+    update->header = view.header;
 
-    client_info.socket = sock;
-    create_game_id();
+    // validate packet is legit
+    if(update->header.game_id != game_id)
+        return false;
+
+    update->from = *from;
+    update->len = len;
+    update->num_inputs = 0;
+
+    if(update->header.type != PACKET_TYPE_INPUT)
+        return true;
+
+    // newest sequence, then that many inputs counting back from it
+    BitReader r;
+    bit_reader_init(&r, view.data, view.data_len);
+
+    u16 sequence = bit_read(&r, 16);
+    u8  count    = bit_read(&r, INPUT_COUNT_BITS) + 1;
 
+    for(int i = count-1; i >= 0; --i)
+    {
+        PlayerInput* input = &update->inputs[i];
+        read_player_input(&r, input);
+        input->sequence = sequence - (count-1-i);
+    }
+
+    if(r.overflow)
+        return false;
+
+    update->num_inputs = count;
     return true;
 }
 
-bool net_client_data_waiting()
+// Lag compensation. The shooter drew everyone interp_delay behind the server
+// time of its newest snapshot, which was already half a round trip old when it
+// arrived, and the shot took the other half to get here. In ticks, fractional.
+static double server_get_view_tick(ClientInfo* client, PlayerInput* input, double now)
 {
-    bool data_waiting = has_data_waiting(client_info.socket);
-    return data_waiting;
+    double newest = server_tick - 1;
+    double arrival = newest + (now - server_tick_start)*SERVER_RATE;
+    double rewind = MIN(client->congestion.srtt + input->interp_delay, LAG_COMPENSATION_MAX);
+
+    return MAX(MIN(arrival - rewind*SERVER_RATE, newest), 0.0);
 }
 
-int net_client_send(u8* data, u32 len)
+// Tests the segment p1 -> p2 against every client but ignore_id where they were
+// at view_tick, in between the two captured ticks around it like the client
+// interpolates. Returns the nearest one hit, -1 if none.
+static int server_rewind_line_test(u16 ignore_id, Vector3f p1, Vector3f p2, double view_tick)
 {
-    Packet pkt = {
-        .header.game_id = game_id,
-        .header.packet_id = client_info.local_latest_packet_id,
-        .header.ack = client_info.remote_latest_packet_id,
-        .header.ack_bitfield = 0
-    };
+    u32 tick = (u32)view_tick;
+    float t = (float)(view_tick - tick);
 
-    memcpy(pkt.data,data,len);
-    pkt.data_len = len;
+    WorldState* a = &world_history[tick % SNAPSHOT_HISTORY];
+    WorldState* b = &world_history[(tick+1) % SNAPSHOT_HISTORY];
 
-    //print_packet(&pkt);
+    if(a->tick != tick)
+        return -1;
 
-    int sent_bytes = net_send(&client_info, &server_address, &pkt);
-    return sent_bytes;
+    bool has_next = (b->tick == tick+1);
+
+    int hit_id = -1;
+    float nearest = 1.0f;
+
+    for(int i = 0; i < MAX_CLIENTS / 64; ++i)
+    {
+        u64 bits = a->present[i];
+
+        while(bits)
+        {
+            u16 id = i*64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            if(id == ignore_id)
+                continue;
+
+            Vector3f pos = a->client_data[id].position;
+
+            if(has_next && world_state_has_client(b, id))
+            {
+                Vector3f* next = &b->client_data[id].position;
+
+                pos.x += (next->x - pos.x)*t;
+                pos.y += (next->y - pos.y)*t;
+                pos.z += (next->z - pos.z)*t;
+            }
+
+            float hit_t;
+            if(phys_collision_line_sphere(p1, p2, pos, PLAYER_HIT_RADIUS, &hit_t) && hit_t <= nearest)
+            {
+                nearest = hit_t;
+                hit_id = id;
+            }
+        }
+    }
+
+    return hit_id;
 }
 
-int net_client_recv(Packet* pkt, bool* is_latest)
+// Same ray the client targets with, from where the shot was fired
+static void server_fire(u16 client_id, PlayerInput* input, double now)
 {
-    Address from = {0};
-    int recv_bytes = net_recv(&client_info, &from, pkt, is_latest);
-    return recv_bytes;
+    if(server_tick == 0)
+        return;
+
+    ClientInfo* client = &server_clients[client_id];
+
+    Vector3f dir, up;
+    get_view_vectors(input->angle_h, input->angle_v, &dir, &up);
+
+    Vector3f p1 = client->state.position;
+    Vector3f p2 = {
+        p1.x + PLAYER_FIRE_RANGE*dir.x,
+        p1.y + PLAYER_FIRE_RANGE*dir.y,
+        p1.z + PLAYER_FIRE_RANGE*dir.z
+    };
+
+    double view_tick = server_get_view_tick(client, input, now);
+    int hit_id = server_rewind_line_test(client_id, p1, p2, view_tick);
+
+    server_metrics.shots++;
+    metrics_histogram_add(&server_metrics.rewind_time, (server_tick - 1 - view_tick)/SERVER_RATE + (now - server_tick_start));
+
+    if(hit_id >= 0)
+    {
+        client->hits++;
+        client->last_hit_id = hit_id;
+        server_metrics.hits++;
+    }
 }
 
-void net_client_deinit()
+// Moves the client by each input it hasn't run yet, as far as its budget allows.
+// The budget keeps a client from moving faster by sending commands faster.
+static void server_apply_inputs(u16 client_id, ServerUpdate* update)
 {
+    ClientInfo* client = &server_clients[client_id];
+
+    double now = server_get_time();
+    client->input_budget += (now - client->input_budget_time)*PLAYER_INPUT_RATE;
+    client->input_budget = MIN(client->input_budget, PLAYER_INPUT_BURST);
+    client->input_budget_time = now;
+
+    for(int i = 0; i < update->num_inputs; ++i)
+    {
+        PlayerInput* input = &update->inputs[i];
+
+        if(client->has_input && !is_packet_id_greater(input->sequence, client->input_sequence))
+            continue;
+
+        if(client->input_budget < 1.0f)
+        {
+            // left for the redundant copies in later packets
+            client->metrics.drops++;
+            server_metrics.drops[DROP_INPUT_BUDGET]++;
+            break;
+        }
+
+        client->input_budget -= 1.0f;
+
+        player_move(&client->state, input);
+
+        client->has_input = true;
+        client->input_sequence = input->sequence;
+
+        client->data.position = client->state.position;
+        client->data.angle_h  = input->angle_h;
+        client->data.angle_v  = input->angle_v;
+
+        if(input->keys & PLAYER_KEY_FIRE)
+            server_fire(client_id, input, now);
+    }
+}
+
+static void server_apply_update(ServerUpdate* update)
+{
+    Address* from = &update->from;
+    PacketHeader* header = &update->header;
+
+    u64 key = get_address_key(from);
+
+    bool new_client = false;
+    int client_id = server_find_client(key);
+
+    if(client_id < 0)
+    {
+        client_id = server_add_client(from, key);
+        if(client_id < 0)
+        {
+            server_metrics.drops[DROP_SERVER_FULL]++;
+            return;
+        }
+
+        new_client = true;
+
+        printf("Client Connected! %u.%u.%u.%u:%u\n",from->a,from->b,from->c,from->d,from->port);
+        printf("Num Clients: %u\n",server_num_clients);
+    }
+
+    ClientInfo* client = &server_clients[client_id];
+
+    client->metrics.packets_in++;
+    client->metrics.bytes_in += update->len;
+
+    bool is_latest = !client->received.received_any || is_packet_id_greater(header->packet_id,client->received.latest_id);
+
+    if(!update_received_packets(&client->received, header->packet_id))
+    {
+        client->metrics.drops++;
+        server_metrics.drops[DROP_STALE]++;
+        return;
+    }
+
+    server_process_acks(client, header->ack, header->ack_bitfield);
+
+    if(new_client || is_latest)
+        client->time_of_latest_packet = server_get_time();
+
+    if(update->num_inputs == 0)
+        return;
+
+    u16 input_sequence = client->input_sequence;
+    server_apply_inputs(client_id, update);
+
+    if(client->input_sequence != input_sequence)
+        server_grid_update(client_id);
+}
+
+static int server_recv_batch(int socket, SocketDatagram* datagrams, u8 buffers[][MAX_PACKET_DATA_SIZE])
+{
+    for(int i = 0; i < SOCKET_BATCH_MAX; ++i)
+    {
+        datagrams[i].data = buffers[i];
+        datagrams[i].len  = MAX_PACKET_DATA_SIZE;
+    }
+
+    return socket_recv_batch(socket, datagrams, SOCKET_BATCH_MAX);
+}
+
+static void server_recv_packets()
+{
+    // the socket is edge-triggered so it has to be read until it would block,
+    // otherwise anything left in the buffer waits for the next datagram to arrive.
+    for(;;)
+    {
+        int num_recv = server_recv_batch(server_info.socket, server_recv_datagrams, server_recv_buffers);
+
+        for(int i = 0; i < num_recv; ++i)
+        {
+            SocketDatagram* d = &server_recv_datagrams[i];
+
+            ServerUpdate update;
+            if(server_parse_packet(&d->address, d->data, d->len, &update))
+                server_apply_update(&update);
+            else
+                server_metrics.drops[DROP_MALFORMED]++;
+        }
+
+        // a short batch means recvmmsg hit EAGAIN
+        if(num_recv < SOCKET_BATCH_MAX)
+            break;
+    }
+}
+
+static void server_flush_sends(SendBatch* batch)
+{
+    if(batch->count == 0)
+        return;
+
+    if(server_replaying)
+    {
+        for(int i = 0; i < batch->count; ++i)
+            server_replay_bytes_out += batch->datagrams[i].len;
+
+        server_replay_packets_out += batch->count;
+        batch->count = 0;
+        return;
+    }
+
+    int sent = socket_send_batch(batch->socket, batch->datagrams, batch->count);
+    batch->failed += batch->count - sent;
+    batch->count = 0;
+}
+
+// Queues a datagram to the client with its header written, returns the payload to fill in.
+// The datagram's len has to be set once the payload is complete.
+static u8* server_alloc_send(SendBatch* batch, ClientInfo* client, PacketType type, u16* packet_id)
+{
+    if(batch->count >= SERVER_SEND_BUFFER_COUNT)
+        server_flush_sends(batch);
+
+    u8* buf = batch->buffers[batch->count];
+
+    PacketHeader header = {
+        .game_id = game_id,
+        .packet_id = client->local_latest_packet_id++,
+        .type = type,
+        .ack = client->received.latest_id,
+        .ack_bitfield = get_ack_bit_field(&client->received)
+    };
+
+    write_packet_header(buf, &header);
+
+    SocketDatagram* d = &batch->datagrams[batch->count++];
+    d->address = client->address;
+    d->data    = buf;
+    d->len     = PACKET_HEADER_SIZE;
+
+    *packet_id = header.packet_id;
+    return buf + PACKET_HEADER_SIZE;
+}
+
+static void server_capture_world_state()
+{
+    WorldState* ws = &world_history[server_tick % SNAPSHOT_HISTORY];
+
+    server_tick_start = server_get_time();
+
+    ws->tick = server_tick;
+    ws->num_clients = server_num_clients;
+    memset(ws->present, 0, sizeof(ws->present));
+
+    for(int i = 0; i < server_num_clients; ++i)
+    {
+        u16 id = server_active_ids[i];
+
+        ws->present[id / 64] |= (1ULL << (id % 64));
+        ws->client_data[id] = server_clients[id].data;
+        quantize_client_data(&ws->client_data[id]);
+    }
+}
+
+// The state of client id as held by the receiver of this snapshot, NULL if it isn't in it
+static inline ClientData* get_snapshot_value(SnapshotInfo* snapshot, u16 id)
+{
+    if(!((snapshot->visible[id / 64] >> (id % 64)) & 1))
+        return NULL;
+
+    u32 value_tick = snapshot->tick - snapshot->value_age[id];
+    return &world_history[value_tick % SNAPSHOT_HISTORY].client_data[id];
+}
+
+// Finds the other clients within AOI_RADIUS of client_id, looking only at the
+// grid cells the radius overlaps, and adds to their priority: more the closer
+// they are and more again in front of where it's looking.
+static void server_compute_visibility(ClientInfo* client, u16 client_id, WorldState* current, u64* in_range)
+{
+    memset(in_range, 0, sizeof(u64)*(MAX_CLIENTS/64));
+
+    Vector3f* pos = &current->client_data[client_id].position;
+
+    Vector3f forward, up;
+    get_view_vectors(current->client_data[client_id].angle_h, 0.0f, &forward, &up);
+
+    int x0 = get_grid_coord(pos->x - AOI_RADIUS, 0, server_grid_width);
+    int x1 = get_grid_coord(pos->x + AOI_RADIUS, 0, server_grid_width);
+    int z0 = get_grid_coord(pos->z - AOI_RADIUS, 2, server_grid_height);
+    int z1 = get_grid_coord(pos->z + AOI_RADIUS, 2, server_grid_height);
+
+    for(int z = z0; z <= z1; ++z)
+    {
+        for(int x = x0; x <= x1; ++x)
+        {
+            for(u16 id = server_grid_cells[z*server_grid_width + x]; id != GRID_END; id = server_clients[id].grid_next)
+            {
+                if(id == client_id)
+                    continue;
+
+                Vector3f* other = &current->client_data[id].position;
+
+                float dx = other->x - pos->x;
+                float dz = other->z - pos->z;
+                float dist2 = dx*dx + dz*dz;
+
+                if(dist2 > AOI_RADIUS*AOI_RADIUS)
+                    continue;
+
+                in_range[id / 64] |= (1ULL << (id % 64));
+
+                float dist = sqrtf(dist2);
+                float priority = PRIORITY_NEAR;
+
+                if(dist > AOI_NEAR_RADIUS)
+                {
+                    float t = (dist - AOI_NEAR_RADIUS) / (AOI_RADIUS - AOI_NEAR_RADIUS);
+                    priority += (PRIORITY_FAR - PRIORITY_NEAR)*t;
+                }
+
+                // forward is level, so this is the angle on the ground plane
+                if(dx*forward.x + dz*forward.z < PRIORITY_VIEW_COS*dist)
+                    priority *= PRIORITY_BEHIND;
+
+                client->history->priority[id] += priority;
+            }
+        }
+    }
+}
+
+static SnapshotInfo* server_get_baseline(ClientInfo* client)
+{
+    if(!client->has_acked_snapshot)
+        return NULL;
+
+    // too old, the history slots it refers to have been reused. Values in it
+    // can be up to SNAPSHOT_MAX_VALUE_AGE ticks older than the snapshot itself.
+    if(server_tick - client->acked_tick > SNAPSHOT_HISTORY-1 - SNAPSHOT_MAX_VALUE_AGE)
+        return NULL;
+
+    SnapshotInfo* baseline = &client->history->snapshot_info[client->acked_tick % SNAPSHOT_HISTORY];
+    if(baseline->tick != client->acked_tick)
+        return NULL;
+
+    return baseline;
+}
+
+static inline u64 get_entry_key(u32 tick, u32 value_tick)
+{
+    // never 0, which is what the cache starts out as
+    return ((u64)(tick+1) << 32) | value_tick;
+}
+
+// Client id's entry this tick against the baseline value b from value_tick, or
+// in full if b is NULL, encoded by whichever receiver needs it first. Returns
+// NULL if its slot already holds another baseline value this tick or another
+// worker is writing it, then the caller encodes it itself.
+static EncodedEntry* server_get_encoded_entry(u16 id, ClientData* c, ClientData* b, u32 value_tick, u32 tick)
+{
+    EncodedEntry* e = &server_entry_cache[id][b ? value_tick % ENTRY_CACHE_SLOTS : ENTRY_CACHE_SLOTS];
+
+    u64 key = get_entry_key(tick, b ? value_tick : tick);
+    u64 old = atomic_load_explicit(&e->key, memory_order_acquire);
+
+    if(old == key)
+        return e;
+
+    // a slot is only reused once its tick is over, so never under a reader
+    if(old == ENTRY_CACHE_BUSY || (old >> 32) == (key >> 32))
+        return NULL;
+
+    if(!atomic_compare_exchange_strong_explicit(&e->key, &old, ENTRY_CACHE_BUSY, memory_order_acquire, memory_order_relaxed))
+        return NULL;
+
+    e->mask = get_entry_mask(c, b);
+    e->num_bits = 0;
+
+    if(e->mask)
+    {
+        BitWriter w;
+        memset(e->data, 0, sizeof(e->data));
+        bit_writer_init(&w, e->data, sizeof(e->data));
+        write_entry(&w, id, e->mask, c, b);
+        e->num_bits = w.bit_pos;
+    }
+
+    atomic_store_explicit(&e->key, key, memory_order_release);
+    return e;
+}
+
+static void server_begin_world_state_part(SendBatch* batch, ClientInfo* client, u16 client_id, WorldState* current, SnapshotInfo* baseline, u8 part, BitWriter* w)
+{
+    u16 packet_id;
+    u8* data = server_alloc_send(batch, client, PACKET_TYPE_WORLD_STATE, &packet_id);
+
+    bit_writer_init(w, data, PACKET_MAX_PAYLOAD);
+
+    WorldStateHeader h = {
+        .tick          = current->tick,
+        .has_baseline  = (baseline != NULL),
+        .baseline_tick = baseline ? baseline->tick : current->tick,
+        .num_clients   = current->num_clients,
+        .ignore_id     = client_id,
+        .part          = part,
+        .num_parts     = 1, // filled in once the whole snapshot is written
+        .num_entries   = 0, // filled in when the part is finished
+
+        // the first part also tells the client where it really is, for prediction
+        .tick_time      = server_tick_time,
+        .has_player     = client->has_input,
+        .input_sequence = client->input_sequence,
+        .player_state   = client->state,
+        .hits           = client->hits,
+        .last_hit_id    = client->last_hit_id
+    };
+
+    write_world_state_header(w, &h);
+
+    // the ring wrapped before this slot's packet was resolved
+    if((u16)(packet_id - client->oldest_unresolved_id) >= PACKET_INFO_MAX_LEN)
+        server_resolve_oldest(client);
+
+    PacketInfo* info = &client->history->packet_info[packet_id % PACKET_INFO_MAX_LEN];
+    info->packet_id = packet_id;
+    info->time_sent = server_get_time();
+    info->tick = current->tick;
+    info->part = part;
+    info->acked = false;
+}
+
+static void server_end_world_state_part(SendBatch* batch, BitWriter* w, u16 num_entries)
+{
+    write_bits_at(w->data, WORLD_STATE_NUM_ENTRIES_BIT, num_entries, ENTRY_COUNT_BITS);
+    batch->datagrams[batch->count-1].len = PACKET_HEADER_SIZE + bit_writer_get_bytes(w);
+}
+
+// Only touches this client's ClientInfo, so clients can be split across threads
+static void server_send_world_state_to_client(SendBatch* batch, u16 client_id, WorldState* current)
+{
+    ClientInfo* client = &server_clients[client_id];
+
+    double now = server_get_time();
+    server_resolve_losses(client, now);
+    congestion_update(&client->congestion, now);
+
+    // backed off, a link that's losing or queueing snapshots gets them less often
+    if(is_tick_greater(client->next_send_tick, current->tick))
+        return;
+
+    client->next_send_tick = current->tick + client->congestion.send_interval;
+
+    SnapshotInfo* baseline = server_get_baseline(client);
+
+    SnapshotInfo* snapshot = &client->history->snapshot_info[current->tick % SNAPSHOT_HISTORY];
+    snapshot->tick = current->tick;
+    snapshot->num_parts = 0;
+    snapshot->acked_parts = 0;
+    memset(snapshot->visible, 0, sizeof(snapshot->visible));
+
+    u64 in_range[MAX_CLIENTS/64];
+    server_compute_visibility(client, client_id, current, in_range);
+
+    // Everything that differs from what the client holds, in id order.
+    // Removals and values about to age out of the history have to be sent,
+    // the rest are bucketed by priority to find how many fit the budget.
+    u16 entry_ids[MAX_CLIENTS];
+    u8  entry_buckets[MAX_CLIENTS]; // PRIORITY_BUCKETS if it has to be sent
+    u8  entry_masks[MAX_CLIENTS];
+    u8  entry_max_bits[MAX_CLIENTS];
+    EncodedEntry* entry_encoded[MAX_CLIENTS]; // NULL if it has to be encoded here
+    int num_changed = 0;
+
+    u32 bucket_bits[PRIORITY_BUCKETS] = {0};
+    int budget = SNAPSHOT_ENTRY_BUDGET*8;
+    u32 baseline_age = baseline ? current->tick - baseline->tick : 0;
+
+    for(int i = 0; i < MAX_CLIENTS / 64; ++i)
+    {
+        u64 bits = in_range[i];
+        if(baseline)
+            bits |= baseline->visible[i];
+
+        while(bits)
+        {
+            u16 id = i*64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            bool is_in_range = (in_range[i] >> (id % 64)) & 1;
+
+            ClientData* c = is_in_range ? &current->client_data[id] : NULL;
+            ClientData* b = baseline ? get_snapshot_value(baseline, id) : NULL;
+
+            // what every receiver holding the same value would be sent, removals are just the id
+            EncodedEntry* encoded = NULL;
+            if(c)
+                encoded = server_get_encoded_entry(id, c, b, b ? baseline->tick - baseline->value_age[id] : 0, current->tick);
+
+            u8 mask = encoded ? encoded->mask : get_entry_mask(c, b);
+
+            if(mask == 0)
+            {
+                // the client already holds this tick's value
+                snapshot->visible[id / 64] |= (1ULL << (id % 64));
+                snapshot->value_age[id] = 0;
+                client->history->priority[id] = 0.0f;
+                continue;
+            }
+
+            int entry_bits = get_entry_max_bits(mask);
+
+            u8 bucket;
+            if(!c || (b && baseline_age + baseline->value_age[id] > SNAPSHOT_MAX_VALUE_AGE))
+            {
+                bucket = PRIORITY_BUCKETS;
+                budget -= entry_bits;
+            }
+            else
+            {
+                bucket = (u8)MIN(client->history->priority[id] / PRIORITY_BUCKET_SIZE, PRIORITY_BUCKETS-1);
+                bucket_bits[bucket] += entry_bits;
+            }
+
+            entry_ids[num_changed] = id;
+            entry_buckets[num_changed] = bucket;
+            entry_masks[num_changed] = mask;
+            entry_max_bits[num_changed] = entry_bits;
+            entry_encoded[num_changed] = encoded;
+            num_changed++;
+        }
+    }
+
+    // buckets from the top that fit whole, then what's left of the budget goes
+    // to the next one down in id order
+    int threshold = PRIORITY_BUCKETS;
+    while(threshold > 0 && (int)bucket_bits[threshold-1] <= budget)
+        budget -= bucket_bits[--threshold];
+
+    // keep every part of this snapshot in the send buffers until num_parts is known
+    if(SERVER_SEND_BUFFER_COUNT - batch->count < SNAPSHOT_MAX_PARTS)
+        server_flush_sends(batch);
+
+    int first_send = batch->count;
+    u8 part = 0;
+    u16 num_entries = 0;
+
+    BitWriter w;
+    server_begin_world_state_part(batch, client, client_id, current, baseline, part, &w);
+
+    for(int i = 0; i < num_changed; ++i)
+    {
+        u16 id = entry_ids[i];
+        u8 bucket = entry_buckets[i];
+        u8 mask = entry_masks[i];
+        int entry_bits = entry_max_bits[i];
+
+        bool send = (bucket >= threshold);
+
+        if(!send && bucket == threshold-1 && entry_bits <= budget)
+        {
+            budget -= entry_bits;
+            send = true;
+        }
+
+        if(!send)
+        {
+            // keeps what it has, and it's not in the snapshot if it had nothing
+            if(baseline && ((baseline->visible[id / 64] >> (id % 64)) & 1))
+            {
+                snapshot->visible[id / 64] |= (1ULL << (id % 64));
+                snapshot->value_age[id] = baseline_age + baseline->value_age[id];
+            }
+            continue;
+        }
+
+        if(w.bit_pos + entry_bits > w.num_bits)
+        {
+            if(part+1 >= SNAPSHOT_MAX_PARTS)
+                break; // can't happen, the budget is about a part
+
+            server_end_world_state_part(batch, &w, num_entries);
+            server_begin_world_state_part(batch, client, client_id, current, baseline, ++part, &w);
+            num_entries = 0;
+        }
+
+        if(entry_encoded[i])
+        {
+            bit_write_bits(&w, entry_encoded[i]->data, entry_encoded[i]->num_bits);
+        }
+        else
+        {
+            bool is_in_range = (in_range[id / 64] >> (id % 64)) & 1;
+
+            ClientData* c = is_in_range ? &current->client_data[id] : NULL;
+            ClientData* b = baseline ? get_snapshot_value(baseline, id) : NULL;
+
+            write_entry(&w, id, mask, c, b);
+        }
+
+        num_entries++;
+
+        client->history->priority[id] = 0.0f;
+
+        if(!(mask & ENTRY_REMOVED))
+        {
+            snapshot->visible[id / 64] |= (1ULL << (id % 64));
+            snapshot->value_age[id] = 0;
+        }
+    }
+
+    server_end_world_state_part(batch, &w, num_entries);
+
+    u8 num_parts = part+1;
+
+    u16 first_id = client->local_latest_packet_id - num_parts;
+
+    for(int i = first_send; i < batch->count; ++i)
+    {
+        u32 len = batch->datagrams[i].len;
+
+        write_bits_at(batch->buffers[i] + PACKET_HEADER_SIZE, WORLD_STATE_NUM_PARTS_BIT, num_parts-1, SNAPSHOT_PART_BITS);
+        client->history->packet_info[(u16)(first_id + i - first_send) % PACKET_INFO_MAX_LEN].size = len;
+        client->metrics.bytes_out += len;
+
+        congestion_on_sent(&client->congestion, len);
+    }
+
+    client->metrics.packets_out += num_parts;
+    snapshot->num_parts = num_parts;
+}
+
+#if defined(__linux__)
+// Returns true if the socket may still hold datagrams, edge-triggered epoll
+// won't report them again so the worker has to come back for them.
+static bool server_worker_recv(ServerWorker* worker)
+{
+    bool queued = false;
+    bool more = true;
+
+    for(int batch = 0; batch < SERVER_WORKER_MAX_BATCHES && more; ++batch)
+    {
+        for(int i = 0; i < SOCKET_BATCH_MAX; ++i)
+        {
+            if(worker->recv_handles[i] == PACKET_HANDLE_NONE)
+                worker->recv_handles[i] = packet_pool_alloc(&worker->pool);
+
+            // with no buffer left the tick thread is behind, the datagram is read and dropped
+            PacketHandle handle = worker->recv_handles[i];
+            worker->recv_datagrams[i].data = (handle != PACKET_HANDLE_NONE) ? packet_pool_get(&worker->pool, handle)->data : worker->discard_buffer;
+            worker->recv_datagrams[i].len  = MAX_PACKET_DATA_SIZE;
+        }
+
+        int num_recv = socket_recv_batch(worker->socket, worker->recv_datagrams, SOCKET_BATCH_MAX);
+
+        for(int i = 0; i < num_recv; ++i)
+        {
+            PacketHandle handle = worker->recv_handles[i];
+            if(handle == PACKET_HANDLE_NONE)
+            {
+                atomic_fetch_add_explicit(&worker->dropped_pool_empty, 1, memory_order_relaxed);
+                continue;
+            }
+
+            PacketBuffer* buf = packet_pool_get(&worker->pool, handle);
+            buf->from = worker->recv_datagrams[i].address;
+            buf->len  = worker->recv_datagrams[i].len;
+
+            // the buffer now belongs to the tick thread, otherwise keep it for the next batch
+            if(packet_queue_enqueue(&worker->queue, handle))
+            {
+                worker->recv_handles[i] = PACKET_HANDLE_NONE;
+                queued = true;
+            }
+            else
+            {
+                atomic_fetch_add_explicit(&worker->dropped_queue_full, 1, memory_order_relaxed);
+            }
+        }
+
+        more = (num_recv == SOCKET_BATCH_MAX);
+    }
+
+    if(queued && !atomic_exchange(&server_drain_signaled, true))
+    {
+        u64 one = 1;
+        if(write(server_drain_fd, &one, sizeof(one)) < 0)
+            perror("Failed to wake the tick thread");
+    }
+
+    return more;
+}
+
+static void server_worker_broadcast(ServerWorker* worker)
+{
+    // interleaved so every worker gets a similar share
+    for(int i = worker->index; i < server_num_clients; i += server_num_workers)
+        server_send_world_state_to_client(&worker->send, server_active_ids[i], server_broadcast_state);
+
+    server_flush_sends(&worker->send);
+}
+
+static void* server_worker_run(void* arg)
+{
+    ServerWorker* worker = arg;
+    bool pending = false; // left datagrams on the socket last time, so only poll
+
+    // the tick thread records them as it drains them, in order with its ticks
+    capture_defer_recv();
+
+    for(;;)
+    {
+        struct epoll_event events[2];
+        int num_events = epoll_wait(worker->event_fd, events, 2, pending ? 0 : -1);
+
+        if(num_events < 0)
+        {
+            if(errno != EINTR)
+                perror("epoll_wait error");
+            continue;
+        }
+
+        bool broadcast = false;
+        bool readable = pending;
+
+        for(int i = 0; i < num_events; ++i)
+        {
+            if(events[i].data.fd == worker->wake_fd)
+                broadcast = true;
+            else
+                readable = true;
+        }
+
+        // the tick thread is waiting on the barrier, so before any more receiving
+        if(broadcast)
+        {
+            u64 count;
+            if(read(worker->wake_fd, &count, sizeof(count)) < 0)
+                perror("Failed to read worker wake event");
+
+            if(atomic_load(&server_workers_stopping))
+                break;
+
+            server_worker_broadcast(worker);
+            pthread_barrier_wait(&server_broadcast_barrier);
+        }
+
+        pending = readable && server_worker_recv(worker);
+    }
+
+    return NULL;
+}
+
+static bool server_worker_init(ServerWorker* worker, int index, int socket)
+{
+    worker->index  = index;
+    worker->socket = socket;
+    worker->send.socket = socket;
+    worker->event_fd = -1;
+    worker->wake_fd  = -1;
+
+    for(int i = 0; i < SOCKET_BATCH_MAX; ++i)
+        worker->recv_handles[i] = PACKET_HANDLE_NONE;
+
+    // one batch more than the queue holds, so the queue fills before the pool runs out
+    if(!packet_pool_create(&worker->pool, SERVER_WORKER_QUEUE_SIZE + SOCKET_BATCH_MAX) ||
+       !packet_queue_create(&worker->queue, SERVER_WORKER_QUEUE_SIZE))
+    {
+        printf("Failed to create worker packet queue!\n");
+        return false;
+    }
+
+    worker->event_fd = epoll_create1(0);
+    worker->wake_fd  = eventfd(0, EFD_NONBLOCK);
+
+    if(worker->event_fd < 0 || worker->wake_fd < 0)
+    {
+        perror("Failed to create worker events.\n");
+        return false;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events  = EPOLLIN | EPOLLET;
+    ev.data.fd = socket;
+
+    struct epoll_event wake_ev = {0};
+    wake_ev.events  = EPOLLIN;
+    wake_ev.data.fd = worker->wake_fd;
+
+    if(epoll_ctl(worker->event_fd, EPOLL_CTL_ADD, socket, &ev) < 0 ||
+       epoll_ctl(worker->event_fd, EPOLL_CTL_ADD, worker->wake_fd, &wake_ev) < 0)
+    {
+        perror("Failed to add worker events to epoll instance.\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Frees a worker whose thread isn't running, or never started
+static void server_worker_free(ServerWorker* worker)
+{
+    if(worker->event_fd >= 0) close(worker->event_fd);
+    if(worker->wake_fd >= 0)  close(worker->wake_fd);
+    socket_close(worker->socket);
+
+    packet_queue_destroy(&worker->queue);
+    packet_pool_destroy(&worker->pool);
+    free(worker);
+}
+
+// Stops the first num_running worker threads, then frees all num_workers
+static void server_stop_workers(ServerWorker** workers, int num_workers, int num_running)
+{
+    atomic_store(&server_workers_stopping, true);
+
+    u64 one = 1;
+    for(int i = 0; i < num_running; ++i)
+    {
+        if(write(workers[i]->wake_fd, &one, sizeof(one)) < 0)
+            perror("Failed to wake worker");
+    }
+
+    for(int i = 0; i < num_running; ++i)
+        pthread_join(workers[i]->thread, NULL);
+
+    for(int i = 0; i < num_workers; ++i)
+        server_worker_free(workers[i]);
+
+    atomic_store(&server_workers_stopping, false);
+}
+
+static void server_drain_worker_queues()
+{
+    // cleared before draining, anything queued after it signals again
+    u64 count;
+    if(read(server_drain_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("Failed to read drain event");
+
+    atomic_store(&server_drain_signaled, false);
+
+    // each client always lands on the same socket, so its packets stay in order
+    for(int i = 0; i < server_num_workers; ++i)
+    {
+        ServerWorker* worker = server_workers[i];
+        PacketHandle handle;
+
+        while((handle = packet_queue_dequeue(&worker->queue)) != PACKET_HANDLE_NONE)
+        {
+            PacketBuffer* buf = packet_pool_get(&worker->pool, handle);
+
+            if(capture_running)
+                capture_datagram(CAPTURE_RECV, &buf->from, buf->data, buf->len);
+
+            ServerUpdate update;
+            if(server_parse_packet(&buf->from, buf->data, buf->len, &update))
+                server_apply_update(&update);
+            else
+                server_metrics.drops[DROP_MALFORMED]++;
+
+            packet_pool_free(&worker->pool, handle);
+        }
+    }
+}
+
+static void server_broadcast_with_workers(WorldState* current)
+{
+    server_broadcast_state = current;
+
+    u64 one = 1;
+    for(int i = 0; i < server_num_workers; ++i)
+    {
+        if(write(server_workers[i]->wake_fd, &one, sizeof(one)) < 0)
+            perror("Failed to wake worker");
+    }
+
+    // returns once every worker has sent its share
+    pthread_barrier_wait(&server_broadcast_barrier);
+}
+#endif
+
+static void server_send_world_state()
+{
+    // Each client gets the clients in its area of interest, encoded as a delta
+    // against the newest snapshot it has acknowledged, or in full if it has
+    // none we still hold.
+    WorldState* current = &world_history[server_tick % SNAPSHOT_HISTORY];
+
+#if defined(__linux__)
+    if(server_num_workers > 0)
+    {
+        server_broadcast_with_workers(current);
+        return;
+    }
+#endif
+
+    for(int i = 0; i < server_num_clients; ++i)
+        server_send_world_state_to_client(&server_send_batch, server_active_ids[i], current);
+
+    server_flush_sends(&server_send_batch);
+}
+
+static void server_disconnect_idle_clients()
+{
+    // disconnect any client that hasn't sent a packet in DISCONNECTION_TIMEOUT
+    double time_curr = server_get_time();
+
+    for(int i = server_num_clients-1; i >= 0; --i)
+    {
+        u16 client_id = server_active_ids[i];
+        double time_elapsed = time_curr - server_clients[client_id].time_of_latest_packet;
+
+        if(time_elapsed >= DISCONNECTION_TIMEOUT)
+        {
+            Address* addr = &server_clients[client_id].address;
+            printf("Client Disconnected! %u.%u.%u.%u:%u\n",addr->a,addr->b,addr->c,addr->d,addr->port);
+
+            server_remove_client(client_id);
+
+            printf("Num Clients: %u\n",server_num_clients);
+        }
+    }
+}
+
+// Gathers up the interval's counters, hands them to the metrics writer and starts over
+static void server_publish_metrics()
+{
+    ServerMetrics* m = &server_metrics;
+    double now = timer_get_time();
+
+    m->time = now - server_timer.time_start;
+    m->interval = now - server_metrics_start;
+    m->tick = server_tick;
+
+    m->drops[DROP_SEND_FAILED] += server_send_batch.failed;
+    server_send_batch.failed = 0;
+
+#if defined(__linux__)
+    // the workers are between broadcasts, their send batches are only touched again after the next wake
+    for(int i = 0; i < server_num_workers; ++i)
+    {
+        ServerWorker* worker = server_workers[i];
+
+        m->drops[DROP_POOL_EMPTY]  += atomic_exchange_explicit(&worker->dropped_pool_empty, 0, memory_order_relaxed);
+        m->drops[DROP_QUEUE_FULL]  += atomic_exchange_explicit(&worker->dropped_queue_full, 0, memory_order_relaxed);
+        m->drops[DROP_SEND_FAILED] += worker->send.failed;
+        worker->send.failed = 0;
+    }
+#endif
+
+    m->tick_jitter = timer_get_jitter(&server_timer.stats);
+    m->skipped_ticks = server_timer.stats.skipped;
+    timer_reset_stats(&server_timer);
+
+    m->num_clients = server_num_clients;
+
+    for(int i = 0; i < server_num_clients; ++i)
+    {
+        u16 id = server_active_ids[i];
+        ClientInfo* client = &server_clients[id];
+
+        ClientMetrics* c = &m->clients[i];
+        CongestionState* cs = &client->congestion;
+
+        *c = client->metrics;
+        c->id = id;
+        c->address = client->address;
+        c->rtt = cs->srtt;
+        c->rtt_var = cs->rttvar;
+        c->loss = cs->loss;
+        c->bandwidth = cs->bandwidth;
+        c->send_interval = cs->send_interval;
+
+        memset(&client->metrics, 0, sizeof(ClientMetrics));
+    }
+
+    metrics_publish(m);
+
+    memset(m, 0, offsetof(ServerMetrics, clients));
+    server_metrics_start = now;
+}
+
+static int server_open_socket(bool reuseport)
+{
+    int sock;
+
+    printf("Creating socket.\n");
+    if(!socket_create(&sock))
+        return -1;
+
+    if(reuseport && !socket_set_reuseport(sock))
+        return -1;
+
+    printf("Binding socket %u to any local ip on port %u.\n", sock, PORT);
+    if(!socket_bind(sock, NULL, PORT))
+        return -1;
+
+    socket_set_nonblocking(sock);
+    socket_set_recv_buffer_size(sock, SERVER_RECV_BUFFER_SIZE);
+
+    return sock;
+}
+
+static bool server_start_workers(int num_workers)
+{
+#if defined(__linux__)
+    if(num_workers == SERVER_WORKERS_PER_CORE)
+        num_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    num_workers = MAX(1, MIN(num_workers, SERVER_MAX_WORKERS));
+
+    printf("Starting %d receive workers.\n", num_workers);
+
+    // the tick thread sleeps on this and its timer
+    server_drain_fd = eventfd(0, EFD_NONBLOCK);
+    if(server_drain_fd < 0)
+    {
+        perror("Failed to create drain event.\n");
+        return false;
+    }
+
+    if(!server_events_init(server_drain_fd))
+        return false;
+
+    ServerWorker* workers[SERVER_MAX_WORKERS];
+    int num_created = 0, num_running = 0;
+
+    for(; num_created < num_workers; ++num_created)
+    {
+        int sock = server_open_socket(true);
+        if(sock < 0)
+            break;
+
+        ServerWorker* worker = aligned_alloc(CACHE_LINE_SIZE, (sizeof(ServerWorker) + CACHE_LINE_SIZE-1) & ~(size_t)(CACHE_LINE_SIZE-1));
+        if(!worker)
+        {
+            printf("Failed to allocate worker!\n");
+            socket_close(sock);
+            break;
+        }
+
+        memset(worker, 0, sizeof(ServerWorker));
+
+        if(!server_worker_init(worker, num_created, sock))
+        {
+            server_worker_free(worker);
+            break;
+        }
+
+        workers[num_created] = worker;
+    }
+
+    bool started = (num_created == num_workers);
+
+    for(; started && num_running < num_workers; ++num_running)
+    {
+        if(pthread_create(&workers[num_running]->thread, NULL, server_worker_run, workers[num_running]) != 0)
+        {
+            printf("Failed to create worker thread!\n");
+            started = false;
+            break;
+        }
+    }
+
+    // workers only reach the barrier once woken for a broadcast, so it can
+    // wait until they're all running
+    if(started && pthread_barrier_init(&server_broadcast_barrier, NULL, num_workers+1) != 0)
+    {
+        printf("Failed to create worker barrier!\n");
+        started = false;
+    }
+
+    if(!started)
+    {
+        server_stop_workers(workers, num_created, num_running);
+        return false;
+    }
+
+    for(int i = 0; i < num_workers; ++i)
+        server_workers[i] = workers[i];
+
+    server_num_workers = num_workers;
+    server_info.socket = server_workers[0]->socket;
+
+    return true;
+#else
+    printf("Receive workers need Linux, running single threaded.\n");
+    return false;
+#endif
+}
+
+// Stops the workers and closes what net_server_start opened
+static void server_shutdown(bool threaded)
+{
+#if defined(__linux__)
+    if(threaded)
+    {
+        server_stop_workers(server_workers, server_num_workers, server_num_workers);
+        pthread_barrier_destroy(&server_broadcast_barrier);
+        server_num_workers = 0;
+
+        close(server_drain_fd);
+        server_drain_fd = -1;
+    }
+    else
+#endif
+    {
+        socket_close(server_info.socket);
+    }
+
+    server_info.socket = -1;
+    server_send_batch.socket = -1;
+
+#if defined(__linux__)
+    close(server_timer_fd);
+    close(server_event_fd);
+    server_timer_fd = -1;
+    server_event_fd = -1;
+#endif
+}
+
+static bool server_init()
+{
+    // players are moved here, which needs the ground under them
+    if(!terrain_load_heights(TERRAIN_HEIGHTMAP))
+        return false;
+
+    if(!protocol_init())
+        return false;
+
+    if(get_entry_max_bits(ENTRY_ALL) > ENTRY_CACHE_MAX_BITS)
+    {
+        printf("Snapshot entries take up to %d bits, more than ENTRY_CACHE_MAX_BITS\n", get_entry_max_bits(ENTRY_ALL));
+        return false;
+    }
+
+    server_clients_init();
+    create_game_id();
+
+    return true;
+}
+
+// Everything a tick does once the packets before it are applied
+static void server_run_tick(double recv_time)
+{
+    if(capture_running)
+        capture_tick(server_tick);
+
+    double simulate_time = 0.0, send_time = 0.0;
+
+    if(server_num_clients > 0)
+    {
+        double simulate_start = timer_get_time();
+
+        server_disconnect_idle_clients();
+        server_capture_world_state();
+
+        double send_start = timer_get_time();
+
+        server_send_world_state();
+        server_info.local_latest_packet_id++;
+
+        simulate_time = send_start - simulate_start;
+        send_time = timer_get_time() - send_start;
+    }
+
+    // goes out with the next tick's snapshots
+    server_tick_time = recv_time + simulate_time + send_time;
+
+    metrics_histogram_add(&server_metrics.tick_time, server_tick_time);
+    metrics_histogram_add(&server_metrics.recv_time, recv_time);
+    metrics_histogram_add(&server_metrics.simulate_time, simulate_time);
+    metrics_histogram_add(&server_metrics.send_time, send_time);
+    server_metrics.ticks++;
+
+    server_tick++;
+
+    if(!server_replaying && timer_get_time() - server_metrics_start >= METRICS_INTERVAL)
+        server_publish_metrics();
+}
+
+int net_server_start(int num_workers)
+{
+    if(!server_init())
+        return -1;
+
+    bool threaded = (num_workers != 0) && server_start_workers(num_workers);
+
+    if(!threaded)
+    {
+#if defined(__linux__)
+        if(num_workers != 0)
+            return -1;
+#endif
+        int sock = server_open_socket(false);
+        if(sock < 0)
+            return -1;
+
+        server_info.socket = sock;
+        server_send_batch.socket = sock;
+
+        if(!server_events_init(sock))
+            return -1;
+    }
+
+    printf("Server started.\n");
+
+    timer_set_fps(&server_timer,SERVER_RATE);
+    timer_set_policy(&server_timer,TIMER_CATCH_UP,SERVER_MAX_CATCH_UP);
+    timer_begin(&server_timer);
+
+    server_metrics_start = server_timer.time_start;
+
+    while(!atomic_load(&server_stopping))
+    {
+        double recv_time = 0.0;
+
+        // Read packets until the next tick is due, sleeping while there are none
+        for(;;)
+        {
+            double recv_start = timer_get_time();
+
+#if defined(__linux__)
+            if(threaded)
+                server_drain_worker_queues();
+            else
+#endif
+                server_recv_packets();
+
+            recv_time += timer_get_time() - recv_start;
+
+            double time_left = timer_get_time_until_frame(&server_timer);
+            if(time_left <= 0.0)
+                break;
+
+            double deadline = server_timer.time_last + server_timer.spf;
+
+            if(time_left > TIMER_SPIN_TIME)
+                server_wait_for_data(deadline - TIMER_SPIN_TIME);
+            else
+                timer_sleep_until(deadline); // spins the last stretch, then reads once more
+        }
+
+        metrics_histogram_add(&server_metrics.tick_late, timer_start_frame(&server_timer));
+
+        server_run_tick(recv_time);
+
+        timer_inc_frame(&server_timer);
+    }
+
+    server_shutdown(threaded);
+    printf("Server stopped.\n");
+
+    return 0;
+}
+
+void net_server_stop()
+{
+    atomic_store(&server_stopping, true);
+}
+
+int net_server_replay(const char* path, bool realtime)
+{
+    if(!server_init())
+        return -1;
+
+    CaptureReader reader;
+    if(!capture_open(&reader, path))
+        return -1;
+
+    static CaptureRecord record;
+    MetricsHistogram tick_hist = {0};
+    u64 num_datagrams = 0, num_malformed = 0, num_ticks = 0;
+
+    server_replaying = true;
+    server_info.socket = -1;
+    server_send_batch.socket = -1;
+
+    printf("Replaying %s%s\n", path, realtime ? " in real time" : "");
+
+    Timer wall;
+    timer_begin(&wall);
+
+    double recv_time = 0.0;
+
+    while(!atomic_load(&server_stopping) && capture_read(&reader, &record))
+    {
+        if(record.type == CAPTURE_SEND)
+            continue;
+
+        if(realtime)
+            timer_sleep_until(wall.time_start + record.time);
+
+        server_replay_time = record.time;
+
+        if(record.type == CAPTURE_RECV)
+        {
+            double recv_start = timer_get_time();
+
+            ServerUpdate update;
+            if(server_parse_packet(&record.address, record.data, record.len, &update))
+                server_apply_update(&update);
+            else
+                num_malformed++;
+
+            recv_time += timer_get_time() - recv_start;
+            num_datagrams++;
+        }
+        else
+        {
+            double tick_start = timer_get_time();
+            server_run_tick(recv_time);
+            metrics_histogram_add(&tick_hist, recv_time + timer_get_time() - tick_start);
+
+            recv_time = 0.0;
+            num_ticks++;
+        }
+    }
+
+    double elapsed = timer_get_elapsed(&wall);
+    capture_close(&reader);
+    server_replaying = false;
+
+    printf("Replayed %llu ticks and %llu datagrams (%llu malformed) in %.3f s\n",
+           (unsigned long long)num_ticks, (unsigned long long)num_datagrams, (unsigned long long)num_malformed, elapsed);
+    printf("  %.0f ticks/s, %.0f datagrams/s in, %llu datagrams and %llu bytes out\n",
+           num_ticks / elapsed, num_datagrams / elapsed,
+           (unsigned long long)server_replay_packets_out, (unsigned long long)server_replay_bytes_out);
+    printf("  tick avg %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           tick_hist.total ? 1000.0*tick_hist.sum/tick_hist.total : 0.0,
+           1000.0*metrics_histogram_percentile(&tick_hist, 0.50),
+           1000.0*metrics_histogram_percentile(&tick_hist, 0.99),
+           1000.0*tick_hist.max);
+
+    return 0;
+}
+
+bool net_client_set_server_ip(char* address)
+{
+    // example input:
+    // 200.100.24.10
+
+    char num_str[4] = {0}; // up to 3 digits + null terminator
+    u8   bytes[4]  = {0};
+
+    int num_str_index = 0, byte_index = 0;
+    size_t len = strlen(address);
+
+    for(size_t i = 0; i <= len; ++i)
+    {
+        if(address[i] == '.' || address[i] == '\0')
+        {
+            int value = atoi(num_str);
+
+            if(num_str_index == 0 || byte_index >= 4 || value > 255)
+            {
+                printf("Invalid server address %s\n", address);
+                return false;
+            }
+
+            bytes[byte_index++] = value;
+            memset(num_str,0,sizeof(num_str));
+            num_str_index = 0;
+            continue;
+        }
+
+        if(address[i] < '0' || address[i] > '9' || num_str_index >= 3)
+        {
+            printf("Invalid server address %s\n", address);
+            return false;
+        }
+
+        num_str[num_str_index++] = address[i];
+    }
+
+    if(byte_index != 4)
+    {
+        printf("Invalid server address %s\n", address);
+        return false;
+    }
+
+    server_address.a = bytes[0];
+    server_address.b = bytes[1];
+    server_address.c = bytes[2];
+    server_address.d = bytes[3];
+
+    server_address.port = PORT;
+
+    return true;
+}
+
+Address net_client_get_server_address()
+{
+    return server_address;
+}
+
+static NodeInfo client_info = {0};
+
+// Snapshots as reassembled by the client, kept around as delta baselines
+static WorldState client_history[SNAPSHOT_HISTORY];
+static u32  client_history_parts[SNAPSHOT_HISTORY];
+static u8   client_history_num_parts[SNAPSHOT_HISTORY];
+static bool client_history_complete[SNAPSHOT_HISTORY];
+static u32  client_history_value_tick[SNAPSHOT_HISTORY][MAX_CLIENTS]; // the tick each client's value was sent on
+
+// our own player as of each snapshot, from its first part
+static bool        client_history_has_player[SNAPSHOT_HISTORY];
+static u16         client_history_input_sequence[SNAPSHOT_HISTORY];
+static PlayerState client_history_player[SNAPSHOT_HISTORY];
+static u8          client_history_hits[SNAPSHOT_HISTORY];
+static u16         client_history_last_hit[SNAPSHOT_HISTORY];
+
+// last inputs sent, repeated in each packet
+static PlayerInput client_inputs[PLAYER_INPUT_REDUNDANCY];
+static int         client_num_inputs = 0;
+static bool client_has_snapshot = false;
+static u32  client_latest_tick = 0;
+
+// Everything above is only touched by the network thread. It talks to the
+// game thread through the ack state and the snapshot triple buffer below.
+static pthread_t   client_thread;
+static u8          client_recv_buffer[MAX_PACKET_DATA_SIZE]; // owned by the network thread
+static atomic_bool client_running = false;
+static _Atomic u64 client_ack_state = 0; // ack << 32 | ack_bitfield
+
+// Triple buffer: the network thread fills the back snapshot and swaps it
+// with the middle one, the game swaps its front one with the middle when
+// that's flagged fresh. Neither side ever waits on the other.
+#define SNAPSHOT_FRESH 0x4
+
+static ClientSnapshot client_snapshots[3];
+static int        client_snapshot_back   = 0; // network thread only
+static int        client_snapshot_front  = 1; // game thread only
+static atomic_int client_snapshot_middle = 2;
+
+static void client_publish_snapshot(WorldState* ws, double time_received)
+{
+    ClientSnapshot* snapshot = &client_snapshots[client_snapshot_back];
+
+    int slot = ws->tick % SNAPSHOT_HISTORY;
+
+    memcpy(&snapshot->state, ws, sizeof(WorldState));
+    memcpy(snapshot->value_tick, client_history_value_tick[slot], sizeof(snapshot->value_tick));
+    snapshot->time_received = time_received;
+
+    snapshot->has_player_state = client_history_has_player[slot];
+    snapshot->input_sequence   = client_history_input_sequence[slot];
+    snapshot->player_state     = client_history_player[slot];
+    snapshot->hits             = client_history_hits[slot];
+    snapshot->last_hit_id      = client_history_last_hit[slot];
+
+    int prev = atomic_exchange_explicit(&client_snapshot_middle, client_snapshot_back | SNAPSHOT_FRESH, memory_order_acq_rel);
+    client_snapshot_back = prev & ~SNAPSHOT_FRESH;
+}
+
+ClientSnapshot* net_client_get_snapshot()
+{
+    if(!(atomic_load_explicit(&client_snapshot_middle, memory_order_relaxed) & SNAPSHOT_FRESH))
+        return NULL;
+
+    int prev = atomic_exchange_explicit(&client_snapshot_middle, client_snapshot_front, memory_order_acq_rel);
+    client_snapshot_front = prev & ~SNAPSHOT_FRESH;
+
+    return &client_snapshots[client_snapshot_front];
+}
+
+static void* client_network_run(void* arg);
+
+bool net_client_init()
+{
+    int sock;
+
+    printf("Creating socket.\n");
+    socket_create(&sock);
+    socket_set_nonblocking(sock);
+
+    client_info.socket = sock;
+    create_game_id();
+
+    if(!protocol_init())
+        return false;
+
+    atomic_store(&client_running, true);
+
+    if(pthread_create(&client_thread, NULL, client_network_run, NULL) != 0)
+    {
+        printf("Failed to create network thread!\n");
+        atomic_store(&client_running, false);
+        return false;
+    }
+
+    return true;
+}
+
+int net_client_send_input(PlayerInput* input)
+{
+    // predict with exactly what the server will run
+    input->angle_h = dequantize_angle_h(quantize_angle_h(input->angle_h, INPUT_ANGLE_BITS), INPUT_ANGLE_BITS);
+    input->angle_v = dequantize_angle_v(quantize_angle_v(input->angle_v, INPUT_ANGLE_BITS), INPUT_ANGLE_BITS);
+
+    client_inputs[input->sequence % PLAYER_INPUT_REDUNDANCY] = *input;
+    client_num_inputs = MIN(client_num_inputs+1, PLAYER_INPUT_REDUNDANCY);
+
+    u64 ack_state = atomic_load_explicit(&client_ack_state, memory_order_acquire);
+
+    Packet pkt = {
+        .header.game_id = game_id,
+        .header.packet_id = client_info.local_latest_packet_id,
+        .header.type = PACKET_TYPE_INPUT,
+        .header.ack = (u16)(ack_state >> 32),
+        .header.ack_bitfield = (u32)ack_state
+    };
+
+    pkt.data_len = write_input_payload(pkt.data, client_inputs, client_num_inputs, input->sequence);
+
+    //print_packet(&pkt);
+
+    int sent_bytes = net_send(&client_info, &server_address, &pkt);
+    return sent_bytes;
+}
+
+// Applies one snapshot part. Returns false if it can't be used, in which case
+// the packet must not be acknowledged.
+static bool client_apply_world_state_part(PacketView* pkt, WorldState** completed)
+{
+    BitReader r;
+    bit_reader_init(&r, pkt->data, pkt->data_len);
+
+    WorldStateHeader h;
+    if(!read_world_state_header(&r, &h))
+        return false;
+
+    // already have something newer
+    if(client_has_snapshot && !is_tick_greater(h.tick, client_latest_tick))
+        return false;
+
+    int slot = h.tick % SNAPSHOT_HISTORY;
+    WorldState* ws = &client_history[slot];
+
+    if(ws->tick != h.tick || client_history_num_parts[slot] == 0)
+    {
+        // first part of this tick, start from the baseline it was encoded against
+        if(h.has_baseline)
+        {
+            int baseline_slot = h.baseline_tick % SNAPSHOT_HISTORY;
+            WorldState* baseline = &client_history[baseline_slot];
+
+            if(h.baseline_tick == h.tick || baseline->tick != h.baseline_tick || !client_history_complete[baseline_slot])
+                return false;
+
+            memcpy(ws, baseline, sizeof(WorldState));
+            memcpy(client_history_value_tick[slot], client_history_value_tick[baseline_slot], sizeof(client_history_value_tick[slot]));
+        }
+        else
+        {
+            memset(ws->present, 0, sizeof(ws->present));
+        }
+
+        ws->tick = h.tick;
+        client_history_parts[slot] = 0;
+        client_history_num_parts[slot] = h.num_parts;
+        client_history_complete[slot] = false;
+        client_history_has_player[slot] = false;
+    }
+
+    u32 part_bit = (1u << h.part);
+    if(client_history_parts[slot] & part_bit)
+        return false;
+
+    ws->num_clients = h.num_clients;
+    ws->ignore_id   = h.ignore_id;
+
+    if(!decode_entries(ws, client_history_value_tick[slot], &r, h.num_entries))
+        return false;
+
+    if(h.part == 0)
+    {
+        client_history_has_player[slot]     = h.has_player;
+        client_history_input_sequence[slot] = h.input_sequence;
+        client_history_player[slot]         = h.player_state;
+        client_history_hits[slot]           = h.hits;
+        client_history_last_hit[slot]       = h.last_hit_id;
+    }
+
+    client_history_parts[slot] |= part_bit;
+
+    u32 all_parts = (h.num_parts >= 32) ? 0xFFFFFFFF : ((1u << h.num_parts) - 1);
+
+    if(client_history_parts[slot] == all_parts)
+    {
+        client_history_complete[slot] = true;
+        client_has_snapshot = true;
+        client_latest_tick = h.tick;
+        *completed = ws;
+    }
+
+    return true;
+}
+
+static void client_handle_packet(PacketView* pkt, double time_received)
+{
+    if(pkt->header.game_id != game_id || pkt->header.type != PACKET_TYPE_WORLD_STATE)
+        return;
+
+    WorldState* completed = NULL;
+
+    if(!client_apply_world_state_part(pkt, &completed))
+        return;
+
+    update_received_packets(&client_info.received, pkt->header.packet_id);
+
+    u64 ack_state = ((u64)client_info.received.latest_id << 32) | get_ack_bit_field(&client_info.received);
+    atomic_store_explicit(&client_ack_state, ack_state, memory_order_release);
+
+    if(completed)
+        client_publish_snapshot(completed, time_received);
+}
+
+static void* client_network_run(void* arg)
+{
+    (void)arg;
+
+    while(atomic_load_explicit(&client_running, memory_order_relaxed))
+    {
+        if(!wait_for_data(client_info.socket, CLIENT_WAIT_TIMEOUT))
+            continue;
+
+        for(;;)
+        {
+            SocketDatagram d = {
+                .data = client_recv_buffer,
+                .len  = sizeof(client_recv_buffer)
+            };
+
+            if(socket_recv(client_info.socket, &d) < 0)
+                break;
+
+            // stamped as soon as it's read so extrapolation isn't skewed by how long the game took to look
+            double time_received = timer_get_time();
+
+            // parsed in place, decoding reads straight out of the receive buffer
+            PacketView pkt;
+            if(!parse_packet(d.data, d.len, &pkt))
+                continue;
+
+            client_handle_packet(&pkt, time_received);
+        }
+    }
+
+    return NULL;
+}
+
+void net_client_deinit()
+{
+    if(atomic_exchange(&client_running, false))
+        pthread_join(client_thread, NULL);
+
     socket_close(client_info.socket);
 }
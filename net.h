@@ -1,14 +1,17 @@
 #pragma once
 
 #include "math3d.h"
+#include "player.h"
+#include "socket.h"
 
-#define MAX_CLIENTS 8
+#define MAX_CLIENTS 1024 // client ids are sent in CLIENT_ID_BITS, see net.c
 #define MAX_PACKET_DATA_SIZE 1024
 
 typedef enum
 {
     PACKET_TYPE_INIT,
-    PACKET_TYPE_WORLD_STATE
+    PACKET_TYPE_WORLD_STATE,
+    PACKET_TYPE_INPUT
 } PacketType;
 
 typedef struct
@@ -33,27 +36,59 @@ typedef struct
     Vector3f position;
     float angle_h;
     float angle_v;
-    float junk; // @TODO: figure out why final 4 bytes don't get received!
 } ClientData;
 
+// A full snapshot of the world at one server tick, as kept in the server's
+// history and reassembled by the client from delta encoded parts.
 typedef struct
 {
-    u16        version;
+    u32        tick;
     u16        num_clients;
     u16        ignore_id;
+    u64        present[MAX_CLIENTS/64];
     ClientData client_data[MAX_CLIENTS];
 } WorldState;
 
-extern u32 game_id;
+// A completed snapshot as handed from the client's network thread to the game
+typedef struct
+{
+    WorldState state;
+    u32        value_tick[MAX_CLIENTS]; // the tick each client in state is as of, the server doesn't send everyone every tick
+    double     time_received; // timer_get_time() when its last part arrived
+
+    // where the server has our own player after applying input_sequence
+    bool        has_player_state;
+    u16         input_sequence;
+    PlayerState player_state;
+
+    // shots of ours the server counted as hits, wrapping, and who the last one hit
+    u8          hits;
+    u16         last_hit_id;
+} ClientSnapshot;
+
 extern char* server_ip_address;
 
 // Server
-int net_server_start();
+#define SERVER_RATE 30.0f // snapshots per second, one per tick
+#define SERVER_WORKERS_PER_CORE -1
+
+// num_workers > 0 receives on that many SO_REUSEPORT sockets, each with its
+// own thread, 0 runs everything on the calling thread (Linux only)
+int net_server_start(int num_workers);
+
+// Runs the server off a capture file instead of a socket, as fast as it goes
+// or at the pace it was recorded. Snapshots are encoded, then dropped.
+int net_server_replay(const char* path, bool realtime);
+
+// Has net_server_start or net_server_replay return once the tick in progress
+// is done, safe to call from a signal handler
+void net_server_stop();
 
 // Client
-bool net_client_init();
+bool net_client_init(); // starts the network thread that receives snapshots
 bool net_client_set_server_ip(char* address);
-bool net_client_data_waiting();
-int net_client_send(u8* data, u32 len);
-int net_client_recv(Packet* pkt, bool* is_latest);
+Address net_client_get_server_address(); // as set by net_client_set_server_ip
+int net_client_send_input(PlayerInput* input); // rounds input's angles to what the server will see
+ClientSnapshot* net_client_get_snapshot(); // newest snapshot since the last call or NULL, valid until the next call
 void net_client_deinit();
+
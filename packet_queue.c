@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packet_queue.h"
+
+static u32 round_up_pow2(u32 value)
+{
+    u32 p = 1;
+    while(p < value)
+        p <<= 1;
+    return p;
+}
+
+bool packet_queue_create(PacketQueue* q, u32 capacity)
+{
+    capacity = round_up_pow2(capacity);
+
+    q->handles = malloc(capacity*sizeof(PacketHandle));
+    if(!q->handles)
+        return false;
+
+    q->capacity = capacity;
+    q->cached_head = 0;
+    q->cached_tail = 0;
+
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+
+    return true;
+}
+
+void packet_queue_destroy(PacketQueue* q)
+{
+    free(q->handles);
+    q->handles = NULL;
+}
+
+bool packet_queue_enqueue(PacketQueue* q, PacketHandle handle)
+{
+    u32 tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    if(tail - q->cached_head >= q->capacity)
+    {
+        q->cached_head = atomic_load_explicit(&q->head, memory_order_acquire);
+        if(tail - q->cached_head >= q->capacity)
+            return false;
+    }
+
+    q->handles[tail & (q->capacity-1)] = handle;
+
+    // the handle has to be visible before the consumer sees the new tail
+    atomic_store_explicit(&q->tail, tail+1, memory_order_release);
+    return true;
+}
+
+PacketHandle packet_queue_dequeue(PacketQueue* q)
+{
+    u32 head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+    if(head == q->cached_tail)
+    {
+        q->cached_tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if(head == q->cached_tail)
+            return PACKET_HANDLE_NONE;
+    }
+
+    PacketHandle handle = q->handles[head & (q->capacity-1)];
+
+    atomic_store_explicit(&q->head, head+1, memory_order_release);
+    return handle;
+}
+
+bool packet_pool_create(PacketPool* pool, u32 capacity)
+{
+    pool->buffers = malloc(capacity*sizeof(PacketBuffer));
+    if(!pool->buffers)
+        return false;
+
+    if(!packet_queue_create(&pool->free_handles, capacity))
+    {
+        free(pool->buffers);
+        return false;
+    }
+
+    pool->capacity = capacity;
+
+    for(u32 i = 0; i < capacity; ++i)
+        packet_queue_enqueue(&pool->free_handles, i);
+
+    return true;
+}
+
+void packet_pool_destroy(PacketPool* pool)
+{
+    packet_queue_destroy(&pool->free_handles);
+    free(pool->buffers);
+    pool->buffers = NULL;
+}
+
+PacketHandle packet_pool_alloc(PacketPool* pool)
+{
+    return packet_queue_dequeue(&pool->free_handles);
+}
+
+void packet_pool_free(PacketPool* pool, PacketHandle handle)
+{
+    packet_queue_enqueue(&pool->free_handles, handle);
+}
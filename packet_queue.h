@@ -1,58 +1,61 @@
 #pragma once
 
-typedef struct
-{
-    Packet*  data;
-    u32 front,rear,size;
-    u32 capacity;
-} PacketQueue;
-
-bool packet_queue_create(PacketQueue* q, u32 capacity)
-{
-    q->data = malloc(capacity*sizeof(Packet));
-    if(!q->data)
-        return false;
+#include <stdbool.h>
+#include <stdatomic.h>
 
-    q->capacity = capacity;
-    q->front = 0;
-    q->size = 0;
-    q->rear = capacity-1;
+#include "util.h"
+#include "socket.h"
+#include "net.h"
 
-    return true;
-}
+#define CACHE_LINE_SIZE 64
+#define PACKET_HANDLE_NONE 0xFFFFFFFF
 
-bool packet_queue_is_full(PacketQueue* q)
-{
-    return (q->size == q->capacity);
-}
+typedef u32 PacketHandle;
 
-bool packet_queue_is_empty(PacketQueue* q)
+// A datagram as it came off the socket, owned by whoever holds its handle
+typedef struct
 {
-    return (q->size == 0);
-}
-
-bool packet_queue_enqueue(PacketQueue* q, Packet* p)
+    Address from;
+    u32     len;
+    u8      data[MAX_PACKET_DATA_SIZE];
+} PacketBuffer;
+
+// Lock-free ring of packet handles between exactly one producer thread and
+// one consumer thread. Each index sits on its own cache line next to the
+// owning side's cached copy of the other index, which is only reread when
+// the ring looks full or empty.
+typedef struct
 {
-    if(packet_queue_is_full(q))
-        return false;
+    _Alignas(CACHE_LINE_SIZE) _Atomic u32 head; // next to dequeue, written by the consumer
+    u32 cached_tail;
 
-    q->rear++;
-    q->rear %= q->capacity;
-    memcpy(&q->data[q->rear],p,sizeof(Packet));
-    q->size++;
+    _Alignas(CACHE_LINE_SIZE) _Atomic u32 tail; // next to enqueue, written by the producer
+    u32 cached_head;
 
-    return true;
-}
+    _Alignas(CACHE_LINE_SIZE) PacketHandle* handles;
+    u32 capacity; // power of 2
+} PacketQueue;
 
-bool packet_queue_dequeue(PacketQueue* q, Packet* p)
+// Preallocated packet buffers handed around by handle. One thread allocates
+// and one thread frees, like the two ends of a PacketQueue.
+typedef struct
 {
-    if(packet_queue_is_empty(q))
-        return false;
+    PacketQueue   free_handles;
+    PacketBuffer* buffers;
+    u32 capacity;
+} PacketPool;
 
-    memcpy(p,&q->data[q->front],sizeof(Packet));
-    q->front++;
-    q->front %= q->capacity;
-    q->size--;
+bool packet_queue_create(PacketQueue* q, u32 capacity); // rounds capacity up to a power of 2
+void packet_queue_destroy(PacketQueue* q);
+bool packet_queue_enqueue(PacketQueue* q, PacketHandle handle); // false if full
+PacketHandle packet_queue_dequeue(PacketQueue* q); // PACKET_HANDLE_NONE if empty
 
-    return true;
+bool packet_pool_create(PacketPool* pool, u32 capacity);
+void packet_pool_destroy(PacketPool* pool);
+PacketHandle packet_pool_alloc(PacketPool* pool); // PACKET_HANDLE_NONE if every buffer is in use
+void packet_pool_free(PacketPool* pool, PacketHandle handle);
+
+static inline PacketBuffer* packet_pool_get(PacketPool* pool, PacketHandle handle)
+{
+    return &pool->buffers[handle];
 }
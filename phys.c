@@ -1,14 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <math.h>
 
 #include "util.h"
 #include "math3d.h"
 #include "phys.h"
 
-bool phys_collision_line_sphere(Vector3f p1, Vector3f p2, Vector3f s, float r)
+bool phys_collision_line_sphere(Vector3f p1, Vector3f p2, Vector3f s, float r, float* t)
 {
-    // p1 and p2 are points on the line
+    // p1 and p2 are the ends of the segment
     // s is the center of sphere
     // r is radius of sphere
 
@@ -21,7 +22,19 @@ bool phys_collision_line_sphere(Vector3f p1, Vector3f p2, Vector3f s, float r)
     float c = SQ(s.x) + SQ(s.y) + SQ(s.z) + SQ(p1.x) + SQ(p1.y) + SQ(p1.z) - 2.0f * (s.x*p1.x + s.y*p1.y + s.z*p1.z) - SQ(r);
 
     float q = b*b-4.0f*a*c;
-    printf("Q: %f\n", q);
 
-    return (q >= 0);
+    if(q < 0.0f || a == 0.0f)
+        return false;
+
+    // where the line goes in and out of the sphere, as fractions of p1 -> p2
+    float t1 = (-b - sqrtf(q)) / (2.0f*a);
+    float t2 = (-b + sqrtf(q)) / (2.0f*a);
+
+    if(t2 < 0.0f || t1 > 1.0f)
+        return false;
+
+    if(t)
+        *t = MAX(t1, 0.0f);
+
+    return true;
 }
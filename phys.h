@@ -1,3 +1,4 @@
 #pragma once
 
-bool phys_collision_line_sphere(Vector3f p1, Vector3f p2, Vector3f c, float r);
+// Does the segment p1 -> p2 touch the sphere? t, if given, gets how far along it does first, 0 to 1.
+bool phys_collision_line_sphere(Vector3f p1, Vector3f p2, Vector3f c, float r, float* t);
@@ -1,14 +1,19 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <math.h>
 
 #include "util.h"
 #include "math3d.h"
-#include "camera.h"
+#include "terrain.h"
 #include "player.h"
 
 Player player = {0};
 
+static PlayerInput input_history[PLAYER_INPUT_HISTORY];
+static u16 input_sequence = 0;     // last handed out by player_get_input
+static u16 predicted_sequence = 0; // last run through player_update
+
 static void load_player_props();
 
 //
@@ -20,9 +25,11 @@ void player_init()
     memset(&player,0,sizeof(Player));
 
     player.accel_factor = 0.1f;
-    player.height = 1.5f + 1.4f; // meters
+    player.height = PLAYER_HEIGHT;
     player.mass = 1.0f; // kg
 
+    player.state.position.y = PLAYER_HEIGHT;
+
     memset(player.name,0,16);
     strncpy(player.name,"Player",16);
 
@@ -33,29 +40,204 @@ void player_init()
     load_player_props();
 }
 
-void player_update()
+void player_get_input(PlayerInput* input, float angle_h, float angle_v)
+{
+    memset(input,0,sizeof(PlayerInput));
+
+    input->sequence = ++input_sequence;
+
+    if(player.key_w_down) input->keys |= PLAYER_KEY_W;
+    if(player.key_s_down) input->keys |= PLAYER_KEY_S;
+    if(player.key_a_down) input->keys |= PLAYER_KEY_A;
+    if(player.key_d_down) input->keys |= PLAYER_KEY_D;
+    if(player.key_space)  input->keys |= PLAYER_KEY_JUMP;
+    if(player.key_shift)  input->keys |= PLAYER_KEY_SHIFT;
+    if(player.key_fire)   input->keys |= PLAYER_KEY_FIRE;
+
+    player.key_fire = false;
+
+    input->angle_h = angle_h;
+    input->angle_v = angle_v;
+}
+
+// Runs input on the local player and keeps it until the server has applied it
+void player_update(PlayerInput* input)
+{
+    input_history[input->sequence % PLAYER_INPUT_HISTORY] = *input;
+    predicted_sequence = input->sequence;
+
+    player.angle_h = input->angle_h;
+    player.angle_v = input->angle_v;
+
+    player_move(&player.state, input);
+
+    player.correction.x *= PLAYER_CORRECTION_DECAY;
+    player.correction.y *= PLAYER_CORRECTION_DECAY;
+    player.correction.z *= PLAYER_CORRECTION_DECAY;
+}
+
+// Takes the server's state as of input sequence and replays everything predicted since
+void player_reconcile(u16 sequence, PlayerState* state)
+{
+    Vector3f shown = {
+        player.state.position.x + player.correction.x,
+        player.state.position.y + player.correction.y,
+        player.state.position.z + player.correction.z
+    };
+
+    player.state = *state;
+
+    u16 pending = predicted_sequence - sequence;
+
+    if(pending < PLAYER_INPUT_HISTORY)
+    {
+        for(u16 s = sequence + 1; s != (u16)(predicted_sequence + 1); ++s)
+            player_move(&player.state, &input_history[s % PLAYER_INPUT_HISTORY]);
+    }
+
+    // ease small differences out instead of popping the camera
+    Vector3f error = {
+        shown.x - player.state.position.x,
+        shown.y - player.state.position.y,
+        shown.z - player.state.position.z
+    };
+
+    if(magnitude_v3f(&error) < PLAYER_CORRECTION_SNAP)
+        player.correction = error;
+    else
+        memset(&player.correction,0,sizeof(Vector3f));
+}
+
+static void player_update_velocity(PlayerState* state, PlayerInput* input, Vector3f* target, Vector3f* up)
+{
+    float accel           = 0.167f; // 1 meter per second
+    float max_vel         = 0.175f;
+    float friction_factor = 0.008f;
+
+    if(input->keys & PLAYER_KEY_SHIFT)
+    {
+        accel   *= 2.0f;
+        max_vel *= 2.0f;
+    }
+
+    if(!state->jumped && (input->keys & PLAYER_KEY_JUMP))
+    {
+        // jump
+        state->jumped = true;
+        state->velocity.y += 0.4f;
+    }
+
+    // walking stays on the ground plane
+    Vector3f forward = {target->x, 0.0f, target->z};
+    normalize_v3f(&forward);
+
+    if(input->keys & PLAYER_KEY_W)
+    {
+        state->velocity.x += -accel * forward.x;
+        state->velocity.z += -accel * forward.z;
+    }
+
+    if(input->keys & PLAYER_KEY_S)
+    {
+        state->velocity.x += +accel * forward.x;
+        state->velocity.z += +accel * forward.z;
+    }
+
+    if(input->keys & PLAYER_KEY_A)
+    {
+        Vector3f left;
+        cross_v3f(*up, *target, &left);
+        normalize_v3f(&left);
+
+        state->velocity.x += -accel * left.x;
+        state->velocity.y += -accel * left.y;
+        state->velocity.z += -accel * left.z;
+    }
+
+    if(input->keys & PLAYER_KEY_D)
+    {
+        Vector3f right;
+        cross_v3f(*up, *target, &right);
+        normalize_v3f(&right);
+
+        state->velocity.x += +accel * right.x;
+        state->velocity.y += +accel * right.y;
+        state->velocity.z += +accel * right.z;
+    }
+
+    // ground friction
+    if(ABS(state->velocity.x) > 0.0f || ABS(state->velocity.z) > 0.0f)
+    {
+        Vector3f friction = {-state->velocity.x, 0.0f, -state->velocity.z};
+
+        normalize_v3f(&friction);
+        friction.x *= friction_factor;
+        friction.z *= friction_factor;
+
+        state->velocity.x += friction.x;
+        state->velocity.z += friction.z;
+    }
+
+    float velocity_magnitude =
+        sqrt(state->velocity.x*state->velocity.x + 
+             state->velocity.z*state->velocity.z);
+
+    float margin_of_error = 0.0166f;
+
+    if(velocity_magnitude > max_vel)
+    {
+        // set velocity to max
+        normalize_v3f(&state->velocity);
+
+        state->velocity.x *= max_vel;
+        state->velocity.z *= max_vel;
+    }
+    else if(ABS(velocity_magnitude) < margin_of_error)
+    {
+        state->velocity.x = 0.0f;
+        state->velocity.z = 0.0f;
+    }
+}
+
+// One frame of walking physics. Runs on the client to predict and on the server
+// to decide where players really are, so it may only depend on state and input.
+void player_move(PlayerState* state, PlayerInput* input)
 {
-   if(camera.mode == CAMERA_MODE_FOLLOW_PLAYER)
-   {
-       player.velocity.x = camera.velocity.x;
-       player.velocity.y = camera.velocity.y;
-       player.velocity.z = camera.velocity.z;
-
-       player.position.x = camera.position.x;
-       player.position.y = camera.position.y;
-       player.position.z = camera.position.z;
-
-       player.target.x = camera.target.x;
-       player.target.y = camera.target.y;
-       player.target.z = camera.target.z;
-
-       player.up.x = camera.up.x;
-       player.up.y = camera.up.y;
-       player.up.z = camera.up.z;
-
-       player.angle_h = camera.angle_h;
-       player.angle_v = camera.angle_v;
+    Vector3f target, up;
+    get_view_vectors(input->angle_h, input->angle_v, &target, &up);
+
+    float terrain_height = 0.0f;
+    Vector3f norm = {0};
+    terrain_get_stats(state->position.x, state->position.z, &terrain_height, &norm);
+
+    float ground = PLAYER_HEIGHT + terrain_height;
+    float margin_of_error = 0.05f;
+
+    if(state->position.y > ground)
+    {
+        // gravity
+        state->velocity.y -= 0.02;
+        if(state->position.y > ground + margin_of_error)
+            state->is_in_air = true;
+    }
+    else
+    {
+        state->velocity.y = 0.0f;
+        state->is_in_air = false;
+        state->jumped = false;
     }
+
+    if(!state->is_in_air)
+        player_update_velocity(state, input, &target, &up);
+
+    bool below_ground = (state->position.y < ground);
+
+    state->position.x += state->velocity.x;
+    state->position.y += state->velocity.y;
+    state->position.z += state->velocity.z;
+
+    if(below_ground)
+        state->position.y = ground;
 }
 
 static void load_player_props()
@@ -1,5 +1,43 @@
 #pragma once
 
+#define PLAYER_HEIGHT (1.5f + 1.4f) // meters, eye height above the ground
+
+// PlayerInput.keys
+#define PLAYER_KEY_W     (1<<0)
+#define PLAYER_KEY_S     (1<<1)
+#define PLAYER_KEY_A     (1<<2)
+#define PLAYER_KEY_D     (1<<3)
+#define PLAYER_KEY_JUMP  (1<<4)
+#define PLAYER_KEY_SHIFT (1<<5)
+#define PLAYER_KEY_FIRE  (1<<6)
+#define PLAYER_KEY_BITS  7
+
+#define PLAYER_FIRE_RANGE 100.0f
+#define PLAYER_HIT_RADIUS 2.0f
+
+#define PLAYER_INPUT_HISTORY    128   // predicted inputs kept for replay, ~2s at TARGET_FPS
+#define PLAYER_CORRECTION_SNAP  2.0f  // corrections bigger than this are snapped to instead of smoothed
+#define PLAYER_CORRECTION_DECAY 0.85f // fraction of a smoothed correction left after each frame
+
+// One frame of input, all the server needs to move a player
+typedef struct
+{
+    u16   sequence;
+    u8    keys; // PLAYER_KEY_*
+    float angle_h;
+    float angle_v;
+    float interp_delay; // seconds behind the server the others were drawn, sent with PLAYER_KEY_FIRE
+} PlayerInput;
+
+// Everything player_move reads and writes, so both ends can run it
+typedef struct
+{
+    Vector3f position;
+    Vector3f velocity;
+    bool is_in_air;
+    bool jumped;
+} PlayerState;
+
 typedef struct
 {
     char name[16];
@@ -11,10 +49,8 @@ typedef struct
     float accel_factor;
 
     Vector3f accel;
-    Vector3f velocity;
-    Vector3f position;
-    Vector3f target;
-    Vector3f up;
+    PlayerState state;
+    Vector3f correction; // prediction error still being eased out, added to where the camera sits
 
     float angle_h;
     float angle_v;
@@ -25,8 +61,7 @@ typedef struct
     bool key_d_down;
     bool key_space;
     bool key_shift;
-    bool is_in_air;
-    bool jumped;
+    bool key_fire; // until the next input carries it
 } Player;
 
 typedef struct
@@ -39,4 +74,7 @@ typedef struct
 extern Player player;
 
 void player_init();
-void player_update();
+void player_get_input(PlayerInput* input, float angle_h, float angle_v); // keys held now, looking along the angles
+void player_update(PlayerInput* input);
+void player_reconcile(u16 sequence, PlayerState* state);
+void player_move(PlayerState* state, PlayerInput* input);
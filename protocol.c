@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "util.h"
+#include "math3d.h"
+#include "terrain.h"
+#include "protocol.h"
+
+u32 game_id = 0;
+
+PositionRange position_range = {0};
+
+bool protocol_init()
+{
+    if(!terrain_load_bounds(TERRAIN_HEIGHTMAP))
+        return false;
+
+    Vector3f min, max;
+    terrain_get_bounds(&min, &max);
+
+    min.y -= POSITION_HEADROOM;
+    max.y += POSITION_HEADROOM;
+
+    position_range_init(&position_range, min, max, POSITION_PRECISION);
+
+    printf("Position quantization: %d/%d/%d bits\n",position_range.bits[0],position_range.bits[1],position_range.bits[2]);
+    return true;
+}
+
+void create_game_id()
+{
+    game_id = 0x98325423;
+}
+
+void write_packet_header(u8* data, PacketHeader* header)
+{
+    BitWriter w;
+    bit_writer_init(&w, data, PACKET_HEADER_SIZE);
+
+    bit_write(&w, header->game_id, 32);
+    bit_write(&w, header->packet_id, 16);
+    bit_write(&w, header->type, 8);
+    bit_write(&w, header->ack, 16);
+    bit_write(&w, header->ack_bitfield, 32);
+}
+
+void read_packet_header(const u8* data, PacketHeader* header)
+{
+    BitReader r;
+    bit_reader_init(&r, data, PACKET_HEADER_SIZE);
+
+    header->game_id      = bit_read(&r, 32);
+    header->packet_id    = bit_read(&r, 16);
+    header->type         = bit_read(&r, 8);
+    header->ack          = bit_read(&r, 16);
+    header->ack_bitfield = bit_read(&r, 32);
+}
+
+u32 write_packet(u8* data, Packet* pkt)
+{
+    u32 data_len = MIN(pkt->data_len, PACKET_MAX_PAYLOAD);
+
+    write_packet_header(data, &pkt->header);
+    memcpy(data + PACKET_HEADER_SIZE, pkt->data, data_len);
+
+    return PACKET_HEADER_SIZE + data_len;
+}
+
+// Points view at the header and payload inside data, which must outlive the view.
+// Returns false if the datagram is too short to hold a header.
+bool parse_packet(const u8* data, u32 len, PacketView* view)
+{
+    if(len < PACKET_HEADER_SIZE)
+        return false;
+
+    read_packet_header(data, &view->header);
+
+    view->data = data + PACKET_HEADER_SIZE;
+    view->data_len = MIN(len - PACKET_HEADER_SIZE, PACKET_MAX_PAYLOAD);
+
+    return true;
+}
+
+u32 get_ack_bit_field(ReceivedPackets* received)
+{
+    return received->received_bits;
+}
+
+bool update_received_packets(ReceivedPackets* received, u16 packet_id)
+{
+    if(!received->received_any)
+    {
+        received->received_any = true;
+        received->latest_id = packet_id;
+        received->received_bits = 0;
+        return true;
+    }
+
+    if(is_packet_id_greater(packet_id, received->latest_id))
+    {
+        u16 shift = packet_id - received->latest_id;
+
+        // slide the window forward, the previous latest becomes bit (shift-1)
+        received->received_bits = (shift >= 32) ? 0 : (received->received_bits << shift);
+        if(shift <= 32)
+            received->received_bits |= (1u << (shift-1));
+
+        received->latest_id = packet_id;
+        return true;
+    }
+
+    u16 age = received->latest_id - packet_id;
+    if(age == 0 || age > 32)
+        return false;
+
+    u32 bit = 1u << (age-1);
+    if(received->received_bits & bit)
+        return false;
+
+    received->received_bits |= bit;
+    return true;
+}
+
+// Rounds a snapshot value to what the receiver will decode
+void quantize_client_data(ClientData* c)
+{
+    for(int i = 0; i < 3; ++i)
+    {
+        float* axis = get_axis(&c->position, i);
+        *axis = dequantize_position(&position_range, quantize_position(&position_range, *axis, i), i);
+    }
+
+    c->angle_h = dequantize_angle_h(quantize_angle_h(c->angle_h, ANGLE_H_BITS), ANGLE_H_BITS);
+    c->angle_v = dequantize_angle_v(quantize_angle_v(c->angle_v, ANGLE_V_BITS), ANGLE_V_BITS);
+}
+
+void write_player_input(BitWriter* w, PlayerInput* input)
+{
+    bit_write(w, input->keys, PLAYER_KEY_BITS);
+    bit_write(w, quantize_angle_h(input->angle_h, INPUT_ANGLE_BITS), INPUT_ANGLE_BITS);
+    bit_write(w, quantize_angle_v(input->angle_v, INPUT_ANGLE_BITS), INPUT_ANGLE_BITS);
+
+    if(input->keys & PLAYER_KEY_FIRE)
+        bit_write(w, (u32)MIN(input->interp_delay*1000.0f + 0.5f, (1 << INTERP_DELAY_BITS)-1), INTERP_DELAY_BITS);
+}
+
+void read_player_input(BitReader* r, PlayerInput* input)
+{
+    input->keys    = bit_read(r, PLAYER_KEY_BITS);
+    input->angle_h = dequantize_angle_h(bit_read(r, INPUT_ANGLE_BITS), INPUT_ANGLE_BITS);
+    input->angle_v = dequantize_angle_v(bit_read(r, INPUT_ANGLE_BITS), INPUT_ANGLE_BITS);
+
+    input->interp_delay = 0.0f;
+    if(input->keys & PLAYER_KEY_FIRE)
+        input->interp_delay = bit_read(r, INTERP_DELAY_BITS) / 1000.0f;
+}
+
+// Sent exactly, prediction replays from it and must land where the server did
+void write_player_state(BitWriter* w, PlayerState* state)
+{
+    for(int i = 0; i < 3; ++i)
+        bit_write_float(w, *get_axis(&state->position, i));
+
+    for(int i = 0; i < 3; ++i)
+        bit_write_float(w, *get_axis(&state->velocity, i));
+
+    bit_write(w, state->is_in_air ? 1 : 0, 1);
+    bit_write(w, state->jumped ? 1 : 0, 1);
+}
+
+void read_player_state(BitReader* r, PlayerState* state)
+{
+    for(int i = 0; i < 3; ++i)
+        *get_axis(&state->position, i) = bit_read_float(r);
+
+    for(int i = 0; i < 3; ++i)
+        *get_axis(&state->velocity, i) = bit_read_float(r);
+
+    state->is_in_air = bit_read(r, 1);
+    state->jumped    = bit_read(r, 1);
+}
+
+// inputs is a ring indexed by sequence % PLAYER_INPUT_REDUNDANCY holding the
+// last num_inputs commands up to sequence. They go newest first, the server
+// drops the ones it has already run. Returns the payload size.
+u32 write_input_payload(u8* data, PlayerInput* inputs, int num_inputs, u16 sequence)
+{
+    BitWriter w;
+    bit_writer_init(&w, data, PACKET_MAX_PAYLOAD);
+
+    bit_write(&w, sequence, 16);
+    bit_write(&w, num_inputs-1, INPUT_COUNT_BITS);
+
+    for(int i = 0; i < num_inputs; ++i)
+        write_player_input(&w, &inputs[(u16)(sequence - i) % PLAYER_INPUT_REDUNDANCY]);
+
+    return bit_writer_get_bytes(&w);
+}
+
+// Counterpart of read_world_state_header
+void write_world_state_header(BitWriter* w, WorldStateHeader* h)
+{
+    bit_write(w, h->tick, 32);
+    bit_write(w, h->has_baseline ? 1 : 0, 1);
+    bit_write(w, h->has_baseline ? h->tick - h->baseline_tick : 0, SNAPSHOT_HISTORY_BITS);
+    bit_write(w, h->num_clients, CLIENT_COUNT_BITS);
+    bit_write(w, h->ignore_id, CLIENT_ID_BITS);
+    bit_write(w, h->part, SNAPSHOT_PART_BITS);
+    bit_write(w, h->num_parts-1, SNAPSHOT_PART_BITS);
+    bit_write(w, h->num_entries, ENTRY_COUNT_BITS);
+
+    if(h->part == 0)
+    {
+        bit_write(w, (u32)MIN(h->tick_time / TICK_TIME_PRECISION, (1 << TICK_TIME_BITS)-1), TICK_TIME_BITS);
+        bit_write(w, h->has_player ? 1 : 0, 1);
+
+        if(h->has_player)
+        {
+            bit_write(w, h->input_sequence, 16);
+            write_player_state(w, &h->player_state);
+        }
+
+        bit_write(w, h->hits, 8);
+        bit_write(w, h->last_hit_id, CLIENT_ID_BITS);
+    }
+}
+
+bool read_world_state_header(BitReader* r, WorldStateHeader* h)
+{
+    h->tick          = bit_read(r, 32);
+    h->has_baseline  = bit_read(r, 1);
+    h->baseline_tick = h->tick - bit_read(r, SNAPSHOT_HISTORY_BITS);
+    h->num_clients   = bit_read(r, CLIENT_COUNT_BITS);
+    h->ignore_id     = bit_read(r, CLIENT_ID_BITS);
+    h->part          = bit_read(r, SNAPSHOT_PART_BITS);
+    h->num_parts     = bit_read(r, SNAPSHOT_PART_BITS) + 1;
+    h->num_entries   = bit_read(r, ENTRY_COUNT_BITS);
+
+    h->tick_time = 0.0;
+    h->has_player = false;
+    h->input_sequence = 0;
+    memset(&h->player_state, 0, sizeof(PlayerState));
+    h->hits = 0;
+    h->last_hit_id = 0;
+
+    if(h->part == 0)
+    {
+        h->tick_time  = bit_read(r, TICK_TIME_BITS) * TICK_TIME_PRECISION;
+        h->has_player = bit_read(r, 1);
+
+        if(h->has_player)
+        {
+            h->input_sequence = bit_read(r, 16);
+            read_player_state(r, &h->player_state);
+        }
+
+        h->hits        = bit_read(r, 8);
+        h->last_hit_id = bit_read(r, CLIENT_ID_BITS);
+    }
+
+    return !r->overflow && h->part < h->num_parts;
+}
+
+// Returns which fields changed between the baseline and current state of one
+// client, 0 if nothing did. Either is NULL if the client isn't in that snapshot.
+// Values in the history are already quantized so they can be compared directly.
+u8 get_entry_mask(ClientData* c, ClientData* b)
+{
+    if(!c)
+        return ENTRY_REMOVED;
+
+    if(!b)
+        return ENTRY_ALL;
+
+    u8 mask = 0;
+
+    if(c->position.x != b->position.x) mask |= ENTRY_POSITION_X;
+    if(c->position.y != b->position.y) mask |= ENTRY_POSITION_Y;
+    if(c->position.z != b->position.z) mask |= ENTRY_POSITION_Z;
+    if(c->angle_h    != b->angle_h)    mask |= ENTRY_ANGLE_H;
+    if(c->angle_v    != b->angle_v)    mask |= ENTRY_ANGLE_V;
+
+    return mask;
+}
+
+int get_entry_max_bits(u8 mask)
+{
+    int bits = CLIENT_ID_BITS + 1;
+
+    if(mask & ENTRY_REMOVED)
+        return bits;
+
+    bits += ENTRY_MASK_BITS;
+
+    for(int i = 0; i < 3; ++i)
+    {
+        if(mask & (ENTRY_POSITION_X << i))
+            bits += 1 + MAX(position_range.bits[i], POSITION_DELTA_BITS);
+    }
+
+    if(mask & ENTRY_ANGLE_H) bits += ANGLE_H_BITS;
+    if(mask & ENTRY_ANGLE_V) bits += ANGLE_V_BITS;
+
+    return bits;
+}
+
+// Entry: id, removed flag, then the field mask and the fields it lists.
+// Position components that moved only a few steps since the baseline are
+// sent as a small signed delta, the rest in full.
+void write_entry(BitWriter* w, u16 id, u8 mask, ClientData* c, ClientData* b)
+{
+    bit_write(w, id, CLIENT_ID_BITS);
+    bit_write(w, (mask & ENTRY_REMOVED) ? 1 : 0, 1);
+
+    if(mask & ENTRY_REMOVED)
+        return;
+
+    bit_write(w, mask, ENTRY_MASK_BITS);
+
+    const s32 delta_range = 1 << (POSITION_DELTA_BITS-1);
+
+    for(int i = 0; i < 3; ++i)
+    {
+        if(!(mask & (ENTRY_POSITION_X << i)))
+            continue;
+
+        u32 value = quantize_position(&position_range, *get_axis(&c->position, i), i);
+
+        if(b)
+        {
+            s32 delta = (s32)value - (s32)quantize_position(&position_range, *get_axis(&b->position, i), i);
+
+            if(delta >= -delta_range && delta < delta_range)
+            {
+                bit_write(w, 1, 1);
+                bit_write(w, (u32)(delta + delta_range), POSITION_DELTA_BITS);
+                continue;
+            }
+        }
+
+        bit_write(w, 0, 1);
+        bit_write(w, value, position_range.bits[i]);
+    }
+
+    if(mask & ENTRY_ANGLE_H) bit_write(w, quantize_angle_h(c->angle_h, ANGLE_H_BITS), ANGLE_H_BITS);
+    if(mask & ENTRY_ANGLE_V) bit_write(w, quantize_angle_v(c->angle_v, ANGLE_V_BITS), ANGLE_V_BITS);
+}
+
+bool decode_entries(WorldState* ws, u32* value_tick, BitReader* r, u16 num_entries)
+{
+    const s32 delta_range = 1 << (POSITION_DELTA_BITS-1);
+
+    for(int i = 0; i < num_entries; ++i)
+    {
+        u16  id      = bit_read(r, CLIENT_ID_BITS);
+        bool removed = bit_read(r, 1);
+
+        if(r->overflow)
+            return false;
+
+        if(removed)
+        {
+            ws->present[id / 64] &= ~(1ULL << (id % 64));
+            continue;
+        }
+
+        u8 mask = bit_read(r, ENTRY_MASK_BITS);
+
+        // ws starts out as a copy of the baseline, so it holds what deltas are relative to
+        bool in_baseline = world_state_has_client(ws, id);
+        ClientData* c = &ws->client_data[id];
+
+        for(int j = 0; j < 3; ++j)
+        {
+            if(!(mask & (ENTRY_POSITION_X << j)))
+                continue;
+
+            float* axis = get_axis(&c->position, j);
+            bool is_delta = bit_read(r, 1);
+
+            if(is_delta)
+            {
+                if(!in_baseline)
+                    return false;
+
+                s32 delta = (s32)bit_read(r, POSITION_DELTA_BITS) - delta_range;
+                *axis = dequantize_position(&position_range, (u32)((s32)quantize_position(&position_range, *axis, j) + delta), j);
+            }
+            else
+            {
+                *axis = dequantize_position(&position_range, bit_read(r, position_range.bits[j]), j);
+            }
+        }
+
+        if(mask & ENTRY_ANGLE_H) c->angle_h = dequantize_angle_h(bit_read(r, ANGLE_H_BITS), ANGLE_H_BITS);
+        if(mask & ENTRY_ANGLE_V) c->angle_v = dequantize_angle_v(bit_read(r, ANGLE_V_BITS), ANGLE_V_BITS);
+
+        if(r->overflow)
+            return false;
+
+        ws->present[id / 64] |= (1ULL << (id % 64));
+        value_tick[id] = ws->tick;
+    }
+
+    return true;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "util.h"
+#include "math3d.h"
+#include "player.h"
+#include "net.h"
+#include "bitpack.h"
+
+// What goes over the wire between client and server, shared by the game, the
+// server and the bots. Nothing in here touches a socket.
+
+#define SNAPSHOT_HISTORY   32 // ticks of world state kept as delta baselines
+#define SNAPSHOT_MAX_PARTS 32 // packets one snapshot may be split into
+
+// Snapshot entry field mask
+#define ENTRY_POSITION_X (1<<0)
+#define ENTRY_POSITION_Y (1<<1)
+#define ENTRY_POSITION_Z (1<<2)
+#define ENTRY_ANGLE_H    (1<<3)
+#define ENTRY_ANGLE_V    (1<<4)
+#define ENTRY_ALL        0x1F
+#define ENTRY_REMOVED    (1<<7)
+
+// Wire format. Everything is bit-packed LSB first, so the layout doesn't
+// depend on struct padding or host byte order.
+#define PACKET_HEADER_SIZE  13 // game_id 32, packet_id 16, type 8, ack 16, ack_bitfield 32
+#define PACKET_MAX_PAYLOAD  (MAX_PACKET_DATA_SIZE - PACKET_HEADER_SIZE) // datagrams stay within MAX_PACKET_DATA_SIZE
+
+#define CLIENT_ID_BITS        10 // MAX_CLIENTS-1
+#define CLIENT_COUNT_BITS     11 // MAX_CLIENTS
+#define SNAPSHOT_HISTORY_BITS 5  // SNAPSHOT_HISTORY-1, baseline sent as an offset from tick
+#define SNAPSHOT_PART_BITS    5  // SNAPSHOT_MAX_PARTS-1
+#define ENTRY_COUNT_BITS      11
+#define ENTRY_MASK_BITS       5
+
+// snapshot part header: tick, has_baseline, baseline offset, num_clients, ignore_id, part, num_parts-1, num_entries.
+// Part 0 follows it with the receiver's own player state, then every part has its entries.
+#define WORLD_STATE_NUM_PARTS_BIT   (32 + 1 + SNAPSHOT_HISTORY_BITS + CLIENT_COUNT_BITS + CLIENT_ID_BITS + SNAPSHOT_PART_BITS)
+#define WORLD_STATE_NUM_ENTRIES_BIT (WORLD_STATE_NUM_PARTS_BIT + SNAPSHOT_PART_BITS)
+#define WORLD_STATE_HEADER_BITS     (WORLD_STATE_NUM_ENTRIES_BIT + ENTRY_COUNT_BITS)
+
+// Quantization
+#define POSITION_PRECISION  0.01f // world units per step
+#define POSITION_HEADROOM   64.0f // vertical room beyond the terrain's height range
+#define POSITION_DELTA_BITS 8     // moves smaller than this many steps are sent relative to the baseline
+#define ANGLE_H_BITS        12
+#define ANGLE_V_BITS        11
+#define INPUT_ANGLE_BITS    16    // view angles steer movement, so inputs carry them finer than snapshots
+#define TICK_TIME_BITS      16
+#define TICK_TIME_PRECISION 0.00001 // seconds per step, so up to ~0.65s
+
+// Input commands. Each packet repeats the last few so a lost one rarely costs a move.
+#define PLAYER_INPUT_REDUNDANCY 8
+#define INPUT_COUNT_BITS        3  // PLAYER_INPUT_REDUNDANCY-1
+#define INTERP_DELAY_BITS       8          // ms, sent with PLAYER_KEY_FIRE
+
+// A received datagram parsed in place: the header is decoded, the payload is
+// left where it landed in the receive buffer.
+typedef struct
+{
+    PacketHeader header;
+    const u8*    data;
+    u32          data_len;
+} PacketView;
+
+// What every snapshot part starts with
+typedef struct
+{
+    u32  tick;
+    bool has_baseline;
+    u32  baseline_tick;
+    u16  num_clients;
+    u16  ignore_id;
+    u8   part;
+    u8   num_parts;
+    u16  num_entries;
+
+    // first part only
+    double      tick_time; // how long the server's previous tick took
+    bool        has_player;
+    u16         input_sequence;
+    PlayerState player_state;
+    u8          hits;
+    u16         last_hit_id;
+} WorldStateHeader;
+
+// Remote packets seen so far, in the form sent back as ack/ack_bitfield:
+// bit n of received_bits is set if packet (latest_id - 1 - n) arrived.
+typedef struct
+{
+    bool received_any;
+    u16  latest_id;
+    u32  received_bits;
+} ReceivedPackets;
+
+extern u32 game_id;
+
+// From the terrain bounds, set up by protocol_init
+extern PositionRange position_range;
+
+static inline float* get_axis(Vector3f* v, int axis)
+{
+    return (axis == 0) ? &v->x : (axis == 1) ? &v->y : &v->z;
+}
+
+static inline bool is_packet_id_greater(u16 id, u16 cmp)
+{
+    return ((id > cmp) && (id - cmp <= 32768)) || 
+           ((id < cmp) && (cmp - id  > 32768));
+}
+
+static inline bool is_tick_greater(u32 tick, u32 cmp)
+{
+    return (s32)(tick - cmp) > 0;
+}
+
+static inline bool world_state_has_client(WorldState* ws, u16 id)
+{
+    return (ws->present[id / 64] >> (id % 64)) & 1;
+}
+
+bool protocol_init(); // loads the terrain bounds the position range comes from
+
+void create_game_id();
+
+void write_packet_header(u8* data, PacketHeader* header);
+void read_packet_header(const u8* data, PacketHeader* header);
+u32  write_packet(u8* data, Packet* pkt); // header and payload, returns the datagram's size
+bool parse_packet(const u8* data, u32 len, PacketView* view); // false if too short for a header, data must outlive the view
+
+u32  get_ack_bit_field(ReceivedPackets* received);
+bool update_received_packets(ReceivedPackets* received, u16 packet_id); // false if a duplicate or too old to be tracked
+
+void quantize_client_data(ClientData* c); // rounds to what the receiver will decode
+void write_player_input(BitWriter* w, PlayerInput* input);
+void read_player_input(BitReader* r, PlayerInput* input);
+void write_player_state(BitWriter* w, PlayerState* state);
+void read_player_state(BitReader* r, PlayerState* state);
+u32  write_input_payload(u8* data, PlayerInput* inputs, int num_inputs, u16 sequence);
+
+void write_world_state_header(BitWriter* w, WorldStateHeader* h);
+bool read_world_state_header(BitReader* r, WorldStateHeader* h);
+
+// Snapshot entries, one client each against the baseline value b the receiver holds
+u8   get_entry_mask(ClientData* c, ClientData* b);
+int  get_entry_max_bits(u8 mask);
+void write_entry(BitWriter* w, u16 id, u8 mask, ClientData* c, ClientData* b);
+bool decode_entries(WorldState* ws, u32* value_tick, BitReader* r, u16 num_entries);
@@ -0,0 +1,249 @@
+// Server receive path benchmark: blasts datagrams at a running server from
+// several sockets and reports how many it took in, not part of the game build.
+//
+// gcc -O2 recv_bench.c -lpthread -o recv_bench
+// ./adventure-server &
+// ./recv_bench [server ip] [--sockets N] [--time seconds] [--size bytes]
+//
+// Processed is sent minus the datagrams the host dropped for a full receive
+// buffer (RcvbufErrors in /proc/net/snmp), so nothing else on the host should
+// be receiving UDP at the same time. The datagrams aren't game packets, the
+// server reads and discards each one as malformed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define BENCH_PORT     27001
+#define BENCH_MAX_SIZE 1024
+#define BENCH_MAX_SOCKETS 64
+
+typedef unsigned long long u64;
+
+static struct sockaddr_in server;
+static int    num_sockets = 4;
+static double duration = 3.0;
+static int    datagram_size = 48;
+
+static volatile bool running = true;
+
+typedef struct
+{
+    pthread_t thread;
+    int socket;
+    u64 sent;
+    u64 failed; // sendto errors, the sender's own buffer
+} Sender;
+
+static Sender senders[BENCH_MAX_SOCKETS];
+
+static double get_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+// the host's UDP counters, false if they can't be read
+static bool get_udp_drops(u64* rcvbuf_errors, u64* no_ports)
+{
+    FILE* f = fopen("/proc/net/snmp", "r");
+    if(!f)
+        return false;
+
+    char names[512], values[512];
+    bool found = false;
+
+    // a line of names and then a line of values for each protocol
+    while(fgets(names, sizeof(names), f) && fgets(values, sizeof(values), f))
+    {
+        if(strncmp(names, "Udp:", 4) != 0)
+            continue;
+
+        char* name_save;
+        char* value_save;
+        char* name  = strtok_r(names, " \n", &name_save);
+        char* value = strtok_r(values, " \n", &value_save);
+
+        while(name && value)
+        {
+            if(strcmp(name, "RcvbufErrors") == 0)
+                *rcvbuf_errors = strtoull(value, NULL, 10);
+            else if(strcmp(name, "NoPorts") == 0)
+                *no_ports = strtoull(value, NULL, 10);
+
+            name  = strtok_r(NULL, " \n", &name_save);
+            value = strtok_r(NULL, " \n", &value_save);
+        }
+
+        found = true;
+        break;
+    }
+
+    fclose(f);
+    return found;
+}
+
+static void* sender_run(void* arg)
+{
+    Sender* sender = arg;
+    unsigned char data[BENCH_MAX_SIZE];
+
+    memset(data, 0xAB, sizeof(data));
+
+    while(running)
+    {
+        if(sendto(sender->socket, data, datagram_size, 0, (struct sockaddr*)&server, sizeof(server)) == datagram_size)
+            sender->sent++;
+        else
+            sender->failed++;
+    }
+
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* ip = "127.0.0.1";
+
+    for(int i = 1; i < argc; ++i)
+    {
+        if(argv[i][0] == '-' && argv[i][1] == '-')
+        {
+            if(i+1 >= argc)
+            {
+                printf("%s needs a value\n", argv[i]);
+                return 1;
+            }
+
+            if(strncmp(argv[i]+2,"sockets",7) == 0)
+                num_sockets = atoi(argv[++i]);
+            else if(strncmp(argv[i]+2,"time",4) == 0)
+                duration = atof(argv[++i]);
+            else if(strncmp(argv[i]+2,"size",4) == 0)
+                datagram_size = atoi(argv[++i]);
+        }
+        else
+        {
+            ip = argv[i];
+        }
+    }
+
+    if(num_sockets < 1 || num_sockets > BENCH_MAX_SOCKETS || datagram_size < 1 || datagram_size > BENCH_MAX_SIZE)
+    {
+        printf("Need 1 to %d sockets and datagrams of 1 to %d bytes\n", BENCH_MAX_SOCKETS, BENCH_MAX_SIZE);
+        return 1;
+    }
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(BENCH_PORT);
+
+    if(inet_pton(AF_INET, ip, &server.sin_addr) != 1)
+    {
+        printf("Invalid server address %s\n", ip);
+        return 1;
+    }
+
+    u64 rcvbuf_start = 0, no_ports_start = 0;
+    if(!get_udp_drops(&rcvbuf_start, &no_ports_start))
+    {
+        printf("Can't read /proc/net/snmp, drops can't be counted\n");
+        return 1;
+    }
+
+    for(int i = 0; i < num_sockets; ++i)
+    {
+        senders[i].socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if(senders[i].socket < 0)
+        {
+            perror("Failed to create socket");
+            return 1;
+        }
+    }
+
+    printf("Sending %d byte datagrams to %s:%d from %d sockets for %.1f s\n", datagram_size, ip, BENCH_PORT, num_sockets, duration);
+
+    double t0 = get_time();
+
+    for(int i = 0; i < num_sockets; ++i)
+        pthread_create(&senders[i].thread, NULL, sender_run, &senders[i]);
+
+    // a line a second, then the totals
+    double next_report = t0 + 1.0;
+    double end = t0 + duration;
+    u64 last_sent = 0, last_drops = 0;
+    double last_time = t0;
+
+    for(;;)
+    {
+        double now = get_time();
+        if(now >= end)
+            break;
+
+        double wait = (next_report < end ? next_report : end) - now;
+        usleep((useconds_t)(wait * 1000000.0));
+
+        now = get_time();
+        if(now < next_report)
+            continue;
+
+        u64 sent = 0, rcvbuf = 0, no_ports = 0;
+        for(int i = 0; i < num_sockets; ++i)
+            sent += senders[i].sent;
+        get_udp_drops(&rcvbuf, &no_ports);
+
+        u64 drops = (rcvbuf - rcvbuf_start) + (no_ports - no_ports_start);
+        double elapsed = now - last_time;
+
+        printf("%5.1f s | sent %9.0f pkt/s | processed %9.0f pkt/s | dropped %9.0f pkt/s\n",
+               now - t0,
+               (sent - last_sent) / elapsed,
+               ((sent - last_sent) - (drops - last_drops)) / elapsed,
+               (drops - last_drops) / elapsed);
+
+        last_sent = sent;
+        last_drops = drops;
+        last_time = now;
+        next_report += 1.0;
+    }
+
+    running = false;
+
+    for(int i = 0; i < num_sockets; ++i)
+        pthread_join(senders[i].thread, NULL);
+
+    double elapsed = get_time() - t0;
+
+    // let the server drain what's still queued before the last count
+    usleep(200000);
+
+    u64 sent = 0, failed = 0, rcvbuf = 0, no_ports = 0;
+    for(int i = 0; i < num_sockets; ++i)
+    {
+        sent   += senders[i].sent;
+        failed += senders[i].failed;
+        close(senders[i].socket);
+    }
+    get_udp_drops(&rcvbuf, &no_ports);
+
+    u64 buffer_drops = rcvbuf - rcvbuf_start;
+    u64 unreachable  = no_ports - no_ports_start;
+    u64 drops = buffer_drops + unreachable;
+    u64 processed = (sent > drops) ? sent - drops : 0;
+
+    printf("\nTotal over %.2f s:\n", elapsed);
+    printf("  sent      %llu (%.0f pkt/s), %llu sends failed\n", sent, sent / elapsed, failed);
+    printf("  processed %llu (%.0f pkt/s)\n", processed, processed / elapsed);
+    printf("  dropped   %llu (%.1f%%): %llu receive buffer full, %llu nothing listening\n",
+           drops, sent ? 100.0 * drops / sent : 0.0, buffer_drops, unreachable);
+
+    return 0;
+}
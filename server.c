@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+
+#include "util.h"
+#include "math3d.h"
+#include "settings.h"
+#include "socket.h"
+#include "net.h"
+#include "metrics.h"
+#include "capture.h"
+
+// Dedicated server, no window or GL, for hosts without a display or GPU.
+// Takes the same server flags as adventure --server.
+//
+// adventure-server [--workers [N]] [--metrics file|unix:path] [--capture file]
+//                  [--replay file [--realtime]]
+//                  [--latency ms] [--jitter ms] [--loss %] [--duplicate %] [--reorder %] [--seed n]
+
+static void on_stop_signal(int sig)
+{
+    (void)sig;
+    net_server_stop();
+}
+
+int main(int argc, char* argv[])
+{
+    int server_workers = 0;
+
+    // network conditions simulated on what the server sends
+    bool simulate_network = false;
+    SocketConditions conditions = {.seed = 1};
+
+    char* metrics_path = NULL;
+    char* capture_path = NULL;
+    char* replay_path = NULL;
+    bool replay_realtime = false;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        if(argv[i][0] != '-' || argv[i][1] != '-')
+            continue;
+
+        // receive workers, one per core unless a count follows
+        if(strncmp(argv[i]+2,"workers",7) == 0)
+        {
+            server_workers = SERVER_WORKERS_PER_CORE;
+
+            if(i+1 < argc && argv[i+1][0] >= '0' && argv[i+1][0] <= '9')
+                server_workers = atoi(argv[++i]);
+        }
+
+        // on its own, so adventure --server command lines work as they are
+        else if(strncmp(argv[i]+2,"server",6) == 0)
+            continue;
+        else if(strncmp(argv[i]+2,"realtime",8) == 0)
+            replay_realtime = true;
+
+        else if(i+1 >= argc)
+        {
+            printf("%s needs a value\n", argv[i]);
+            return 1;
+        }
+
+        // telemetry as JSON lines, to a file or unix:/path
+        else if(strncmp(argv[i]+2,"metrics",7) == 0)
+            metrics_path = argv[++i];
+
+        // every datagram sent and received, to a capture file
+        else if(strncmp(argv[i]+2,"capture",7) == 0)
+            capture_path = argv[++i];
+
+        // run off a capture, as fast as possible unless --realtime
+        else if(strncmp(argv[i]+2,"replay",6) == 0)
+            replay_path = argv[++i];
+
+        // simulated network
+        else if(strncmp(argv[i]+2,"latency",7) == 0)
+        {
+            conditions.latency = atof(argv[++i]);
+            simulate_network = true;
+        }
+        else if(strncmp(argv[i]+2,"jitter",6) == 0)
+        {
+            conditions.jitter = atof(argv[++i]);
+            simulate_network = true;
+        }
+        else if(strncmp(argv[i]+2,"loss",4) == 0)
+        {
+            conditions.loss = atof(argv[++i]);
+            simulate_network = true;
+        }
+        else if(strncmp(argv[i]+2,"duplicate",9) == 0)
+        {
+            conditions.duplicate = atof(argv[++i]);
+            simulate_network = true;
+        }
+        else if(strncmp(argv[i]+2,"reorder",7) == 0)
+        {
+            conditions.reorder = atof(argv[++i]);
+            simulate_network = true;
+        }
+        else if(strncmp(argv[i]+2,"seed",4) == 0)
+        {
+            conditions.seed = (u32)strtoul(argv[++i], NULL, 10);
+        }
+    }
+
+    if(simulate_network && !socket_simulate_conditions(&conditions))
+        return 1;
+
+    // Ctrl-C or a kill stops the server after the current tick, so the
+    // metrics and capture are flushed and closed
+    signal(SIGINT, on_stop_signal);
+    signal(SIGTERM, on_stop_signal);
+
+    int result = -1;
+
+    if(metrics_path && !metrics_start(metrics_path))
+        result = -1;
+    else if(replay_path)
+        result = net_server_replay(replay_path, replay_realtime);
+    else if(!capture_path || capture_start(capture_path))
+        result = net_server_start(server_workers);
+
+    metrics_stop();
+    capture_stop();
+    socket_simulate_stop();
+
+    return result == 0 ? 0 : 1;
+}
@@ -1,2 +1,2 @@
 #!/bin/sh
-./adventure --server
+./adventure-server
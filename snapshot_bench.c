@@ -0,0 +1,678 @@
+// Round trip test and size benchmark for snapshot encoding, not part of the game build.
+// Links the bit packing and wire format units on their own, run from the repo
+// root so the heightmap the position bounds come from is found.
+//
+// gcc -O2 snapshot_bench.c protocol.c bitpack.c ... -lm -o snapshot_bench (see build.sh)
+// ./snapshot_bench [num_clients] [iterations] [seed]
+//
+// Random bit fields go through the bit writer and reader and have to come back
+// exactly. Random ClientData, inputs and whole WorldStates, with positions at and past
+// the terrain bounds and angles around their wrap and clamp points, go through
+// the real writers and readers. Every decoded value has to be within half a
+// quantization step of what was encoded, clamped to the representable range.
+// Then it prints the bytes of a full snapshot and of a delta one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+#include "util.h"
+#include "math3d.h"
+#include "player.h"
+#include "net.h"
+#include "bitpack.h"
+#include "protocol.h"
+
+#define BENCH_ANGLE_SAMPLES 100000
+#define BENCH_BIT_FIELDS    200   // per buffer, a mix of fields, whole bytes and floats
+#define BENCH_BIT_BUFFERS   10000
+#define BENCH_MOVING        0.5f  // fraction of clients that move between delta snapshots
+#define BENCH_TELEPORTING   0.02f // fraction that move too far for a position delta
+#define BENCH_TURNING       0.25f // fraction that look around
+#define BENCH_CHURN         0.01f // fraction that leave, and as many that join
+#define BENCH_MAX_FAILURES  10    // printed, the rest are only counted
+
+static u32 rng_state = 1;
+static u32 failures = 0;
+
+static u32 bench_rand()
+{
+    // xorshift32
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static float rand_float(float min, float max)
+{
+    return min + (max - min) * (bench_rand() / 4294967296.0f);
+}
+
+static bool rand_chance(float chance)
+{
+    return rand_float(0.0f, 1.0f) < chance;
+}
+
+static void fail(const char* what, float value, float decoded, float allowed)
+{
+    if(failures++ < BENCH_MAX_FAILURES)
+        printf("FAIL %s: %.6f decoded as %.6f, allowed error %.6f\n", what, value, decoded, allowed);
+}
+
+// Half a step, and the float rounding of a decoded value of up to that
+// magnitude, which nothing stored as a float can do better than
+static double get_allowed_error(double step, double magnitude)
+{
+    return step / 2.0 + magnitude * FLT_EPSILON;
+}
+
+//
+// Bits
+//
+
+typedef struct
+{
+    int type; // 0 bit_write, 1 bit_write_bits, 2 float
+    u32 value;
+    int bits;
+    u8  bytes[8];
+} BitField;
+
+static bool check_bit_field(BitField* f, BitReader* r)
+{
+    if(f->type == 1)
+    {
+        for(int i = 0; i < f->bits; i += 8)
+        {
+            int n = MIN(8, f->bits - i);
+            if(bit_read(r, n) != f->bytes[i/8])
+                return false;
+        }
+
+        return true;
+    }
+
+    if(f->type == 2)
+    {
+        float value;
+        memcpy(&value, &f->value, sizeof(float));
+
+        float decoded = bit_read_float(r);
+        return memcmp(&value, &decoded, sizeof(float)) == 0;
+    }
+
+    return bit_read(r, f->bits) == f->value;
+}
+
+// Random fields of every width at every alignment, with some overwritten in
+// place afterwards, have to read back exactly. Going past either end of the
+// buffer has to be flagged and not touch anything.
+static void test_bits()
+{
+    u32 start = failures;
+
+    static u8 data[BENCH_BIT_FIELDS*8 + 1];
+    static BitField fields[BENCH_BIT_FIELDS];
+    static u32 positions[BENCH_BIT_FIELDS];
+
+    for(int b = 0; b < BENCH_BIT_BUFFERS; ++b)
+    {
+        memset(data, 0xAA, sizeof(data)); // bits not written over are never read
+        u32 size = 1 + bench_rand() % (sizeof(data) - 1);
+
+        BitWriter w;
+        bit_writer_init(&w, data, size);
+
+        int num_fields = 0;
+
+        for(; num_fields < BENCH_BIT_FIELDS; ++num_fields)
+        {
+            BitField* f = &fields[num_fields];
+            f->type = bench_rand() % 4 == 0 ? 1 + bench_rand() % 2 : 0;
+
+            if(f->type == 1)
+            {
+                // whole bytes from a buffer, the tail of the last one 0 as the writer needs
+                f->bits = 1 + bench_rand() % 64;
+                memset(f->bytes, 0, sizeof(f->bytes));
+
+                for(int i = 0; i < f->bits; ++i)
+                    f->bytes[i/8] |= (bench_rand() & 1) << (i%8);
+            }
+            else if(f->type == 2)
+            {
+                float value = rand_float(-1000.0f, 1000.0f);
+                memcpy(&f->value, &value, sizeof(float));
+                f->bits = 32;
+            }
+            else
+            {
+                f->bits  = 1 + bench_rand() % 32;
+                f->value = bench_rand() & (f->bits == 32 ? 0xFFFFFFFF : (1u << f->bits) - 1);
+            }
+
+            positions[num_fields] = w.bit_pos;
+
+            if(f->type == 1)
+            {
+                bit_write_bits(&w, f->bytes, f->bits);
+            }
+            else if(f->type == 2)
+            {
+                float value;
+                memcpy(&value, &f->value, sizeof(float));
+                bit_write_float(&w, value);
+            }
+            else
+            {
+                bit_write(&w, f->value, f->bits);
+            }
+
+            if(w.overflow)
+                break;
+        }
+
+        // the field that didn't fit left the writer where it was
+        if(num_fields < BENCH_BIT_FIELDS && w.bit_pos != positions[num_fields])
+            fail("bits written past the end", positions[num_fields], w.bit_pos, 0.0f);
+
+        // change some plain fields in place, as the snapshot part header is
+        for(int i = 0; i < num_fields; ++i)
+        {
+            BitField* f = &fields[i];
+
+            if(f->type == 0 && bench_rand() % 8 == 0)
+            {
+                f->value = bench_rand() & (f->bits == 32 ? 0xFFFFFFFF : (1u << f->bits) - 1);
+                write_bits_at(data, positions[i], f->value, f->bits);
+            }
+        }
+
+        BitReader r;
+        bit_reader_init(&r, data, bit_writer_get_bytes(&w));
+
+        for(int i = 0; i < num_fields; ++i)
+        {
+            if(!check_bit_field(&fields[i], &r) || r.overflow)
+            {
+                fail("bit field", i, fields[i].bits, 0.0f);
+                break;
+            }
+        }
+
+        // only the padding of the last byte is left
+        u32 left = bit_writer_get_bytes(&w)*8 - r.bit_pos;
+        bit_read(&r, left + 1);
+
+        if(left >= 8 || !r.overflow || r.bit_pos != bit_writer_get_bytes(&w)*8 - left)
+            fail("bits read past the end", left, r.bit_pos, 0.0f);
+    }
+
+    printf("Bits: %d buffers of up to %d fields of 1 to 64 bits: %s\n",
+           BENCH_BIT_BUFFERS, BENCH_BIT_FIELDS, failures == start ? "ok" : "FAILED");
+}
+
+//
+// Single values
+//
+
+static float get_position_max(int axis)
+{
+    return position_range.min[axis] + position_range.steps[axis]*position_range.precision;
+}
+
+static double get_position_magnitude(int axis)
+{
+    return MAX(fabs(position_range.min[axis]), fabs(get_position_max(axis)));
+}
+
+// inside, at and a little past the bounds, where the encoding clamps
+static float rand_position(int axis)
+{
+    float min = position_range.min[axis];
+    float max = get_position_max(axis);
+
+    switch(bench_rand() % 8)
+    {
+        case 0: return min;
+        case 1: return max;
+        case 2: return rand_float(min - 10.0f, min);
+        case 3: return rand_float(max, max + 10.0f);
+        default: return rand_float(min, max);
+    }
+}
+
+// around the wrap and clamp points as well as anywhere
+static float rand_angle_h()
+{
+    static const float edges[] = {-720.0f, -540.0f, -360.0f, -180.0f, 0.0f, 180.0f, 360.0f, 540.0f};
+
+    if(bench_rand() % 4 == 0)
+        return edges[bench_rand() % 8] + rand_float(-0.01f, 0.01f);
+
+    return rand_float(-720.0f, 720.0f);
+}
+
+static float rand_angle_v()
+{
+    static const float edges[] = {-90.0f, 90.0f};
+
+    switch(bench_rand() % 4)
+    {
+        case 0: return edges[bench_rand() % 2] + rand_float(-0.01f, 0.01f);
+        case 1: return rand_float(-120.0f, 120.0f);
+        default: return rand_float(-90.0f, 90.0f);
+    }
+}
+
+// errors are worked out in double so the check adds none of its own
+
+static void check_position(float value, float decoded, int axis)
+{
+    double expected = MAX(position_range.min[axis], MIN(value, get_position_max(axis)));
+    double allowed  = get_allowed_error(POSITION_PRECISION, get_position_magnitude(axis));
+
+    if(fabs(decoded - expected) > allowed)
+        fail(axis == 0 ? "position.x" : axis == 1 ? "position.y" : "position.z", value, decoded, allowed);
+}
+
+static void check_angle_h(float value, float decoded, int bits)
+{
+    double error = fmod(fabs((double)value - decoded), 360.0);
+    error = MIN(error, 360.0 - error);
+
+    double allowed = get_allowed_error(360.0 / (1 << bits), 360.0);
+
+    if(error > allowed)
+        fail("angle_h", value, decoded, allowed);
+}
+
+static void check_angle_v(float value, float decoded, int bits)
+{
+    double expected = MAX(-90.0, MIN(value, 90.0));
+    double allowed  = get_allowed_error(180.0 / ((1 << bits) - 1), 90.0);
+
+    if(fabs(decoded - expected) > allowed)
+        fail("angle_v", value, decoded, allowed);
+}
+
+static void check_client_data(ClientData* value, ClientData* decoded)
+{
+    for(int i = 0; i < 3; ++i)
+        check_position(*get_axis(&value->position, i), *get_axis(&decoded->position, i), i);
+
+    check_angle_h(value->angle_h, decoded->angle_h, ANGLE_H_BITS);
+    check_angle_v(value->angle_v, decoded->angle_v, ANGLE_V_BITS);
+}
+
+static void test_values()
+{
+    u32 start = failures;
+
+    for(int i = 0; i < BENCH_ANGLE_SAMPLES; ++i)
+    {
+        for(int axis = 0; axis < 3; ++axis)
+        {
+            float p = rand_position(axis);
+            check_position(p, dequantize_position(&position_range, quantize_position(&position_range, p, axis), axis), axis);
+        }
+    }
+
+    // every angle precision in use, snapshot and input, and the ones around them
+    for(int bits = 8; bits <= 16; ++bits)
+    {
+        for(int i = 0; i < BENCH_ANGLE_SAMPLES; ++i)
+        {
+            float h = rand_angle_h();
+            float v = rand_angle_v();
+
+            check_angle_h(h, dequantize_angle_h(quantize_angle_h(h, bits), bits), bits);
+            check_angle_v(v, dequantize_angle_v(quantize_angle_v(v, bits), bits), bits);
+        }
+    }
+
+    // inputs through their writer and reader, at INPUT_ANGLE_BITS
+    u8 data[PACKET_MAX_PAYLOAD];
+
+    for(int i = 0; i < BENCH_ANGLE_SAMPLES; ++i)
+    {
+        PlayerInput input = {
+            .keys = bench_rand() & ((1 << PLAYER_KEY_BITS) - 1),
+            .angle_h = rand_angle_h(),
+            .angle_v = rand_angle_v(),
+            .interp_delay = rand_float(0.0f, 0.2f)
+        };
+
+        BitWriter w;
+        bit_writer_init(&w, data, sizeof(data));
+        write_player_input(&w, &input);
+
+        PlayerInput decoded;
+        BitReader r;
+        bit_reader_init(&r, data, bit_writer_get_bytes(&w));
+        read_player_input(&r, &decoded);
+
+        if(r.overflow || decoded.keys != input.keys)
+            fail("input keys", input.keys, decoded.keys, 0.0f);
+
+        check_angle_h(input.angle_h, decoded.angle_h, INPUT_ANGLE_BITS);
+        check_angle_v(input.angle_v, decoded.angle_v, INPUT_ANGLE_BITS);
+    }
+
+    printf("Values: positions at %.3f, angles at 8 to 16 bits, inputs at %d bits: %s\n",
+           POSITION_PRECISION, INPUT_ANGLE_BITS, failures == start ? "ok" : "FAILED");
+}
+
+//
+// Whole snapshots
+//
+
+typedef struct
+{
+    u8  data[SNAPSHOT_MAX_PARTS][PACKET_MAX_PAYLOAD];
+    u32 len[SNAPSHOT_MAX_PARTS];
+    int num_parts;
+    u32 bytes; // on the wire, packet headers included
+} EncodedSnapshot;
+
+static void rand_client_data(ClientData* c)
+{
+    for(int i = 0; i < 3; ++i)
+        *get_axis(&c->position, i) = rand_position(i);
+
+    c->angle_h = rand_angle_h();
+    c->angle_v = rand_angle_v();
+}
+
+static void add_client(WorldState* ws, u16 id)
+{
+    ws->present[id / 64] |= (1ULL << (id % 64));
+    ws->num_clients++;
+}
+
+static void remove_client(WorldState* ws, u16 id)
+{
+    ws->present[id / 64] &= ~(1ULL << (id % 64));
+    ws->num_clients--;
+}
+
+static void begin_part(EncodedSnapshot* out, WorldState* current, WorldState* baseline, BitWriter* w)
+{
+    if(out->num_parts == SNAPSHOT_MAX_PARTS)
+    {
+        printf("Snapshot needs more than %d parts\n", SNAPSHOT_MAX_PARTS);
+        exit(1);
+    }
+
+    WorldStateHeader h = {
+        .tick          = current->tick,
+        .has_baseline  = (baseline != NULL),
+        .baseline_tick = baseline ? baseline->tick : current->tick,
+        .num_clients   = current->num_clients,
+        .part          = out->num_parts,
+        .num_parts     = 1 // filled in once they're all written
+    };
+
+    memset(out->data[out->num_parts], 0, PACKET_MAX_PAYLOAD);
+    bit_writer_init(w, out->data[out->num_parts], PACKET_MAX_PAYLOAD);
+    write_world_state_header(w, &h);
+
+    out->num_parts++;
+}
+
+static void end_part(EncodedSnapshot* out, BitWriter* w, u16 num_entries)
+{
+    write_bits_at(w->data, WORLD_STATE_NUM_ENTRIES_BIT, num_entries, ENTRY_COUNT_BITS);
+    out->len[out->num_parts-1] = bit_writer_get_bytes(w);
+}
+
+// As the server sends it, without the budget and priorities: every entry that
+// changed, split over as many parts as it takes. baseline is what the
+// receiver holds, quantized, or NULL for a full snapshot.
+static void encode_snapshot(WorldState* current, WorldState* baseline, EncodedSnapshot* out)
+{
+    // the server compares and keeps quantized values, and encodes from them
+    static WorldState quantized;
+    memcpy(&quantized, current, sizeof(WorldState));
+
+    for(int id = 0; id < MAX_CLIENTS; ++id)
+        quantize_client_data(&quantized.client_data[id]);
+
+    out->num_parts = 0;
+    out->bytes = 0;
+
+    BitWriter w;
+    u16 num_entries = 0;
+
+    begin_part(out, current, baseline, &w);
+
+    for(int id = 0; id < MAX_CLIENTS; ++id)
+    {
+        ClientData* c = world_state_has_client(current, id) ? &quantized.client_data[id] : NULL;
+        ClientData* b = (baseline && world_state_has_client(baseline, id)) ? &baseline->client_data[id] : NULL;
+
+        if(!c && !b)
+            continue;
+
+        u8 mask = get_entry_mask(c, b);
+        if(!mask)
+            continue;
+
+        if(w.bit_pos + get_entry_max_bits(mask) > PACKET_MAX_PAYLOAD*8)
+        {
+            end_part(out, &w, num_entries);
+            begin_part(out, current, baseline, &w);
+            num_entries = 0;
+        }
+
+        write_entry(&w, id, mask, c, b);
+        num_entries++;
+    }
+
+    end_part(out, &w, num_entries);
+
+    for(int i = 0; i < out->num_parts; ++i)
+    {
+        write_bits_at(out->data[i], WORLD_STATE_NUM_PARTS_BIT, out->num_parts-1, SNAPSHOT_PART_BITS);
+        out->bytes += PACKET_HEADER_SIZE + out->len[i];
+    }
+}
+
+// As the client applies it, onto a copy of the baseline it holds
+static void decode_snapshot(EncodedSnapshot* in, WorldState* baseline, WorldState* ws)
+{
+    static u32 value_tick[MAX_CLIENTS];
+
+    if(baseline)
+        memcpy(ws, baseline, sizeof(WorldState));
+    else
+        memset(ws, 0, sizeof(WorldState));
+
+    for(int i = 0; i < in->num_parts; ++i)
+    {
+        BitReader r;
+        bit_reader_init(&r, in->data[i], in->len[i]);
+
+        WorldStateHeader h;
+        if(!read_world_state_header(&r, &h) || h.part != i || h.num_parts != in->num_parts || h.has_baseline != (baseline != NULL))
+        {
+            fail("snapshot header", i, h.part, 0.0f);
+            return;
+        }
+
+        if(!decode_entries(ws, value_tick, &r, h.num_entries))
+        {
+            fail("snapshot entries", i, h.num_entries, 0.0f);
+            return;
+        }
+
+        ws->tick = h.tick;
+        ws->num_clients = h.num_clients;
+    }
+}
+
+static void check_snapshot(WorldState* current, WorldState* decoded)
+{
+    if(decoded->num_clients != current->num_clients)
+        fail("num_clients", current->num_clients, decoded->num_clients, 0.0f);
+
+    for(int id = 0; id < MAX_CLIENTS; ++id)
+    {
+        bool present = world_state_has_client(current, id);
+
+        if(world_state_has_client(decoded, id) != present)
+        {
+            fail("client present", present, !present, 0.0f);
+            continue;
+        }
+
+        if(present)
+            check_client_data(&current->client_data[id], &decoded->client_data[id]);
+    }
+}
+
+// The next tick: some move a little, a few a long way, some turn, a few leave and join
+static void advance_world(WorldState* ws, int num_clients)
+{
+    ws->tick++;
+
+    int churn = (int)(num_clients * BENCH_CHURN);
+
+    for(int i = 0; i < churn; ++i)
+    {
+        u16 leaving = bench_rand() % MAX_CLIENTS;
+        while(!world_state_has_client(ws, leaving))
+            leaving = (leaving + 1) % MAX_CLIENTS;
+
+        remove_client(ws, leaving);
+
+        // maybe the same id again, as a new player
+        u16 joining = bench_rand() % MAX_CLIENTS;
+        while(world_state_has_client(ws, joining))
+            joining = (joining + 1) % MAX_CLIENTS;
+
+        add_client(ws, joining);
+        rand_client_data(&ws->client_data[joining]);
+    }
+
+    for(int id = 0; id < MAX_CLIENTS; ++id)
+    {
+        if(!world_state_has_client(ws, id))
+            continue;
+
+        ClientData* c = &ws->client_data[id];
+
+        if(rand_chance(BENCH_TELEPORTING))
+        {
+            for(int i = 0; i < 3; ++i)
+                *get_axis(&c->position, i) = rand_position(i);
+        }
+        else if(rand_chance(BENCH_MOVING))
+        {
+            // a tick at running speed, within the position delta range
+            c->position.x += rand_float(-0.5f, 0.5f);
+            c->position.z += rand_float(-0.5f, 0.5f);
+            c->position.y += rand_float(-0.1f, 0.1f);
+        }
+
+        if(rand_chance(BENCH_TURNING))
+        {
+            c->angle_h += rand_float(-10.0f, 10.0f);
+            c->angle_v += rand_float(-5.0f, 5.0f);
+        }
+    }
+}
+
+static void bench_snapshots(int num_clients, int iterations)
+{
+    static WorldState current, held, decoded;
+    static EncodedSnapshot encoded;
+
+    u32 start = failures;
+
+    memset(&current, 0, sizeof(current));
+
+    for(int i = 0; i < num_clients; ++i)
+    {
+        add_client(&current, i);
+        rand_client_data(&current.client_data[i]);
+    }
+
+    u64 full_bytes = 0, delta_bytes = 0;
+    int full_parts = 0, delta_parts = 0;
+
+    for(int it = 0; it < iterations; ++it)
+    {
+        // full, and what the receiver holds from then on
+        encode_snapshot(&current, NULL, &encoded);
+        decode_snapshot(&encoded, NULL, &held);
+        check_snapshot(&current, &held);
+
+        full_bytes += encoded.bytes;
+        full_parts += encoded.num_parts;
+
+        // a tick later, against it
+        advance_world(&current, num_clients);
+
+        encode_snapshot(&current, &held, &encoded);
+        decode_snapshot(&encoded, &held, &decoded);
+        check_snapshot(&current, &decoded);
+
+        delta_bytes += encoded.bytes;
+        delta_parts += encoded.num_parts;
+    }
+
+    printf("%5d clients | full %8.1f B in %5.2f parts | delta %8.1f B in %5.2f parts | %s\n",
+           num_clients,
+           (double)full_bytes / iterations, (double)full_parts / iterations,
+           (double)delta_bytes / iterations, (double)delta_parts / iterations,
+           failures == start ? "ok" : "FAILED");
+}
+
+int main(int argc, char* argv[])
+{
+    int num_clients = 0; // 0 for a range of them
+    int iterations  = 100;
+
+    if(argc > 1) num_clients = atoi(argv[1]);
+    if(argc > 2) iterations  = atoi(argv[2]);
+    if(argc > 3) rng_state   = (u32)strtoul(argv[3], NULL, 10);
+
+    if(num_clients < 0 || num_clients > MAX_CLIENTS || iterations <= 0 || rng_state == 0)
+    {
+        printf("Need 0 to %d clients, some iterations and a non zero seed\n", MAX_CLIENTS);
+        return 1;
+    }
+
+    if(!protocol_init())
+        return 1;
+
+    test_bits();
+    test_values();
+
+    printf("Snapshots, %.0f%% moving and %.0f%% turning a tick, %d iterations:\n", BENCH_MOVING*100.0f, BENCH_TURNING*100.0f, iterations);
+
+    if(num_clients > 0)
+    {
+        bench_snapshots(num_clients, iterations);
+    }
+    else
+    {
+        static const int counts[] = {1, 10, 100, 500, 1000, MAX_CLIENTS};
+
+        for(int i = 0; i < 6; ++i)
+            bench_snapshots(counts[i], iterations);
+    }
+
+    if(failures)
+    {
+        printf("%u values out of bounds\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,8 +1,11 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // recvmmsg, sendmmsg
+#endif
+
 #define PLATFORM_WINDOWS  1
 #define PLATFORM_MAC      2
 #define PLATFORM_UNIX     3
 
-#define MAX_PACKET_SIZE 1024 
 
 #if defined(_WIN32)
 #define PLATFORM PLATFORM_WINDOWS
@@ -13,8 +16,12 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #if PLATFORM == PLATFORM_WINDOWS
     #include <winsock2.h>
@@ -23,6 +30,8 @@
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <unistd.h>
+    #include <fcntl.h>
+    #include <errno.h>
 #endif
 
 #if PLATFORM == PLATFORM_WINDOWS
@@ -30,7 +39,66 @@
 #endif
 
 #include "util.h"
+#include "math3d.h"
+#include "timer.h"
 #include "socket.h"
+#include "capture.h"
+
+#define SIM_WHEEL_SLOTS   1024  // one per millisecond, so nothing is held back longer than this
+#define SIM_MAX_PACKETS   16384 // in flight at once, more are dropped as by a full router queue
+#define SIM_MAX_SIZE      1500  // bigger datagrams go out untouched
+#define SIM_REORDER_DELAY 30.0f // ms a reordered datagram is held back for the next ones to overtake it
+#define SIM_NONE          0xFFFFFFFF
+
+#if defined(__linux__)
+#define SIM_CLOCK CLOCK_MONOTONIC // what the wake condition's timed waits count in
+#else
+#define SIM_CLOCK CLOCK_REALTIME  // the only clock condition variables use there
+#endif
+
+typedef struct
+{
+    int     socket;
+    Address address;
+    u32     len;
+    u32     next; // next in the same wheel slot or the free list
+    u8      data[SIM_MAX_SIZE];
+} SimPacket;
+
+// Network condition simulator. While it's enabled everything sent is queued
+// on a timer wheel of millisecond slots, after a seeded RNG has decided on
+// loss, duplication, jitter and reordering, and its own thread sends the
+// datagrams once their slot comes around, sleeping until the next one is due.
+static struct
+{
+    atomic_bool enabled;
+    SocketConditions conditions;
+    atomic_uint num_rngs; // threads that have seeded their own RNG
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // something queued sooner than the thread is sleeping for, or stopping
+    bool stopping;
+    Timer timer;
+
+    SimPacket* packets;
+    u32 free_list;
+    u32 num_queued;
+    u32 slot_head[SIM_WHEEL_SLOTS];
+    u32 slot_tail[SIM_WHEEL_SLOTS];
+    u64 wheel_time;   // ms of the next slot to send
+    u64 wake_time;    // ms the thread sleeps until, 0 while it's awake
+    double last_due;  // ms, datagrams don't overtake each other unless reordered
+    u32 num_dropped_full;
+} sim;
+
+// Each sending thread draws from its own RNG, so one thread's losses and
+// delays don't depend on how its sends interleave with another's
+static _Thread_local u64 sim_rng = 0;
+
+static int sim_sendto(int socket_handle, Address* address, u8* pkt, u32 pkt_size);
+static int send_one(int socket_handle, Address* address, u8* pkt, u32 pkt_size);
+static int send_datagram(int socket_handle, Address* address, u8* pkt, u32 pkt_size);
 
 bool socket_initalize()
 {
@@ -71,6 +139,57 @@ void socket_close(int socket_handle)
 #endif
 }
 
+bool socket_set_nonblocking(int socket_handle)
+{
+#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
+    int flags = fcntl(socket_handle, F_GETFL, 0);
+    if(flags < 0 || fcntl(socket_handle, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        perror("Failed to set socket non-blocking.\n");
+        return false;
+    }
+#elif PLATFORM == PLATFORM_WINDOWS
+    DWORD non_blocking = 1;
+    if(ioctlsocket(socket_handle, FIONBIO, &non_blocking) != 0)
+    {
+        printf("Failed to set socket non-blocking.\n");
+        return false;
+    }
+#endif
+    return true;
+}
+
+bool socket_set_recv_buffer_size(int socket_handle, int size)
+{
+    // The kernel may clamp this to net.core.rmem_max
+    if(setsockopt(socket_handle, SOL_SOCKET, SO_RCVBUF, (const char*)&size, sizeof(size)) < 0)
+    {
+        perror("Failed to set socket receive buffer size.\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool socket_set_reuseport(int socket_handle)
+{
+#if defined(SO_REUSEPORT)
+    // lets several sockets bind the same port, the kernel spreads incoming
+    // datagrams across them by hashing the sender's address
+    int enable = 1;
+    if(setsockopt(socket_handle, SOL_SOCKET, SO_REUSEPORT, (const char*)&enable, sizeof(enable)) < 0)
+    {
+        perror("Failed to set SO_REUSEPORT.\n");
+        return false;
+    }
+
+    return true;
+#else
+    printf("SO_REUSEPORT isn't supported on this platform.\n");
+    return false;
+#endif
+}
+
 bool socket_bind(int socket_handle, Address* address, u16 port)
 {
     struct sockaddr_in to = {0};
@@ -99,15 +218,49 @@ bool socket_bind(int socket_handle, Address* address, u16 port)
     return true;
 }
 
+static void address_to_sockaddr(Address* address, struct sockaddr_in* to)
+{
+    u32 address_u32 = (address->a << 24) | (address->b << 16) | (address->c << 8) | (address->d);
+
+    memset(to,0,sizeof(struct sockaddr_in));
+
+    to->sin_family      = AF_INET;
+    to->sin_addr.s_addr = htonl(address_u32);
+    to->sin_port        = htons(address->port);
+}
+
+static void sockaddr_to_address(struct sockaddr_in* from, Address* address)
+{
+    u32 address_u32 = ntohl(from->sin_addr.s_addr);
+
+    address->a = (u8)(address_u32 >> 24);
+    address->b = (u8)(address_u32 >> 16);
+    address->c = (u8)(address_u32 >> 8);
+    address->d = (u8)(address_u32 >> 0);
+    address->port = ntohs(from->sin_port);
+}
+
 int socket_sendto(int socket_handle, Address* address, u8* pkt, u32 pkt_size)
 {
-    struct sockaddr_in to = {0};
+    if(capture_running)
+        capture_datagram(CAPTURE_SEND, address, pkt, pkt_size);
 
-    u32 address_u32 = (address->a << 24) | (address->b << 16) | (address->c << 8) | (address->d);
+    return send_one(socket_handle, address, pkt, pkt_size);
+}
 
-    to.sin_family      = AF_INET;
-    to.sin_addr.s_addr = htonl(address_u32);
-    to.sin_port        = htons(address->port);
+// through the network simulator if it's on
+static int send_one(int socket_handle, Address* address, u8* pkt, u32 pkt_size)
+{
+    if(atomic_load(&sim.enabled) && pkt_size <= SIM_MAX_SIZE)
+        return sim_sendto(socket_handle, address, pkt, pkt_size);
+
+    return send_datagram(socket_handle, address, pkt, pkt_size);
+}
+
+static int send_datagram(int socket_handle, Address* address, u8* pkt, u32 pkt_size)
+{
+    struct sockaddr_in to;
+    address_to_sockaddr(address, &to);
 
     int sent_bytes = sendto(socket_handle,(const u8*)pkt, pkt_size, 0, (struct sockaddr*)&to, sizeof(struct sockaddr_in));
 
@@ -120,28 +273,465 @@ int socket_sendto(int socket_handle, Address* address, u8* pkt, u32 pkt_size)
     return sent_bytes;
 }
 
-int socket_recvfrom(int socket_handle, Address* address, u8* pkt)
+int socket_recv(int socket_handle, SocketDatagram* datagram)
 {
-    u8 packet_data[MAX_PACKET_SIZE] = {0};
-
     struct sockaddr_in from;
     socklen_t from_len = sizeof(from);
 
-    int recv_bytes = recvfrom(socket_handle, (u8*)&packet_data, MAX_PACKET_SIZE, 0, (struct sockaddr*)&from, &from_len);
+    int recv_bytes = recvfrom(socket_handle, datagram->data, datagram->len, 0, (struct sockaddr*)&from, &from_len);
 
-    memcpy(pkt,packet_data,recv_bytes);
+    if(recv_bytes < 0)
+    {
+#if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
+        // non-blocking socket has been drained
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
+#endif
+        perror("Failed to receive packet.\n");
+        return -1;
+    }
 
-    address->a = (u8)(from.sin_addr.s_addr >> 0);
-    address->b = (u8)(from.sin_addr.s_addr >> 8);
-    address->c = (u8)(from.sin_addr.s_addr >> 16);
-    address->d = (u8)(from.sin_addr.s_addr >> 24);
-    address->port = ntohs(from.sin_port);
+    datagram->len = recv_bytes;
+    sockaddr_to_address(&from, &datagram->address);
 
-    if (recv_bytes < 0 )
+    if(capture_running)
+        capture_datagram(CAPTURE_RECV, &datagram->address, datagram->data, datagram->len);
+
+    return recv_bytes;
+}
+
+int socket_recv_batch(int socket_handle, SocketDatagram* datagrams, int count)
+{
+    if(count > SOCKET_BATCH_MAX)
+        count = SOCKET_BATCH_MAX;
+
+#if defined(__linux__)
+    struct mmsghdr     msgs[SOCKET_BATCH_MAX];
+    struct iovec       iovecs[SOCKET_BATCH_MAX];
+    struct sockaddr_in froms[SOCKET_BATCH_MAX];
+
+    for(int i = 0; i < count; ++i)
+    {
+        iovecs[i].iov_base = datagrams[i].data;
+        iovecs[i].iov_len  = datagrams[i].len;
+
+        memset(&msgs[i],0,sizeof(struct mmsghdr));
+        msgs[i].msg_hdr.msg_name    = &froms[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov     = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    int num_recv = recvmmsg(socket_handle, msgs, count, MSG_DONTWAIT, NULL);
+
+    if(num_recv < 0)
     {
-        perror("Failed to receive packet.\n" );
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            perror("Failed to receive packets.\n");
         return 0;
     }
 
-    return recv_bytes;
+    for(int i = 0; i < num_recv; ++i)
+    {
+        datagrams[i].len = msgs[i].msg_len;
+        sockaddr_to_address(&froms[i], &datagrams[i].address);
+
+        if(capture_running)
+            capture_datagram(CAPTURE_RECV, &datagrams[i].address, datagrams[i].data, datagrams[i].len);
+    }
+
+    return num_recv;
+#else
+    int num_recv = 0;
+
+    for(; num_recv < count; ++num_recv)
+    {
+        if(socket_recv(socket_handle, &datagrams[num_recv]) < 0)
+            break;
+    }
+
+    return num_recv;
+#endif
+}
+
+int socket_send_batch(int socket_handle, SocketDatagram* datagrams, int count)
+{
+    int num_sent = 0;
+
+    if(capture_running)
+    {
+        for(int i = 0; i < count; ++i)
+            capture_datagram(CAPTURE_SEND, &datagrams[i].address, datagrams[i].data, datagrams[i].len);
+    }
+
+    if(atomic_load(&sim.enabled))
+    {
+        for(; num_sent < count; ++num_sent)
+            send_one(socket_handle, &datagrams[num_sent].address, datagrams[num_sent].data, datagrams[num_sent].len);
+
+        return num_sent;
+    }
+
+#if defined(__linux__)
+    struct mmsghdr     msgs[SOCKET_BATCH_MAX];
+    struct iovec       iovecs[SOCKET_BATCH_MAX];
+    struct sockaddr_in tos[SOCKET_BATCH_MAX];
+
+    while(num_sent < count)
+    {
+        int batch_count = count - num_sent;
+        if(batch_count > SOCKET_BATCH_MAX)
+            batch_count = SOCKET_BATCH_MAX;
+        SocketDatagram* batch = &datagrams[num_sent];
+
+        for(int i = 0; i < batch_count; ++i)
+        {
+            address_to_sockaddr(&batch[i].address, &tos[i]);
+
+            iovecs[i].iov_base = batch[i].data;
+            iovecs[i].iov_len  = batch[i].len;
+
+            memset(&msgs[i],0,sizeof(struct mmsghdr));
+            msgs[i].msg_hdr.msg_name    = &tos[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            msgs[i].msg_hdr.msg_iov     = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen  = 1;
+        }
+
+        int batch_sent = sendmmsg(socket_handle, msgs, batch_count, 0);
+
+        if(batch_sent <= 0)
+        {
+            // a full send buffer just drops the rest, the caller counts them
+            if(batch_sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+                perror("Failed to send packets.\n");
+            break;
+        }
+
+        num_sent += batch_sent;
+    }
+#else
+    for(; num_sent < count; ++num_sent)
+    {
+        if(send_datagram(socket_handle, &datagrams[num_sent].address, datagrams[num_sent].data, datagrams[num_sent].len) == 0)
+            break;
+    }
+#endif
+
+    return num_sent;
+}
+
+//
+// Network condition simulator
+//
+
+// xorshift64*, the same seed gives a thread the same losses and delays
+static u32 sim_rand()
+{
+    if(sim_rng == 0)
+    {
+        // the threads get different streams, in the order they first send
+        u64 stream = atomic_fetch_add(&sim.num_rngs, 1);
+        sim_rng = (((u64)sim.conditions.seed << 1) | 1) + stream*0x9E3779B97F4A7C15ULL; // xorshift can't start from 0
+        if(sim_rng == 0)
+            sim_rng = 1;
+    }
+
+    sim_rng ^= sim_rng >> 12;
+    sim_rng ^= sim_rng << 25;
+    sim_rng ^= sim_rng >> 27;
+    return (u32)((sim_rng * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+// [0,1)
+static float sim_rand_float()
+{
+    return (sim_rand() >> 8) / (float)(1 << 24);
+}
+
+static bool sim_chance(float percent)
+{
+    return percent > 0.0f && sim_rand_float()*100.0f < percent;
+}
+
+static double sim_now_ms()
+{
+    return timer_get_elapsed(&sim.timer) * 1000.0;
+}
+
+// sim.lock must be held. Skips the empty slots already gone by, so a datagram
+// queued after the thread has slept a while isn't placed behind the times.
+static void sim_advance_wheel(u64 now)
+{
+    if(sim.num_queued == 0)
+        sim.wheel_time = MAX(sim.wheel_time, now);
+
+    while(sim.wheel_time < now && sim.slot_head[sim.wheel_time % SIM_WHEEL_SLOTS] == SIM_NONE)
+        sim.wheel_time++;
+}
+
+// sim.lock must be held
+static void sim_enqueue(int socket_handle, Address* address, u8* pkt, u32 pkt_size, double due)
+{
+    if(sim.free_list == SIM_NONE)
+    {
+        if(sim.num_dropped_full++ == 0)
+            printf("Network simulator queue is full, dropping.\n");
+        return;
+    }
+
+    u32 index = sim.free_list;
+    SimPacket* p = &sim.packets[index];
+    sim.free_list = p->next;
+
+    p->socket = socket_handle;
+    p->address = *address;
+    p->len = pkt_size;
+    p->next = SIM_NONE;
+    memcpy(p->data, pkt, pkt_size);
+
+    // the slot about to be sent is the soonest it can go
+    u64 due_ms = (u64)MAX(due, (double)sim.wheel_time);
+    due_ms = MIN(due_ms, sim.wheel_time + SIM_WHEEL_SLOTS - 1);
+
+    int slot = due_ms % SIM_WHEEL_SLOTS;
+
+    if(sim.slot_head[slot] == SIM_NONE)
+        sim.slot_head[slot] = index;
+    else
+        sim.packets[sim.slot_tail[slot]].next = index;
+
+    sim.slot_tail[slot] = index;
+    sim.num_queued++;
+
+    if(due_ms < sim.wake_time)
+        pthread_cond_signal(&sim.wake);
+}
+
+static int sim_sendto(int socket_handle, Address* address, u8* pkt, u32 pkt_size)
+{
+    SocketConditions* c = &sim.conditions;
+
+    // decided before taking the lock, each thread on its own RNG
+    int copies = sim_chance(c->loss) ? 0 : (sim_chance(c->duplicate) ? 2 : 1);
+    float jitter[2];
+    bool reorder[2];
+
+    for(int i = 0; i < copies; ++i)
+    {
+        jitter[i] = (sim_rand_float()*2.0f - 1.0f)*c->jitter;
+        reorder[i] = sim_chance(c->reorder);
+    }
+
+    pthread_mutex_lock(&sim.lock);
+
+    double now = sim_now_ms();
+    sim_advance_wheel((u64)now);
+
+    for(int i = 0; i < copies; ++i)
+    {
+        double due = now + c->latency + jitter[i];
+
+        if(reorder[i])
+        {
+            due = MAX(due, sim.last_due) + SIM_REORDER_DELAY;
+        }
+        else
+        {
+            due = MAX(due, sim.last_due);
+            sim.last_due = due;
+        }
+
+        sim_enqueue(socket_handle, address, pkt, pkt_size, due);
+    }
+
+    pthread_mutex_unlock(&sim.lock);
+
+    // as far as the caller knows it went out
+    return pkt_size;
+}
+
+// sim.lock must be held, ms of the soonest queued slot or UINT64_MAX if none
+static u64 sim_next_due()
+{
+    if(sim.num_queued == 0)
+        return UINT64_MAX;
+
+    for(u64 t = sim.wheel_time; t < sim.wheel_time + SIM_WHEEL_SLOTS; ++t)
+    {
+        if(sim.slot_head[t % SIM_WHEEL_SLOTS] != SIM_NONE)
+            return t;
+    }
+
+    return UINT64_MAX;
+}
+
+// sim.lock must be held, returns early when signaled
+static void sim_wait_until(u64 due_ms)
+{
+    sim.wake_time = due_ms;
+
+    if(due_ms == UINT64_MAX)
+    {
+        pthread_cond_wait(&sim.wake, &sim.lock);
+    }
+    else
+    {
+        double wait_ms = (double)due_ms - sim_now_ms();
+
+        if(wait_ms > 0.0)
+        {
+            struct timespec ts;
+            clock_gettime(SIM_CLOCK, &ts);
+
+            u64 ns = (u64)ts.tv_nsec + (u64)(wait_ms * 1000000.0);
+            ts.tv_sec += ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+
+            pthread_cond_timedwait(&sim.wake, &sim.lock, &ts);
+        }
+    }
+
+    sim.wake_time = 0;
+}
+
+static void* sim_run(void* arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&sim.lock);
+
+    while(!sim.stopping)
+    {
+        // sleeps until a slot's due, senders wake it for anything sooner
+        u64 now = (u64)sim_now_ms();
+        u64 next = sim_next_due();
+
+        if(next > now)
+        {
+            sim_wait_until(next);
+            continue;
+        }
+
+        // take every slot that's come due, then send without holding up the senders
+        u32 head = SIM_NONE, tail = SIM_NONE;
+
+        for(; sim.wheel_time <= now; sim.wheel_time++)
+        {
+            int slot = sim.wheel_time % SIM_WHEEL_SLOTS;
+            if(sim.slot_head[slot] == SIM_NONE)
+                continue;
+
+            if(head == SIM_NONE)
+                head = sim.slot_head[slot];
+            else
+                sim.packets[tail].next = sim.slot_head[slot];
+
+            tail = sim.slot_tail[slot];
+            sim.slot_head[slot] = SIM_NONE;
+        }
+
+        if(head == SIM_NONE)
+            continue;
+
+        pthread_mutex_unlock(&sim.lock);
+
+        u32 count = 0;
+        for(u32 i = head; i != SIM_NONE; i = sim.packets[i].next)
+        {
+            SimPacket* p = &sim.packets[i];
+            send_datagram(p->socket, &p->address, p->data, p->len);
+            count++;
+        }
+
+        pthread_mutex_lock(&sim.lock);
+        sim.packets[tail].next = sim.free_list;
+        sim.free_list = head;
+        sim.num_queued -= count;
+    }
+
+    pthread_mutex_unlock(&sim.lock);
+
+    return NULL;
+}
+
+bool socket_simulate_conditions(SocketConditions* conditions)
+{
+    if(atomic_load(&sim.enabled))
+        return true;
+
+    sim.packets = malloc(SIM_MAX_PACKETS*sizeof(SimPacket));
+    if(!sim.packets)
+    {
+        printf("Failed to allocate network simulator queue.\n");
+        return false;
+    }
+
+    for(u32 i = 0; i < SIM_MAX_PACKETS; ++i)
+        sim.packets[i].next = (i+1 < SIM_MAX_PACKETS) ? i+1 : SIM_NONE;
+
+    sim.free_list = 0;
+
+    for(int i = 0; i < SIM_WHEEL_SLOTS; ++i)
+        sim.slot_head[i] = SIM_NONE;
+
+    sim.conditions = *conditions;
+    sim.conditions.latency = MAX(0.0f, MIN(conditions->latency, SIM_WHEEL_SLOTS - SIM_REORDER_DELAY - 1.0f));
+    sim.conditions.jitter  = MAX(0.0f, MIN(conditions->jitter, sim.conditions.latency));
+    sim.num_queued = 0;
+    sim.wheel_time = 0;
+    sim.wake_time = 0;
+    sim.last_due = 0.0;
+    sim.stopping = false;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#if defined(__linux__)
+    pthread_condattr_setclock(&attr, SIM_CLOCK);
+#endif
+
+    pthread_mutex_init(&sim.lock, NULL);
+    pthread_cond_init(&sim.wake, &attr);
+    pthread_condattr_destroy(&attr);
+    timer_begin(&sim.timer);
+
+    if(pthread_create(&sim.thread, NULL, sim_run, NULL) != 0)
+    {
+        printf("Failed to start network simulator thread.\n");
+        pthread_cond_destroy(&sim.wake);
+        pthread_mutex_destroy(&sim.lock);
+        free(sim.packets);
+        sim.packets = NULL;
+        return false;
+    }
+
+    printf("Simulating %.0f ms latency, %.0f ms jitter, %.1f%% loss, %.1f%% duplicated, %.1f%% reordered (seed %u)\n",
+        sim.conditions.latency, sim.conditions.jitter, sim.conditions.loss, sim.conditions.duplicate, sim.conditions.reorder, sim.conditions.seed);
+
+    atomic_store(&sim.enabled, true);
+    return true;
+}
+
+void socket_simulate_stop()
+{
+    if(!atomic_load(&sim.enabled))
+        return;
+
+    // sends from here on go straight out
+    atomic_store(&sim.enabled, false);
+
+    pthread_mutex_lock(&sim.lock);
+    sim.stopping = true;
+    pthread_cond_signal(&sim.wake);
+    pthread_mutex_unlock(&sim.lock);
+
+    pthread_join(sim.thread, NULL);
+
+    if(sim.num_queued > 0)
+        printf("Network simulator stopped with %u datagrams still queued, dropping.\n", sim.num_queued);
+
+    pthread_cond_destroy(&sim.wake);
+    pthread_mutex_destroy(&sim.lock);
+    free(sim.packets);
+    sim.packets = NULL;
 }
@@ -13,12 +13,50 @@ typedef struct
     u16 port;
 } Address;
 
+#define SOCKET_BATCH_MAX 64
+
+typedef struct
+{
+    Address address;
+    u8* data;
+    u32 len; // recv: capacity of data on input, bytes received on output
+} SocketDatagram;
+
+// Conditions for socket_simulate_conditions, applied to what this end sends
+typedef struct
+{
+    float latency;   // ms
+    float jitter;    // ms either side of latency
+    float loss;      // percent of datagrams dropped
+    float duplicate; // percent sent twice
+    float reorder;   // percent held back for later ones to overtake
+    u32   seed;
+} SocketConditions;
+
 bool socket_initalize();
 void socket_shutdown();
 
 bool socket_create(int* socket_handle);
 bool socket_bind(int socket_handle, Address* address, u16 port);
 void socket_close(int socket_handle);
+bool socket_set_nonblocking(int socket_handle);
+bool socket_set_recv_buffer_size(int socket_handle, int size);
+bool socket_set_reuseport(int socket_handle); // call before socket_bind
 
 int socket_sendto(int socket_handle, Address* address, u8* pkt, u32 pkt_size);
-int socket_recvfrom(int socket_handle, Address* address, u8* pkt);
+// Receives one datagram straight into the caller's datagram->data buffer, no copies.
+// Returns the bytes received, -1 on error or when a non-blocking socket has no more data waiting.
+int socket_recv(int socket_handle, SocketDatagram* datagram);
+
+// batched I/O, one syscall per SOCKET_BATCH_MAX datagrams where supported.
+// Both return the number of datagrams transferred.
+int socket_recv_batch(int socket_handle, SocketDatagram* datagrams, int count);
+int socket_send_batch(int socket_handle, SocketDatagram* datagrams, int count);
+
+// Runs everything sent from now on through a network simulator, from a
+// thread of its own. Call before any sockets are used. Each thread that sends
+// draws from its own RNG, so the seed repeats a thread's losses and delays
+// run to run, but with several threads sending which thread gets which
+// stream depends on the order they first send in.
+bool socket_simulate_conditions(SocketConditions* conditions);
+void socket_simulate_stop(); // joins the simulator's thread, whatever is still queued is dropped. Call once nothing else is sending.
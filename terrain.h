@@ -1,5 +1,18 @@
 #pragma once
 
+#define TERRAIN_HEIGHTMAP "textures/heightmap5.png"
+#define TERRAIN_DETAIL_LEVEL 1.0f
+
+// Height grid loaded by terrain_load_heights, see terrain_height.c
+extern float* terrain_heights;
+extern int terrain_heights_width;
+
+extern float terrain_scale;
+extern float terrain_pos;
+
 void terrain_build(const char* heightmap);
+bool terrain_load_bounds(const char* heightmap);
+bool terrain_load_heights(const char* heightmap);
+void terrain_get_bounds(Vector3f* min, Vector3f* max);
 void terrain_get_stats(float x, float z, float* height, Vector3f* ret_norm);
 void terrain_render();
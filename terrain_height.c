@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "util/stb_image.h"
+
+#include "util.h"
+#include "math3d.h"
+#include "terrain.h"
+
+// Terrain heights and sampling, kept apart from the mesh and GL objects in
+// terrain.c so the server and bots can walk players over the ground.
+
+#define TERRAIN_SCALE_FACTOR 2.0f
+#define TERRAIN_HEIGHT_SCALE 8.0f // heightmap value per unit of height
+
+float* terrain_heights;
+int terrain_heights_width;
+
+float terrain_scale;
+float terrain_pos;
+
+static bool get_terrain_points_and_pos(float x, float z, Vector3f* p1, Vector3f* p2, Vector3f* p3, Vector2f* pos)
+{
+    float terrain_x = -x + terrain_pos;
+    float terrain_z = -z + terrain_pos;
+
+    float grid_square_size = terrain_scale * (1.0f / terrain_heights_width);
+
+    int grid_x = (int)floor(terrain_x / grid_square_size);
+    if(grid_x < 0 || grid_x >= terrain_heights_width)
+        return false;
+
+    int grid_z = (int)floor(terrain_z / grid_square_size);
+    if(grid_z < 0 || grid_z >= terrain_heights_width)
+        return false;
+
+    float x_coord = fmod(terrain_x,grid_square_size)/grid_square_size;
+    float z_coord = fmod(terrain_z,grid_square_size)/grid_square_size;
+    
+    //printf("grid x: %d z: %d\n",grid_x, grid_z);
+
+    int g = terrain_heights_width+1;
+
+    if (x_coord <= (1.0f-z_coord))
+    {
+        p1->x = 0; p1->y = terrain_heights[g*grid_x+grid_z];     p1->z = 0;
+        p2->x = 1; p2->y = terrain_heights[(g*grid_x+1)+grid_z]; p2->z = 1;
+        p3->x = 0; p3->y = terrain_heights[g*grid_x+(grid_z+1)]; p3->z = 1;
+    }
+    else
+    {
+        p1->x = 1; p1->y = terrain_heights[(g*grid_x+1)+grid_z]; p1->z = 0;
+        p2->x = 1; p2->y = terrain_heights[(g*grid_x+1)+grid_z]; p2->z = 1;
+        p3->x = 0; p3->y = terrain_heights[g*grid_x+(grid_z+1)]; p3->z = 1;
+    }
+
+    if(pos == NULL)
+        return true;
+
+    pos->x = x_coord;
+    pos->y = z_coord;
+
+    return true;
+}
+
+void terrain_get_stats(float x, float z, float* height, Vector3f* ret_norm)
+{
+    Vector3f a  = {0};
+    Vector3f b  = {0};
+    Vector3f c  = {0};
+    Vector2f pos2 = {0};
+
+    bool res = get_terrain_points_and_pos(x,z,&a,&b,&c,&pos2);
+
+    if(res)
+    {
+        *height = barry_centric(a,b,c,pos2);
+        get_normal_v3f(a,b,c,ret_norm);
+    }
+    else
+    {
+        *height = 0.0f;
+        memset(ret_norm,0,sizeof(Vector3f));
+    }
+}
+
+static void set_terrain_dimensions(int heightmap_width)
+{
+    terrain_heights_width = (heightmap_width-1)*TERRAIN_DETAIL_LEVEL;
+
+    terrain_scale = TERRAIN_SCALE_FACTOR*terrain_heights_width;
+    terrain_pos = terrain_scale / 2.0f;
+}
+
+bool terrain_load_bounds(const char* heightmap)
+{
+    // only reads the image header, no height data or GL objects
+    int x,y,n;
+    if(!stbi_info(heightmap, &x, &y, &n))
+    {
+        printf("Failed to load file (%s)\n",heightmap);
+        return false;
+    }
+
+    set_terrain_dimensions(x);
+    return true;
+}
+
+void terrain_get_bounds(Vector3f* min, Vector3f* max)
+{
+    min->x = -terrain_pos;
+    min->y = 0.0f;
+    min->z = -terrain_pos;
+
+    max->x = terrain_pos;
+    max->y = 255.0f / TERRAIN_HEIGHT_SCALE;
+    max->z = terrain_pos;
+}
+
+bool terrain_load_heights(const char* heightmap)
+{
+    // heights only, no GL objects, so the server can stand players on the ground
+    int x,y,n;
+    unsigned char* heightdata = stbi_load(heightmap, &x, &y, &n, 1);
+
+    if(!heightdata)
+    {
+        printf("Failed to load file (%s)\n",heightmap);
+        return false;
+    }
+    
+    printf("Loaded file %s. w: %d h: %d channels: %d\n",heightmap,x,y,n);
+
+    set_terrain_dimensions(x);
+    int terrain_heights_width_p1 = (x)*TERRAIN_DETAIL_LEVEL;
+
+    free(terrain_heights);
+    terrain_heights = calloc(terrain_heights_width_p1*terrain_heights_width_p1,sizeof(float));
+
+    if(!terrain_heights)
+    {
+        printf("Failed to allocate memory for terrain height array");
+        stbi_image_free(heightdata);
+        return false;
+    }
+
+    for(int i = 0; i < terrain_heights_width_p1; ++i)
+    {
+        for(int j = 0; j < terrain_heights_width_p1; ++j)
+        {
+            float xlookup = (i*terrain_heights_width_p1) / TERRAIN_DETAIL_LEVEL;
+            float ylookup = j / TERRAIN_DETAIL_LEVEL;
+
+            int xindex = (int)xlookup;
+            int yindex = (int)ylookup;
+
+            float mod_x = (xlookup - xindex);
+            float mod_y = (ylookup - yindex);
+
+            int index = xindex + yindex;
+            int width = terrain_heights_width_p1 / TERRAIN_DETAIL_LEVEL;
+
+            float h00 = heightdata[index];
+            float h01 = heightdata[index+width];
+            float h10 = heightdata[index+1];
+            float h11 = heightdata[index+width+1];
+
+            float height_x = (1.0f-mod_x)*h00 + (mod_x)*h01;
+            float height_y = (1.0f-mod_y)*h10 + (mod_y)*h11;
+
+            float norm_height = (height_x + height_y) / 2.0f;
+            norm_height /= TERRAIN_HEIGHT_SCALE;
+
+            terrain_heights[index] = norm_height;
+        }
+    }
+
+    stbi_image_free(heightdata);
+    return true;
+}
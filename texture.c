@@ -2,7 +2,6 @@
 
 #include <GL/glew.h>
 
-#define STB_IMAGE_IMPLEMENTATION
 #include "util/stb_image.h"
 
 #include <stdbool.h>
@@ -4,10 +4,17 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
 
 #include "util.h"
+#include "math3d.h"
 #include "timer.h"
 
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+
 static struct
 {
     bool monotonic;
@@ -33,6 +40,7 @@ static u64 get_timer_value(void)
     }
 }
 
+// run through pthread_once by whichever thread reads the clock first
 static void init_timer(void)
 {
 #if defined(_POSIX_TIMERS) && defined(_POSIX_MONOTONIC_CLOCK)
@@ -55,13 +63,13 @@ static void init_timer(void)
 
 static double get_time()
 {
+    pthread_once(&timer_once, init_timer);
     return (double) (get_timer_value() - timer.offset) / timer.frequency;
 
 }
 
 void timer_begin(Timer* timer)
 {
-    init_timer();
     timer->time_start = get_time();
     timer->time_last = timer->time_start;
 }
@@ -77,17 +85,89 @@ void timer_set_fps(Timer* timer, float fps)
     timer->spf = 1.0f / fps;
 }
 
-void timer_wait_for_frame(Timer* timer)
+void timer_set_policy(Timer* timer, TimerPolicy policy, int max_catch_up)
+{
+    timer->policy = policy;
+    timer->max_catch_up = max_catch_up;
+}
+
+bool timer_is_monotonic()
+{
+    pthread_once(&timer_once, init_timer);
+    return timer.monotonic;
+}
+
+u64 timer_get_clock_ns(double time)
+{
+    pthread_once(&timer_once, init_timer);
+    return timer.offset + (u64)(time * timer.frequency);
+}
+
+void timer_sleep_until(double time)
+{
+    double sleep_until = time - TIMER_SPIN_TIME;
+
+    if(get_time() < sleep_until)
+    {
+        struct timespec ts;
+
+#if defined(__linux__)
+        // absolute, so being preempted on the way in doesn't add to the sleep
+        if(timer.monotonic)
+        {
+            u64 ns = timer_get_clock_ns(sleep_until);
+            ts.tv_sec  = ns / 1000000000;
+            ts.tv_nsec = ns % 1000000000;
+
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+        }
+        else
+#endif
+        {
+            double duration = sleep_until - get_time();
+            if(duration > 0.0)
+            {
+                ts.tv_sec  = (time_t)duration;
+                ts.tv_nsec = (long)((duration - ts.tv_sec) * 1000000000.0);
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+
+    while(get_time() < time);
+}
+
+double timer_start_frame(Timer* timer)
+{
+    double now = get_time();
+    double late = MAX(now - (timer->time_last + timer->spf), 0.0);
+
+    TimerStats* stats = &timer->stats;
+
+    if(stats->frames > 0)
+    {
+        double interval = now - timer->time_frame;
+        stats->interval_total += interval;
+        stats->interval_sq_total += interval*interval;
+    }
+
+    stats->frames++;
+    stats->late_total += late;
+    stats->late_max = MAX(stats->late_max, late);
+
+    timer->time_frame = now;
+    return late;
+}
+
+double timer_wait_for_frame(Timer* timer)
 {
-    while(get_time() < timer->time_last + timer->spf)
-        usleep(100);
+    timer_sleep_until(timer->time_last + timer->spf);
+    return timer_start_frame(timer);
 }
 
 void timer_wait(Timer* timer, float fps)
 {
-    float spf = 1.0f / fps;
-    while(get_time() < timer->time_last + spf)
-        usleep(100);
+    timer_sleep_until(timer->time_last + 1.0f / fps);
 }
 
 double timer_get_elapsed(Timer* timer)
@@ -96,9 +176,41 @@ double timer_get_elapsed(Timer* timer)
     return time_curr - timer->time_start;
 }
 
+double timer_get_time_until_frame(Timer* timer)
+{
+    return (timer->time_last + timer->spf) - get_time();
+}
+
 void timer_inc_frame(Timer* timer)
 {
     timer->time_last += timer->spf;
+
+    // deadlines already gone by, the latest one's frame runs straight away either way
+    int behind = (int)((get_time() - timer->time_last) / timer->spf);
+    int allowed = (timer->policy == TIMER_CATCH_UP) ? MAX(timer->max_catch_up, 1) : 1;
+
+    // after a long stall, or any stall when skipping, carry on from the latest deadline
+    if(behind > allowed)
+    {
+        timer->time_last += (behind - allowed) * (double)timer->spf;
+        timer->stats.skipped += behind - allowed;
+    }
+}
+
+void timer_reset_stats(Timer* timer)
+{
+    memset(&timer->stats, 0, sizeof(TimerStats));
+}
+
+double timer_get_jitter(TimerStats* stats)
+{
+    if(stats->frames < 2)
+        return 0.0;
+
+    double n = stats->frames - 1;
+    double mean = stats->interval_total / n;
+
+    return sqrt(MAX(stats->interval_sq_total / n - mean*mean, 0.0));
 }
 
 void timer_delay_us(int us)
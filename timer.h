@@ -1,19 +1,59 @@
 #pragma once
 
+// What to do when frames fall behind their schedule
+typedef enum
+{
+    TIMER_SKIP,     // drop the missed frames and run one for the latest deadline
+    TIMER_CATCH_UP, // run them back to back, up to max_catch_up behind, then drop the rest
+} TimerPolicy;
+
+// How frames kept to their deadlines, since the last timer_reset_stats
+typedef struct
+{
+    u32    frames;
+    u32    skipped;
+    double late_total; // how far past its deadline each frame started
+    double late_max;
+    double interval_total;    // between the starts of consecutive frames
+    double interval_sq_total;
+} TimerStats;
+
 typedef struct
 {
     float  fps;
     float  spf;
     double time_start;
-    double time_last;
+    double time_last;  // deadline of the current frame
+    double time_frame; // when the current frame really started
+
+    TimerPolicy policy;
+    int         max_catch_up;
+
+    TimerStats stats;
 } Timer;
 
 void timer_begin(Timer* timer);
 void timer_set_fps(Timer* timer, float fps);
-void timer_wait_for_frame(Timer* timer);
-void timer_wait(Timer* timer, float fps);
+void timer_set_policy(Timer* timer, TimerPolicy policy, int max_catch_up);
+
+// Sleeps until the next frame is due and starts it, returns how late it did.
+// The sleep stops TIMER_SPIN_TIME short and spins the rest, the OS wakes us too late to trust it closer.
+double timer_wait_for_frame(Timer* timer);
+// Starts the next frame without waiting, for loops that wait on something else until it's due
+double timer_start_frame(Timer* timer);
+// Moves on to the next deadline, skipping missed frames as the policy says
 void timer_inc_frame(Timer* timer);
+void timer_wait(Timer* timer, float fps);
+
+void   timer_reset_stats(Timer* timer);
+double timer_get_jitter(TimerStats* stats); // standard deviation of the frame interval
+
+#define TIMER_SPIN_TIME 0.0002 // seconds
 
 double timer_get_elapsed(Timer* timer);
+double timer_get_time_until_frame(Timer* timer);
 void timer_delay_us(int us);
 double timer_get_time();
+void timer_sleep_until(double time); // as timer_get_time(), to within a few us
+bool timer_is_monotonic(); // false if the clock fell back to gettimeofday, which timer_get_clock_ns then counts in
+u64  timer_get_clock_ns(double time); // the CLOCK_MONOTONIC time of a timer_get_time(), for absolute OS timers
@@ -117,9 +117,9 @@ Matrix4f* get_world_transform()
 Matrix4f* get_wvp_transform()
 {
     Vector3f camera_pos = {
-        camera.position.x + camera.player_offset.x,
-        camera.position.y + camera.player_offset.y,
-        camera.position.z + camera.player_offset.z
+        view_camera->position.x + view_camera->player_offset.x,
+        view_camera->position.y + view_camera->player_offset.y,
+        view_camera->position.z + view_camera->player_offset.z
     };
 
     get_scale_transform(&scale_trans);
@@ -145,9 +145,9 @@ Matrix4f* get_wvp_transform()
 Matrix4f* get_vp_transform()
 {
     Vector3f camera_pos = {
-        camera.position.x + camera.player_offset.x,
-        camera.position.y + camera.player_offset.y,
-        camera.position.z + camera.player_offset.z
+        view_camera->position.x + view_camera->player_offset.x,
+        view_camera->position.y + view_camera->player_offset.y,
+        view_camera->position.z + view_camera->player_offset.z
     };
 
     get_perspective_transform(&perspective_trans);
@@ -4,6 +4,7 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 
+#include "util.h"
 #include "settings.h"
 #include "math3d.h"
 #include "window.h"
@@ -134,6 +135,8 @@ static void mouse_button_callback(GLFWwindow* window, int button, int action, in
             int mode = glfwGetInputMode(window,GLFW_CURSOR);
             if(mode == GLFW_CURSOR_NORMAL)
                 glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+            else
+                player.key_fire = true;
         }
     }
 }